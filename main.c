@@ -594,3 +594,9652 @@ int main(int argc, char* argv[]) {
   test_eval5();
   printf("%d\n", eval_string4(argv[1]));
 }
+
+// eval_string4 finally works, but every node it builds is malloc'd one at a time
+// and never freed, so calling it in a loop leaks without bound. rather than
+// freeing trees node by node, let's give the parser an arena: a bump allocator that
+// hands out memory from big blocks and can be reset with a single call once
+// we're done evaluating.
+
+struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t used;
+  size_t cap;
+};
+
+struct Arena {
+  struct ArenaBlock* first;
+  // the block we're currently bumping through
+  struct ArenaBlock* current;
+};
+
+// blocks start at 64K and double from there
+size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+// keep the memory in each block 16-byte aligned
+size_t ARENA_HEADER = (sizeof(struct ArenaBlock) + 15) & ~(size_t)15;
+
+struct Arena arena_init(void) {
+  struct Arena a;
+  a.first = NULL;
+  a.current = NULL;
+  return a;
+}
+
+struct ArenaBlock* arena_new_block(size_t cap) {
+  struct ArenaBlock* b = malloc(ARENA_HEADER + cap);
+  if (b == NULL) {
+    fprintf(stderr, "arena: out of memory\n");
+    exit(1);
+  }
+  b->next = NULL;
+  b->used = 0;
+  b->cap = cap;
+  return b;
+}
+
+void* arena_alloc(struct Arena* a, size_t n) {
+  n = (n + 15) & ~(size_t)15;
+
+  // after a reset, `current` may be followed by blocks we allocated last time
+  // around, so walk forward through those before asking malloc for more
+  while (a->current != NULL) {
+    struct ArenaBlock* b = a->current;
+    if (b->cap - b->used >= n) {
+      void* r = (char*)b + ARENA_HEADER + b->used;
+      b->used += n;
+      return r;
+    }
+    if (b->next == NULL) {
+      break;
+    }
+    a->current = b->next;
+  }
+
+  size_t cap = a->current == NULL ? ARENA_BLOCK_SIZE : a->current->cap * 2;
+  if (cap < n) {
+    cap = n;
+  }
+  struct ArenaBlock* b = arena_new_block(cap);
+  if (a->current == NULL) {
+    a->first = b;
+  } else {
+    a->current->next = b;
+  }
+  a->current = b;
+  b->used = n;
+  return (char*)b + ARENA_HEADER;
+}
+
+// resetting keeps all the blocks around, so once the arena has grown to fit the
+// biggest expression we've seen, it never needs to call malloc again
+void arena_reset(struct Arena* a) {
+  for (struct ArenaBlock* b = a->first; b != NULL; b = b->next) {
+    b->used = 0;
+  }
+  a->current = a->first;
+}
+
+void arena_free(struct Arena* a) {
+  struct ArenaBlock* b = a->first;
+  while (b != NULL) {
+    struct ArenaBlock* next = b->next;
+    free(b);
+    b = next;
+  }
+  a->first = NULL;
+  a->current = NULL;
+}
+
+// arena versions of binary_node and leaf_node
+// (leaf_node never set `op`, which we'll want to rely on eventually, so set it
+// to 0 here)
+
+struct Tree* arena_binary_node(struct Arena* a, char op, struct Tree* left, struct Tree* right) {
+  struct Tree* r = arena_alloc(a, sizeof *r);
+  r->left = left;
+  r->right = right;
+  r->value = 0;
+  r->op = op;
+  return r;
+}
+
+struct Tree* arena_leaf_node(struct Arena* a, int x) {
+  struct Tree* r = arena_alloc(a, sizeof *r);
+  r->left = NULL;
+  r->right = NULL;
+  r->value = x;
+  r->op = 0;
+  return r;
+}
+
+// the parser needs to know which arena to allocate from. we can't add a field to
+// struct Parser, but we can wrap it.
+
+struct Parser2 {
+  struct Parser p;
+  struct Arena* arena;
+};
+
+struct Tree* match_binary_expression4(struct Parser2* p);
+
+struct Tree* match_expression4(struct Parser2* p) {
+  struct Token t = parser_current(&p->p);
+  if (t.t == TOKEN_LPAREN) {
+    return match_binary_expression4(p);
+  } else if (t.t == TOKEN_NUM) {
+    parser_advance(&p->p);
+    return arena_leaf_node(p->arena, strtol(t.s, NULL, 10));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_binary_expression4(struct Parser2* p) {
+  consume2(&p->p, TOKEN_LPAREN);
+  struct Token t = parser_current(&p->p);
+  if (!is_op_token(t.t)) {
+    parser_bail("expected op");
+  }
+  parser_advance(&p->p);
+  struct Tree* left = match_expression4(p);
+  struct Tree* right = match_expression4(p);
+  consume2(&p->p, TOKEN_RPAREN);
+  return arena_binary_node(p->arena, *t.s, left, right);
+}
+
+struct Tree* parser_parse5(struct Parser2* p) {
+  struct Tree* r = match_expression4(p);
+  if (!parser_done(&p->p)) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// evaluate using the given arena, and reset it afterwards so the memory gets
+// reused by the next call
+int eval_string_in(struct Arena* a, const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser2 pr;
+  pr.p = parser_init(&tz);
+  pr.arena = a;
+  struct Tree* tr = parser_parse5(&pr);
+  int r = eval2(tr);
+  arena_reset(a);
+  return r;
+}
+
+struct Arena EVAL_ARENA = { NULL, NULL };
+
+int eval_string5(const char* s) {
+  return eval_string_in(&EVAL_ARENA, s);
+}
+
+// we should test this, but there's a problem: main() is the last thing in the
+// file, so it can't call anything we append after it. fortunately gcc lets us
+// mark functions as constructors, which run before main, and glibc passes them
+// the same argc/argv that main gets. so we can keep a registry of tests and
+// command-line modes, and have a constructor dispatch on argv[1] before main ever
+// sees it.
+
+// assert_int_eq doesn't remember failures, so here's one that does
+int TEST_FAILURES = 0;
+
+void assert_int_eq2(int actual, int expected) {
+  if (actual != expected) {
+    printf("assertion failure: expected %d, got %d\n", expected, actual);
+    TEST_FAILURES++;
+  }
+}
+
+struct Test {
+  const char* name;
+  void (*f)(void);
+};
+
+struct Command {
+  const char* name;
+  int (*run)(int argc, char** argv);
+};
+
+struct Test TESTS[256];
+int NUM_TESTS = 0;
+
+struct Command COMMANDS[64];
+int NUM_COMMANDS = 0;
+
+void register_test(const char* name, void (*f)(void)) {
+  TESTS[NUM_TESTS].name = name;
+  TESTS[NUM_TESTS].f = f;
+  NUM_TESTS++;
+}
+
+void register_command(const char* name, int (*run)(int argc, char** argv)) {
+  COMMANDS[NUM_COMMANDS].name = name;
+  COMMANDS[NUM_COMMANDS].run = run;
+  NUM_COMMANDS++;
+}
+
+// registration happens in constructors with priority 101, which run (in the
+// order they appear in the file) before dispatch_command below, which has the
+// default priority.
+//
+// commands are searched newest-first, so registering a name again later in the
+// file replaces the old version -- handy, since we can't edit the old one.
+
+__attribute__((constructor)) void dispatch_command(int argc, char** argv) {
+  if (argc < 2) {
+    return;
+  }
+  for (int i = NUM_COMMANDS - 1; i >= 0; i--) {
+    if (strcmp(argv[1], COMMANDS[i].name) == 0) {
+      fflush(stdout);
+      exit(COMMANDS[i].run(argc, argv));
+    }
+  }
+}
+
+int run_self_test(int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+  // the original tests (test_eval1 through test_eval3 use the broken
+  // eval_string/eval_string2/eval_string3, so leave those out)
+  test_tokenizer1();
+  test_eval4();
+  test_eval5();
+  for (int i = 0; i < NUM_TESTS; i++) {
+    int before = TEST_FAILURES;
+    TESTS[i].f();
+    if (TEST_FAILURES != before) {
+      printf("FAILED: %s\n", TESTS[i].name);
+    }
+  }
+  printf("%d tests, %d failures\n", NUM_TESTS + 3, TEST_FAILURES);
+  return TEST_FAILURES != 0;
+}
+
+void test_eval6() {
+  assert_int_eq2(eval_string5("(+ 1 2)"), 3);
+  assert_int_eq2(eval_string5("(* (- 7 4) (+ (/ 26 2) 1))"), 42);
+  assert_int_eq2(eval_string5("17"), 17);
+}
+
+// evaluating over and over shouldn't grow the arena
+int arena_num_blocks(struct Arena* a) {
+  int n = 0;
+  for (struct ArenaBlock* b = a->first; b != NULL; b = b->next) {
+    n++;
+  }
+  return n;
+}
+
+void test_arena1() {
+  struct Arena a = arena_init();
+  assert_int_eq2(eval_string_in(&a, "(- (* 6 7) (/ 10 5))"), 40);
+  int blocks = arena_num_blocks(&a);
+  for (int i = 0; i < 100000; i++) {
+    eval_string_in(&a, "(- (* 6 7) (/ 10 5))");
+  }
+  assert_int_eq2(arena_num_blocks(&a), blocks);
+  arena_free(&a);
+}
+
+// an expression big enough to need several blocks
+void test_arena2() {
+  int depth = 20000;
+  char* s = malloc(depth * 6 + 2);
+  size_t n = 0;
+  for (int i = 0; i < depth; i++) {
+    memcpy(s + n, "(+ 1 ", 5);
+    n += 5;
+  }
+  s[n++] = '1';
+  for (int i = 0; i < depth; i++) {
+    s[n++] = ')';
+  }
+  s[n] = '\0';
+
+  struct Arena a = arena_init();
+  assert_int_eq2(eval_string_in(&a, s), depth + 1);
+  assert_int_eq2(arena_num_blocks(&a) > 1, 1);
+  int blocks = arena_num_blocks(&a);
+  assert_int_eq2(eval_string_in(&a, s), depth + 1);
+  assert_int_eq2(arena_num_blocks(&a), blocks);
+  arena_free(&a);
+  free(s);
+}
+
+__attribute__((constructor(101))) void register_arena_tests() {
+  register_command("--self-test", run_self_test);
+  register_test("test_eval6", test_eval6);
+  register_test("test_arena1", test_arena1);
+  register_test("test_arena2", test_arena2);
+}
+
+// struct Tree is 32 bytes (two pointers, an int, a char, and padding), and the
+// nodes end up scattered all over the heap, so eval2 spends its time chasing
+// pointers. let's try an alternate layout where the nodes live in one contiguous
+// array and refer to their children by 32-bit index.
+
+#include <stdint.h>
+
+int FLAT_LEAF = 0;
+int FLAT_BINARY = 1;
+
+struct FlatNode {
+  // FLAT_LEAF or FLAT_BINARY, so we don't need `left != NULL` to tell them apart
+  unsigned char tag;
+  char op;
+  union {
+    struct {
+      uint32_t left;
+      uint32_t right;
+    } b;
+    int value;
+  } u;
+};
+
+struct FlatTree {
+  struct FlatNode* nodes;
+  uint32_t n;
+  uint32_t cap;
+  // scratch space for eval_flat, one slot per node
+  int* values;
+  uint32_t values_cap;
+};
+
+struct FlatTree flat_init(void) {
+  struct FlatTree ft;
+  ft.nodes = NULL;
+  ft.n = 0;
+  ft.cap = 0;
+  ft.values = NULL;
+  ft.values_cap = 0;
+  return ft;
+}
+
+void flat_free(struct FlatTree* ft) {
+  free(ft->nodes);
+  free(ft->values);
+  *ft = flat_init();
+}
+
+uint32_t flat_push(struct FlatTree* ft, struct FlatNode node) {
+  if (ft->n == ft->cap) {
+    ft->cap = ft->cap == 0 ? 64 : ft->cap * 2;
+    ft->nodes = realloc(ft->nodes, ft->cap * sizeof *ft->nodes);
+    if (ft->nodes == NULL) {
+      fprintf(stderr, "flat: out of memory\n");
+      exit(1);
+    }
+  }
+  ft->nodes[ft->n] = node;
+  return ft->n++;
+}
+
+uint32_t flat_leaf_node(struct FlatTree* ft, int x) {
+  struct FlatNode node;
+  node.tag = FLAT_LEAF;
+  node.op = 0;
+  node.u.value = x;
+  return flat_push(ft, node);
+}
+
+uint32_t flat_binary_node(struct FlatTree* ft, char op, uint32_t left, uint32_t right) {
+  struct FlatNode node;
+  node.tag = FLAT_BINARY;
+  node.op = op;
+  node.u.b.left = left;
+  node.u.b.right = right;
+  return flat_push(ft, node);
+}
+
+// the parser is the same as match_expression3, except it appends nodes to the
+// array. since children are always pushed before their parent, the array ends up
+// in postorder and the root is the last node.
+
+uint32_t match_flat_binary_expression(struct Parser* p, struct FlatTree* ft);
+
+uint32_t match_flat_expression(struct Parser* p, struct FlatTree* ft) {
+  struct Token t = parser_current(p);
+  if (t.t == TOKEN_LPAREN) {
+    return match_flat_binary_expression(p, ft);
+  } else if (t.t == TOKEN_NUM) {
+    parser_advance(p);
+    return flat_leaf_node(ft, strtol(t.s, NULL, 10));
+  } else {
+    parser_bail("expected expression");
+    return 0;
+  }
+}
+
+uint32_t match_flat_binary_expression(struct Parser* p, struct FlatTree* ft) {
+  consume2(p, TOKEN_LPAREN);
+  struct Token t = parser_current(p);
+  if (!is_op_token(t.t)) {
+    parser_bail("expected op");
+  }
+  parser_advance(p);
+  uint32_t left = match_flat_expression(p, ft);
+  uint32_t right = match_flat_expression(p, ft);
+  consume2(p, TOKEN_RPAREN);
+  return flat_binary_node(ft, *t.s, left, right);
+}
+
+// the flat counterpart of parser_parse4. any nodes already in `ft` are thrown
+// away, so the same FlatTree can be reused for parse after parse.
+uint32_t parser_parse_flat(struct Parser* p, struct FlatTree* ft) {
+  ft->n = 0;
+  uint32_t r = match_flat_expression(p, ft);
+  if (!parser_done(p)) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// because the nodes are in postorder, we don't need to recurse at all: walk the
+// array front to back, and each node's children have already been computed.
+int eval_flat(struct FlatTree* ft, uint32_t root) {
+  if (ft->values_cap < ft->n) {
+    free(ft->values);
+    ft->values_cap = ft->cap;
+    ft->values = malloc(ft->values_cap * sizeof *ft->values);
+    if (ft->values == NULL) {
+      fprintf(stderr, "flat: out of memory\n");
+      exit(1);
+    }
+  }
+
+  struct FlatNode* nodes = ft->nodes;
+  int* values = ft->values;
+  for (uint32_t i = 0; i <= root; i++) {
+    struct FlatNode node = nodes[i];
+    if (node.tag == FLAT_LEAF) {
+      values[i] = node.u.value;
+      continue;
+    }
+    int left = values[node.u.b.left];
+    int right = values[node.u.b.right];
+    switch (node.op) {
+      case '+': values[i] = left + right; break;
+      case '-': values[i] = left - right; break;
+      case '*': values[i] = left * right; break;
+      case '/': values[i] = left / right; break;
+      // should never happen (same as eval_binary)
+      default: values[i] = -1; break;
+    }
+  }
+  return values[root];
+}
+
+struct FlatTree EVAL_FLAT_TREE = { NULL, 0, 0, NULL, 0 };
+
+int eval_string_flat(const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser pr = parser_init(&tz);
+  uint32_t root = parser_parse_flat(&pr, &EVAL_FLAT_TREE);
+  return eval_flat(&EVAL_FLAT_TREE, root);
+}
+
+void test_flat1() {
+  assert_int_eq2(sizeof(struct FlatNode), 12);
+  assert_int_eq2(eval_string_flat("(+ 1 2)"), 3);
+  assert_int_eq2(eval_string_flat("(* (- 7 4) (+ (/ 26 2) 1))"), 42);
+  assert_int_eq2(eval_string_flat("5"), 5);
+}
+
+// should agree with eval_string4, including on lopsided trees
+void test_flat2() {
+  const char* exprs[] = {
+    "(- 100 (- 50 (- 25 5)))",
+    "(/ (/ (/ 1000 2) 5) 3)",
+    "(* (+ 1 (* 2 3)) (- (/ 81 9) (+ 4 (- 2 10))))",
+  };
+  for (size_t i = 0; i < sizeof exprs / sizeof exprs[0]; i++) {
+    assert_int_eq2(eval_string_flat(exprs[i]), eval_string4(exprs[i]));
+  }
+}
+
+__attribute__((constructor(101))) void register_flat_tests() {
+  register_test("test_flat1", test_flat1);
+  register_test("test_flat2", test_flat2);
+}
+
+// when the same formula gets evaluated over and over, it's a waste to walk the
+// tree every time. instead, compile it once into postfix bytecode and run that on
+// a little stack machine.
+
+// the opcodes need to be compile-time constants so the VM can switch on them, so
+// unlike the token types, make them an enum
+enum {
+  OP_PUSH_CONST,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_RET,
+};
+
+struct Program {
+  // each instruction is an opcode, and OP_PUSH_CONST is followed by its operand
+  int* code;
+  size_t n;
+  size_t cap;
+  // how deep the VM stack will get, so vm_run can size it up front
+  int max_stack;
+};
+
+struct Program* program_new(void) {
+  struct Program* prog = malloc(sizeof *prog);
+  prog->code = NULL;
+  prog->n = 0;
+  prog->cap = 0;
+  prog->max_stack = 0;
+  return prog;
+}
+
+void program_free(struct Program* prog) {
+  free(prog->code);
+  free(prog);
+}
+
+void program_emit(struct Program* prog, int x) {
+  if (prog->n == prog->cap) {
+    prog->cap = prog->cap == 0 ? 64 : prog->cap * 2;
+    prog->code = realloc(prog->code, prog->cap * sizeof *prog->code);
+    if (prog->code == NULL) {
+      fprintf(stderr, "compiler: out of memory\n");
+      exit(1);
+    }
+  }
+  prog->code[prog->n++] = x;
+}
+
+int op_to_opcode(char op) {
+  if (op == '+') {
+    return OP_ADD;
+  } else if (op == '-') {
+    return OP_SUB;
+  } else if (op == '*') {
+    return OP_MUL;
+  } else {
+    return OP_DIV;
+  }
+}
+
+// `depth` is how many values are already on the stack when this subtree starts
+void compile_tree(struct Program* prog, struct Tree* tr, int depth) {
+  if (tr->left == NULL) {
+    program_emit(prog, OP_PUSH_CONST);
+    program_emit(prog, tr->value);
+    if (depth + 1 > prog->max_stack) {
+      prog->max_stack = depth + 1;
+    }
+  } else {
+    compile_tree(prog, tr->left, depth);
+    compile_tree(prog, tr->right, depth + 1);
+    program_emit(prog, op_to_opcode(tr->op));
+  }
+}
+
+struct Program* compile(struct Tree* tr) {
+  struct Program* prog = program_new();
+  compile_tree(prog, tr, 0);
+  program_emit(prog, OP_RET);
+  return prog;
+}
+
+int VM_SMALL_STACK = 256;
+
+int vm_run(const struct Program* prog) {
+  int small[256];
+  int* stack = small;
+  if (prog->max_stack > VM_SMALL_STACK) {
+    stack = malloc(prog->max_stack * sizeof *stack);
+  }
+  int* sp = stack;
+  const int* pc = prog->code;
+  int r;
+
+#ifdef __GNUC__
+  // gcc and clang support computed goto, which gives each opcode its own
+  // indirect jump instead of funneling everything through one switch
+  static void* labels[] = {
+    &&do_push_const, &&do_add, &&do_sub, &&do_mul, &&do_div, &&do_ret,
+  };
+#define VM_NEXT() goto *labels[*pc++]
+  VM_NEXT();
+do_push_const:
+  *sp++ = *pc++;
+  VM_NEXT();
+do_add:
+  sp--;
+  sp[-1] = sp[-1] + sp[0];
+  VM_NEXT();
+do_sub:
+  sp--;
+  sp[-1] = sp[-1] - sp[0];
+  VM_NEXT();
+do_mul:
+  sp--;
+  sp[-1] = sp[-1] * sp[0];
+  VM_NEXT();
+do_div:
+  sp--;
+  sp[-1] = sp[-1] / sp[0];
+  VM_NEXT();
+do_ret:
+  r = sp[-1];
+#undef VM_NEXT
+#else
+  for (;;) {
+    switch (*pc++) {
+      case OP_PUSH_CONST: *sp++ = *pc++; continue;
+      case OP_ADD: sp--; sp[-1] = sp[-1] + sp[0]; continue;
+      case OP_SUB: sp--; sp[-1] = sp[-1] - sp[0]; continue;
+      case OP_MUL: sp--; sp[-1] = sp[-1] * sp[0]; continue;
+      case OP_DIV: sp--; sp[-1] = sp[-1] / sp[0]; continue;
+    }
+    r = sp[-1];
+    break;
+  }
+#endif
+
+  if (stack != small) {
+    free(stack);
+  }
+  return r;
+}
+
+// parse into a scratch arena, compile, and throw the tree away. eval_string4
+// stays around as the reference implementation.
+
+struct Arena COMPILE_ARENA = { NULL, NULL };
+
+struct Program* compile_string(const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser2 pr;
+  pr.p = parser_init(&tz);
+  pr.arena = &COMPILE_ARENA;
+  struct Program* prog = compile(parser_parse5(&pr));
+  arena_reset(&COMPILE_ARENA);
+  return prog;
+}
+
+void test_vm1() {
+  struct Program* prog = compile_string("(* (- 7 4) (+ (/ 26 2) 1))");
+  assert_int_eq2(vm_run(prog), 42);
+  // running it again should give the same answer
+  assert_int_eq2(vm_run(prog), 42);
+  program_free(prog);
+
+  prog = compile_string("9");
+  assert_int_eq2(vm_run(prog), 9);
+  assert_int_eq2(prog->max_stack, 1);
+  program_free(prog);
+}
+
+void test_vm2() {
+  const char* exprs[] = {
+    "(- 100 (- 50 (- 25 5)))",
+    "(/ (/ (/ 1000 2) 5) 3)",
+    "(/ (- 0 7) 2)",
+    "(* (+ 1 (* 2 3)) (- (/ 81 9) (+ 4 (- 2 10))))",
+  };
+  for (size_t i = 0; i < sizeof exprs / sizeof exprs[0]; i++) {
+    struct Program* prog = compile_string(exprs[i]);
+    assert_int_eq2(vm_run(prog), eval_string4(exprs[i]));
+    program_free(prog);
+  }
+}
+
+// a right-leaning tree needs a stack bigger than the on-stack buffer
+void test_vm3() {
+  int depth = 1000;
+  char* s = malloc(depth * 6 + 2);
+  size_t n = 0;
+  for (int i = 0; i < depth; i++) {
+    memcpy(s + n, "(+ 1 ", 5);
+    n += 5;
+  }
+  s[n++] = '1';
+  for (int i = 0; i < depth; i++) {
+    s[n++] = ')';
+  }
+  s[n] = '\0';
+
+  struct Program* prog = compile_string(s);
+  assert_int_eq2(prog->max_stack, depth + 1);
+  assert_int_eq2(vm_run(prog), depth + 1);
+  program_free(prog);
+  free(s);
+}
+
+__attribute__((constructor(101))) void register_vm_tests() {
+  register_test("test_vm1", test_vm1);
+  register_test("test_vm2", test_vm2);
+  register_test("test_vm3", test_vm3);
+}
+
+// in practice the same few expressions get evaluated over and over, and each time
+// we tokenize and parse them from scratch. let's cache compiled programs, keyed on
+// the source text. the cache is bounded, and evicts the least recently used
+// entry when it fills up.
+
+struct CacheEntry {
+  char* key;
+  size_t keylen;
+  uint64_t hash;
+  struct Program* prog;
+  // how many times this entry has been looked up, so we can tell which
+  // expressions are hot
+  unsigned long uses;
+  // next entry in the same hash bucket
+  struct CacheEntry* chain;
+  // neighbors in the LRU list (prev is more recently used)
+  struct CacheEntry* prev;
+  struct CacheEntry* next;
+};
+
+struct ExprCache {
+  struct CacheEntry** buckets;
+  size_t nbuckets;
+  size_t size;
+  size_t capacity;
+  // most and least recently used entries
+  struct CacheEntry* head;
+  struct CacheEntry* tail;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+// a cache needs room for at least one entry (cache_lookup evicts before it
+// inserts), so a capacity of 0 is rejected with NULL
+struct ExprCache* cache_new(size_t capacity) {
+  if (capacity == 0) {
+    return NULL;
+  }
+  struct ExprCache* c = malloc(sizeof *c);
+  // keep the load factor at or below 1/2
+  c->nbuckets = 16;
+  while (c->nbuckets < capacity * 2) {
+    c->nbuckets *= 2;
+  }
+  c->buckets = calloc(c->nbuckets, sizeof *c->buckets);
+  c->size = 0;
+  c->capacity = capacity;
+  c->head = NULL;
+  c->tail = NULL;
+  c->hits = 0;
+  c->misses = 0;
+  c->evictions = 0;
+  return c;
+}
+
+void cache_free(struct ExprCache* c) {
+  struct CacheEntry* e = c->head;
+  while (e != NULL) {
+    struct CacheEntry* next = e->next;
+    program_free(e->prog);
+    free(e->key);
+    free(e);
+    e = next;
+  }
+  free(c->buckets);
+  free(c);
+}
+
+// FNV-1a. computes the length as it goes, so we only scan the key once.
+uint64_t hash_string(const char* s, size_t* len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t n = 0;
+  while (s[n] != '\0') {
+    h ^= (unsigned char)s[n];
+    h *= 1099511628211ULL;
+    n++;
+  }
+  *len = n;
+  return h;
+}
+
+void cache_unlink_lru(struct ExprCache* c, struct CacheEntry* e) {
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    c->head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    c->tail = e->prev;
+  }
+}
+
+void cache_push_front(struct ExprCache* c, struct CacheEntry* e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head != NULL) {
+    c->head->prev = e;
+  }
+  c->head = e;
+  if (c->tail == NULL) {
+    c->tail = e;
+  }
+}
+
+void cache_evict(struct ExprCache* c) {
+  struct CacheEntry* e = c->tail;
+  cache_unlink_lru(c, e);
+  struct CacheEntry** pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+  while (*pp != e) {
+    pp = &(*pp)->chain;
+  }
+  *pp = e->chain;
+  program_free(e->prog);
+  free(e->key);
+  free(e);
+  c->size--;
+  c->evictions++;
+}
+
+struct CacheEntry* cache_lookup(struct ExprCache* c, const char* s) {
+  size_t n;
+  uint64_t h = hash_string(s, &n);
+  struct CacheEntry** bucket = &c->buckets[h & (c->nbuckets - 1)];
+  for (struct CacheEntry* e = *bucket; e != NULL; e = e->chain) {
+    if (e->hash == h && e->keylen == n && memcmp(e->key, s, n) == 0) {
+      c->hits++;
+      e->uses++;
+      if (e != c->head) {
+        cache_unlink_lru(c, e);
+        cache_push_front(c, e);
+      }
+      return e;
+    }
+  }
+
+  c->misses++;
+  if (c->size >= c->capacity) {
+    cache_evict(c);
+  }
+  struct CacheEntry* e = malloc(sizeof *e);
+  e->key = malloc(n + 1);
+  memcpy(e->key, s, n + 1);
+  e->keylen = n;
+  e->hash = h;
+  e->prog = compile_string(s);
+  e->uses = 1;
+  e->chain = *bucket;
+  *bucket = e;
+  cache_push_front(c, e);
+  c->size++;
+  return e;
+}
+
+struct Program* cache_get(struct ExprCache* c, const char* s) {
+  return cache_lookup(c, s)->prog;
+}
+
+int eval_string_cached(struct ExprCache* c, const char* s) {
+  return vm_run(cache_get(c, s));
+}
+
+void test_cache1() {
+  struct ExprCache* c = cache_new(4);
+  assert_int_eq2(eval_string_cached(c, "(+ 1 2)"), 3);
+  assert_int_eq2(eval_string_cached(c, "(+ 1 2)"), 3);
+  assert_int_eq2(eval_string_cached(c, "(* (- 7 4) (+ (/ 26 2) 1))"), 42);
+  assert_int_eq2(c->hits, 1);
+  assert_int_eq2(c->misses, 2);
+  assert_int_eq2(cache_lookup(c, "(+ 1 2)")->uses, 3);
+  cache_free(c);
+}
+
+void test_cache2() {
+  struct ExprCache* c = cache_new(2);
+  eval_string_cached(c, "1");
+  eval_string_cached(c, "2");
+  // touch "1" so that "2" is the least recently used
+  eval_string_cached(c, "1");
+  eval_string_cached(c, "3");
+  assert_int_eq2(c->size, 2);
+  assert_int_eq2(c->evictions, 1);
+
+  unsigned long misses = c->misses;
+  assert_int_eq2(eval_string_cached(c, "1"), 1);
+  assert_int_eq2(c->misses, misses);
+  assert_int_eq2(eval_string_cached(c, "2"), 2);
+  assert_int_eq2(c->misses, misses + 1);
+  cache_free(c);
+
+  assert_int_eq2(cache_new(0) == NULL, 1);
+}
+
+__attribute__((constructor(101))) void register_cache_tests() {
+  register_test("test_cache1", test_cache1);
+  register_test("test_cache2", test_cache2);
+}
+
+// every expression we can parse right now is made entirely of integer literals,
+// so any subtree can be folded down to a single leaf ahead of time. do that in
+// place after parsing, handing the nodes we no longer need to `discard`. that's
+// free() for trees from parser_parse4, or NULL for arena trees, which get thrown
+// away wholesale anyway.
+//
+// for now, every leaf counts as constant. once there are other kinds of leaves,
+// this will need a new version that only folds the constant parts.
+
+int apply_op(char op, int left, int right) {
+  if (op == '+') {
+    return left + right;
+  } else if (op == '-') {
+    return left - right;
+  } else if (op == '*') {
+    return left * right;
+  } else if (op == '/') {
+    return left / right;
+  } else {
+    // should never happen (same as eval_binary)
+    return -1;
+  }
+}
+
+void fold_constants(struct Tree* tr, void (*discard)(struct Tree*)) {
+  if (tr->left == NULL) {
+    return;
+  }
+  fold_constants(tr->left, discard);
+  fold_constants(tr->right, discard);
+  // both children are leaves by now
+  int value = apply_op(tr->op, tr->left->value, tr->right->value);
+  if (discard != NULL) {
+    discard(tr->left);
+    discard(tr->right);
+  }
+  tr->left = NULL;
+  tr->right = NULL;
+  tr->value = value;
+  tr->op = 0;
+}
+
+void discard_heap_node(struct Tree* tr) {
+  free(tr);
+}
+
+// parse_and_fold returns a single heap-allocated leaf, which makes a cached
+// expression O(1) to re-evaluate with eval2
+struct Tree* parse_and_fold(const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser pr = parser_init(&tz);
+  struct Tree* tr = parser_parse4(&pr);
+  fold_constants(tr, discard_heap_node);
+  return tr;
+}
+
+// the compiler can fold too, so that a folded program is a single PUSH_CONST
+struct Program* compile_string_folded(const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser2 pr;
+  pr.p = parser_init(&tz);
+  pr.arena = &COMPILE_ARENA;
+  struct Tree* tr = parser_parse5(&pr);
+  fold_constants(tr, NULL);
+  struct Program* prog = compile(tr);
+  arena_reset(&COMPILE_ARENA);
+  return prog;
+}
+
+void test_fold1() {
+  struct Tree* tr = parse_and_fold("(* (- 7 4) (+ (/ 26 2) 1))");
+  assert_int_eq2(tr->left == NULL, 1);
+  assert_int_eq2(eval2(tr), 42);
+  free(tr);
+
+  tr = parse_and_fold("3");
+  assert_int_eq2(eval2(tr), 3);
+  free(tr);
+}
+
+void test_fold2() {
+  const char* exprs[] = {
+    "(- 100 (- 50 (- 25 5)))",
+    "(/ (/ (/ 1000 2) 5) 3)",
+    "(* (+ 1 (* 2 3)) (- (/ 81 9) (+ 4 (- 2 10))))",
+  };
+  for (size_t i = 0; i < sizeof exprs / sizeof exprs[0]; i++) {
+    struct Program* prog = compile_string_folded(exprs[i]);
+    // PUSH_CONST, value, RET
+    assert_int_eq2(prog->n, 3);
+    assert_int_eq2(vm_run(prog), eval_string4(exprs[i]));
+    program_free(prog);
+  }
+}
+
+__attribute__((constructor(101))) void register_fold_tests() {
+  register_test("test_fold1", test_fold1);
+  register_test("test_fold2", test_fold2);
+}
+
+// the parser and evaluator are both recursive, so an expression nested deeply
+// enough (which machine-generated ones can be) blows the C stack. here are
+// non-recursive versions that keep their state on a heap-allocated stack instead.
+
+struct ParseFrame {
+  char op;
+  // NULL until the left operand has been parsed
+  struct Tree* left;
+};
+
+struct Tree* parse_iterative(struct Parser2* p) {
+  size_t cap = 64;
+  size_t n = 0;
+  struct ParseFrame* stack = malloc(cap * sizeof *stack);
+  struct Tree* result;
+
+  for (;;) {
+    // parse the start of an expression: either a number, or an opening paren and
+    // operator, in which case we go around again for the left operand
+    struct Token t = parser_current(&p->p);
+    if (t.t == TOKEN_LPAREN) {
+      parser_advance(&p->p);
+      struct Token op = parser_current(&p->p);
+      if (!is_op_token(op.t)) {
+        parser_bail("expected op");
+      }
+      parser_advance(&p->p);
+      if (n == cap) {
+        cap *= 2;
+        stack = realloc(stack, cap * sizeof *stack);
+      }
+      stack[n].op = *op.s;
+      stack[n].left = NULL;
+      n++;
+      continue;
+    } else if (t.t == TOKEN_NUM) {
+      parser_advance(&p->p);
+      result = arena_leaf_node(p->arena, strtol(t.s, NULL, 10));
+    } else {
+      parser_bail("expected expression");
+    }
+
+    // we've finished an expression, so hand it to whoever is waiting on it. if
+    // the innermost open expression already has its left operand, this completes
+    // it, which may complete the one outside it, and so on.
+    while (n > 0 && stack[n - 1].left != NULL) {
+      consume2(&p->p, TOKEN_RPAREN);
+      n--;
+      result = arena_binary_node(p->arena, stack[n].op, stack[n].left, result);
+    }
+    if (n == 0) {
+      break;
+    }
+    stack[n - 1].left = result;
+  }
+
+  free(stack);
+  if (!parser_done(&p->p)) {
+    parser_bail("trailing input");
+  }
+  return result;
+}
+
+struct EvalFrame {
+  struct Tree* tr;
+  // 0 = nothing evaluated yet, 1 = left operand evaluated, 2 = both
+  int state;
+};
+
+int eval_iterative(struct Tree* root) {
+  size_t cap = 64;
+  size_t n = 0;
+  struct EvalFrame* frames = malloc(cap * sizeof *frames);
+  size_t vcap = 64;
+  size_t vn = 0;
+  int* values = malloc(vcap * sizeof *values);
+
+  frames[n].tr = root;
+  frames[n].state = 0;
+  n++;
+  while (n > 0) {
+    struct EvalFrame* f = &frames[n - 1];
+    if (f->tr->left == NULL || f->state == 2) {
+      int v;
+      if (f->tr->left == NULL) {
+        v = f->tr->value;
+      } else {
+        int right = values[--vn];
+        int left = values[--vn];
+        v = apply_op(f->tr->op, left, right);
+      }
+      if (vn == vcap) {
+        vcap *= 2;
+        values = realloc(values, vcap * sizeof *values);
+      }
+      values[vn++] = v;
+      n--;
+      continue;
+    }
+
+    struct Tree* child = f->state == 0 ? f->tr->left : f->tr->right;
+    f->state++;
+    if (n == cap) {
+      cap *= 2;
+      frames = realloc(frames, cap * sizeof *frames);
+    }
+    frames[n].tr = child;
+    frames[n].state = 0;
+    n++;
+  }
+
+  int r = values[0];
+  free(frames);
+  free(values);
+  return r;
+}
+
+int eval_string_iterative(struct Arena* a, const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser2 pr;
+  pr.p = parser_init(&tz);
+  pr.arena = a;
+  int r = eval_iterative(parse_iterative(&pr));
+  arena_reset(a);
+  return r;
+}
+
+// I keep writing loops to build deep expressions in tests, so here's a helper.
+// builds (+ 1 (+ 1 ... 1)) if right_leaning, otherwise (+ (+ (... 1) 1) 1).
+// the result has depth + 1 leaves, so it evaluates to depth + 1.
+char* make_deep_expression(int depth, int right_leaning) {
+  char* s = malloc((size_t)depth * 8 + 2);
+  size_t n = 0;
+  for (int i = 0; i < depth; i++) {
+    if (right_leaning) {
+      memcpy(s + n, "(+ 1 ", 5);
+      n += 5;
+    } else {
+      memcpy(s + n, "(+ ", 3);
+      n += 3;
+    }
+  }
+  s[n++] = '1';
+  for (int i = 0; i < depth; i++) {
+    if (right_leaning) {
+      s[n++] = ')';
+    } else {
+      memcpy(s + n, " 1)", 3);
+      n += 3;
+    }
+  }
+  s[n] = '\0';
+  return s;
+}
+
+void test_iterative1() {
+  struct Arena a = arena_init();
+  const char* exprs[] = {
+    "7",
+    "(+ 1 2)",
+    "(* (- 7 4) (+ (/ 26 2) 1))",
+    "(- 100 (- 50 (- 25 5)))",
+    "(* (+ 1 (* 2 3)) (- (/ 81 9) (+ 4 (- 2 10))))",
+  };
+  for (size_t i = 0; i < sizeof exprs / sizeof exprs[0]; i++) {
+    assert_int_eq2(eval_string_iterative(&a, exprs[i]), eval_string4(exprs[i]));
+  }
+  arena_free(&a);
+}
+
+// deep enough that the recursive versions would overflow the stack
+void test_iterative2() {
+  struct Arena a = arena_init();
+  for (int right = 0; right <= 1; right++) {
+    char* s = make_deep_expression(1000000, right);
+    assert_int_eq2(eval_string_iterative(&a, s), 1000001);
+    free(s);
+  }
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_iterative_tests() {
+  register_test("test_iterative1", test_iterative1);
+  register_test("test_iterative2", test_iterative2);
+}
+
+// next: evaluating big batches of independent expressions across every core. a
+// pool of worker threads splits the batch between them, and a worker that runs
+// out of work steals half of whatever another worker has left.
+//
+// is any of this safe to run concurrently? the tokenizer and parser keep all
+// their state on the stack, the TOKEN_* globals are only ever read, and each
+// worker gets its own arena. but EVAL_ARENA, EVAL_FLAT_TREE and COMPILE_ARENA
+// are shared, so workers must not use eval_string5, eval_string_flat, or
+// compile_string.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+struct WorkerPool;
+
+struct Worker {
+  struct WorkerPool* pool;
+  int id;
+  pthread_t thread;
+  struct Arena arena;
+  // the items this worker still has to do, packed as (lo << 32) | hi so that the
+  // owner and thieves can both update it with a single compare-and-swap
+  _Atomic uint64_t range;
+};
+
+struct WorkerPool {
+  struct Worker* workers;
+  int nworkers;
+
+  pthread_mutex_t lock;
+  // signaled when a new job is posted
+  pthread_cond_t job_posted;
+  // signaled when a worker finishes its part of a job
+  pthread_cond_t job_done;
+  // incremented for every job, so workers can tell a new job from a spurious
+  // wakeup
+  unsigned long generation;
+  int finished;
+  int shutdown;
+
+  // the current job
+  void (*task)(struct Worker*, size_t i, void* ctx);
+  void* ctx;
+  // held for the whole of pool_run, so that jobs from different threads take
+  // turns instead of overwriting each other
+  pthread_mutex_t run_lock;
+};
+
+// owners take this many items at a time
+uint32_t POOL_CHUNK = 64;
+
+uint64_t pack_range(uint32_t lo, uint32_t hi) {
+  return ((uint64_t)lo << 32) | hi;
+}
+
+// take up to `max` items from the front of w's range; returns how many were taken
+uint32_t worker_take(struct Worker* w, uint32_t max, uint32_t* start) {
+  uint64_t r = atomic_load(&w->range);
+  for (;;) {
+    uint32_t lo = r >> 32;
+    uint32_t hi = (uint32_t)r;
+    if (lo >= hi) {
+      return 0;
+    }
+    uint32_t k = hi - lo < max ? hi - lo : max;
+    if (atomic_compare_exchange_weak(&w->range, &r, pack_range(lo + k, hi))) {
+      *start = lo;
+      return k;
+    }
+  }
+}
+
+// steal the back half of the victim's range into the thief's own range (which is
+// empty, or we wouldn't be stealing)
+int worker_steal(struct Worker* thief, struct Worker* victim) {
+  uint64_t r = atomic_load(&victim->range);
+  for (;;) {
+    uint32_t lo = r >> 32;
+    uint32_t hi = (uint32_t)r;
+    if (lo >= hi) {
+      return 0;
+    }
+    uint32_t mid = hi - (hi - lo + 1) / 2;
+    if (atomic_compare_exchange_weak(&victim->range, &r, pack_range(lo, mid))) {
+      atomic_store(&thief->range, pack_range(mid, hi));
+      return 1;
+    }
+  }
+}
+
+void worker_run_job(struct Worker* w) {
+  struct WorkerPool* pool = w->pool;
+  for (;;) {
+    uint32_t start;
+    uint32_t k = worker_take(w, POOL_CHUNK, &start);
+    if (k > 0) {
+      for (uint32_t i = start; i < start + k; i++) {
+        pool->task(w, i, pool->ctx);
+      }
+      continue;
+    }
+
+    int stole = 0;
+    for (int j = 1; j < pool->nworkers && !stole; j++) {
+      stole = worker_steal(w, &pool->workers[(w->id + j) % pool->nworkers]);
+    }
+    if (!stole) {
+      return;
+    }
+  }
+}
+
+void* worker_main(void* arg) {
+  struct Worker* w = arg;
+  struct WorkerPool* pool = w->pool;
+  unsigned long seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->shutdown) {
+      pthread_cond_wait(&pool->job_posted, &pool->lock);
+    }
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    worker_run_job(w);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->finished++;
+    pthread_cond_signal(&pool->job_done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+int num_cpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int)n;
+}
+
+struct WorkerPool* pool_new(int nworkers) {
+  struct WorkerPool* pool = malloc(sizeof *pool);
+  pool->workers = calloc(nworkers, sizeof *pool->workers);
+  pool->nworkers = nworkers;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_mutex_init(&pool->run_lock, NULL);
+  pthread_cond_init(&pool->job_posted, NULL);
+  pthread_cond_init(&pool->job_done, NULL);
+  pool->generation = 0;
+  pool->finished = 0;
+  pool->shutdown = 0;
+  pool->task = NULL;
+  pool->ctx = NULL;
+  for (int i = 0; i < nworkers; i++) {
+    struct Worker* w = &pool->workers[i];
+    w->pool = pool;
+    w->id = i;
+    w->arena = arena_init();
+    atomic_init(&w->range, 0);
+    pthread_create(&w->thread, NULL, worker_main, w);
+  }
+  return pool;
+}
+
+void pool_free(struct WorkerPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->job_posted);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nworkers; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    arena_free(&pool->workers[i].arena);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->run_lock);
+  pthread_cond_destroy(&pool->job_posted);
+  pthread_cond_destroy(&pool->job_done);
+  free(pool->workers);
+  free(pool);
+}
+
+// run task(worker, i, ctx) for every i in [0, n), and wait for all of them. if
+// several threads call this on the same pool, their jobs run one after another.
+// n must fit in 32 bits.
+void pool_run(struct WorkerPool* pool, size_t n, void (*task)(struct Worker*, size_t, void*), void* ctx) {
+  pthread_mutex_lock(&pool->run_lock);
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->ctx = ctx;
+  pool->finished = 0;
+  int nw = pool->nworkers;
+  for (int i = 0; i < nw; i++) {
+    uint32_t lo = (uint32_t)(n * i / nw);
+    uint32_t hi = (uint32_t)(n * (i + 1) / nw);
+    atomic_store(&pool->workers[i].range, pack_range(lo, hi));
+  }
+  pool->generation++;
+  pthread_cond_broadcast(&pool->job_posted);
+  // every worker has to check in, not just the ones that did any work, or a
+  // straggler might go looking for work to steal in the next job
+  while (pool->finished < nw) {
+    pthread_cond_wait(&pool->job_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->run_lock);
+}
+
+struct BatchJob {
+  const char** exprs;
+  int* results;
+};
+
+void batch_task(struct Worker* w, size_t i, void* ctx) {
+  struct BatchJob* job = ctx;
+  job->results[i] = eval_string_in(&w->arena, job->exprs[i]);
+}
+
+void pool_eval_batch(struct WorkerPool* pool, const char** exprs, int* results, size_t n) {
+  struct BatchJob job;
+  job.exprs = exprs;
+  job.results = results;
+  pool_run(pool, n, batch_task, &job);
+}
+
+// a process-wide pool with one worker per core, created the first time it's
+// needed
+struct WorkerPool* DEFAULT_POOL = NULL;
+pthread_once_t DEFAULT_POOL_ONCE = PTHREAD_ONCE_INIT;
+
+void default_pool_init(void) {
+  DEFAULT_POOL = pool_new(num_cpus());
+}
+
+struct WorkerPool* default_pool(void) {
+  pthread_once(&DEFAULT_POOL_ONCE, default_pool_init);
+  return DEFAULT_POOL;
+}
+
+// the default pool only runs one batch at a time, so concurrent callers wait
+// their turn (or can make their own pools)
+void eval_batch(const char** exprs, int* results, size_t n) {
+  pool_eval_batch(default_pool(), exprs, results, n);
+}
+
+// usage: --batch EXPR...
+int run_batch(int argc, char** argv) {
+  size_t n = argc - 2;
+  int* results = malloc(n * sizeof *results);
+  eval_batch((const char**)argv + 2, results, n);
+  for (size_t i = 0; i < n; i++) {
+    printf("%d\n", results[i]);
+  }
+  free(results);
+  return 0;
+}
+
+void test_batch1() {
+  const char* exprs[] = {
+    "(+ 1 2)",
+    "(* (- 7 4) (+ (/ 26 2) 1))",
+    "5",
+  };
+  int results[3];
+  eval_batch(exprs, results, 3);
+  assert_int_eq2(results[0], 3);
+  assert_int_eq2(results[1], 42);
+  assert_int_eq2(results[2], 5);
+}
+
+// more workers than cores, and more items than chunks, so some stealing should
+// happen
+void test_batch2() {
+  size_t n = 20000;
+  const char* pattern[] = {
+    "(- 100 (- 50 (- 25 5)))",
+    "(/ (/ (/ 1000 2) 5) 3)",
+    "(* (+ 1 (* 2 3)) (- (/ 81 9) (+ 4 (- 2 10))))",
+    "(+ (+ (+ (+ 1 2) 3) 4) 5)",
+  };
+  const char** exprs = malloc(n * sizeof *exprs);
+  int* results = malloc(n * sizeof *results);
+  for (size_t i = 0; i < n; i++) {
+    exprs[i] = pattern[i % 4];
+  }
+  struct WorkerPool* pool = pool_new(2 * num_cpus());
+  for (int round = 0; round < 3; round++) {
+    memset(results, 0, n * sizeof *results);
+    pool_eval_batch(pool, exprs, results, n);
+    for (size_t i = 0; i < n; i++) {
+      assert_int_eq2(results[i], eval_string5(exprs[i]));
+    }
+  }
+  // an empty batch shouldn't hang
+  pool_eval_batch(pool, exprs, results, 0);
+  pool_free(pool);
+  free(exprs);
+  free(results);
+}
+
+struct ConcurrentBatch {
+  const char** exprs;
+  size_t n;
+  int mismatches;
+};
+
+void* concurrent_batch_thread(void* arg) {
+  struct ConcurrentBatch* cb = arg;
+  int* results = malloc(cb->n * sizeof *results);
+  for (int round = 0; round < 20; round++) {
+    eval_batch(cb->exprs, results, cb->n);
+    for (size_t i = 0; i < cb->n; i++) {
+      cb->mismatches += results[i] != (int)(i % 7) + 1;
+    }
+  }
+  free(results);
+  return NULL;
+}
+
+// several threads sharing the default pool at once
+void test_batch3() {
+  size_t n = 1000;
+  const char* pattern[] = { "1", "(+ 1 1)", "(- 5 2)", "(* 2 2)", "(/ 10 2)", "(+ 1 (+ 2 3))", "7" };
+  const char** exprs = malloc(n * sizeof *exprs);
+  for (size_t i = 0; i < n; i++) {
+    exprs[i] = pattern[i % 7];
+  }
+  pthread_t threads[4];
+  struct ConcurrentBatch cbs[4];
+  for (int i = 0; i < 4; i++) {
+    cbs[i] = (struct ConcurrentBatch){ exprs, n, 0 };
+    pthread_create(&threads[i], NULL, concurrent_batch_thread, &cbs[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    assert_int_eq2(cbs[i].mismatches, 0);
+  }
+  free(exprs);
+}
+
+__attribute__((constructor(101))) void register_batch() {
+  register_command("--batch", run_batch);
+  register_test("test_batch1", test_batch1);
+  register_test("test_batch2", test_batch2);
+  register_test("test_batch3", test_batch3);
+}
+
+// main evaluates a single expression from argv[1], so evaluating a million of
+// them means starting a million processes. let's add a mode that reads
+// newline-separated expressions from stdin or a file and writes one result per
+// line. reading is done in big chunks (or by mmap'ing the file), and output goes
+// through a buffer instead of one printf per line.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+struct LineReader {
+  int fd;
+  char* buf;
+  // bytes of valid data in buf
+  size_t len;
+  // start of the next line
+  size_t pos;
+  size_t cap;
+  // if set, buf is the whole file, mmap'd
+  int mapped;
+  int eof;
+};
+
+size_t LINE_READER_BUFSIZE = 1 << 20;
+
+struct LineReader line_reader_init(int fd) {
+  struct LineReader r;
+  r.fd = fd;
+  r.buf = NULL;
+  r.len = 0;
+  r.pos = 0;
+  r.cap = 0;
+  r.mapped = 0;
+  r.eof = 0;
+
+  // regular files get mapped in one go; anything else (pipes, terminals, empty
+  // files) falls back to read()
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      r.buf = p;
+      r.len = st.st_size;
+      r.cap = st.st_size;
+      r.mapped = 1;
+      r.eof = 1;
+      return r;
+    }
+  }
+  r.cap = LINE_READER_BUFSIZE;
+  r.buf = malloc(r.cap);
+  return r;
+}
+
+void line_reader_free(struct LineReader* r) {
+  if (r->mapped) {
+    munmap(r->buf, r->cap);
+  } else {
+    free(r->buf);
+  }
+  r->buf = NULL;
+}
+
+// read more input into the buffer, first shifting the unread part to the front
+// (and growing the buffer if a single line fills it). returns 0 at end of input.
+int line_reader_fill(struct LineReader* r) {
+  if (r->eof) {
+    return 0;
+  }
+  if (r->pos > 0) {
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  if (r->len == r->cap) {
+    r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+  }
+  for (;;) {
+    ssize_t k = read(r->fd, r->buf + r->len, r->cap - r->len);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      r->eof = 1;
+      return 0;
+    }
+    r->len += k;
+    return 1;
+  }
+}
+
+// sets *s and *n to the next line, without the newline. the line is not
+// NUL-terminated, and only stays valid until the next call. returns 0 at end of
+// input.
+int line_reader_next(struct LineReader* r, const char** s, size_t* n) {
+  size_t scanned = r->pos;
+  for (;;) {
+    char* nl = memchr(r->buf + scanned, '\n', r->len - scanned);
+    if (nl != NULL) {
+      *s = r->buf + r->pos;
+      *n = nl - (r->buf + r->pos);
+      r->pos = nl - r->buf + 1;
+      return 1;
+    }
+    size_t consumed = r->pos;
+    scanned = r->len;
+    if (!line_reader_fill(r)) {
+      break;
+    }
+    scanned -= consumed;
+  }
+  // last line, with no trailing newline
+  if (r->pos < r->len) {
+    *s = r->buf + r->pos;
+    *n = r->len - r->pos;
+    r->pos = r->len;
+    return 1;
+  }
+  return 0;
+}
+
+struct Writer {
+  int fd;
+  // for a socket, writes go through send with MSG_NOSIGNAL, so that a peer that
+  // has gone away doesn't kill us with SIGPIPE, and a write error sets failed
+  // instead of exiting. a failed writer throws away whatever it's given.
+  int sock;
+  int failed;
+  size_t n;
+  char buf[1 << 16];
+};
+
+void writer_init(struct Writer* w, int fd) {
+  w->fd = fd;
+  w->sock = 0;
+  w->failed = 0;
+  w->n = 0;
+}
+
+void writer_init_socket(struct Writer* w, int fd) {
+  writer_init(w, fd);
+  w->sock = 1;
+}
+
+void writer_write_all(struct Writer* w, const char* s, size_t n) {
+  size_t off = 0;
+  while (off < n && !w->failed) {
+    ssize_t k = w->sock ? send(w->fd, s + off, n - off, MSG_NOSIGNAL) : write(w->fd, s + off, n - off);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      if (!w->sock) {
+        fprintf(stderr, "write error\n");
+        exit(1);
+      }
+      w->failed = 1;
+      break;
+    }
+    off += k;
+  }
+}
+
+void writer_flush(struct Writer* w) {
+  writer_write_all(w, w->buf, w->n);
+  w->n = 0;
+}
+
+void writer_bytes(struct Writer* w, const char* s, size_t n) {
+  if (w->n + n > sizeof w->buf) {
+    writer_flush(w);
+  }
+  if (n > sizeof w->buf) {
+    writer_write_all(w, s, n);
+    return;
+  }
+  memcpy(w->buf + w->n, s, n);
+  w->n += n;
+}
+
+void writer_int(struct Writer* w, int x) {
+  char tmp[16];
+  int i = sizeof tmp;
+  // work in unsigned so that INT_MIN doesn't overflow
+  unsigned u = x < 0 ? 0u - (unsigned)x : (unsigned)x;
+  do {
+    tmp[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (x < 0) {
+    tmp[--i] = '-';
+  }
+  writer_bytes(w, tmp + i, sizeof tmp - i);
+}
+
+void writer_char(struct Writer* w, char c) {
+  if (w->n == sizeof w->buf) {
+    writer_flush(w);
+  }
+  w->buf[w->n++] = c;
+}
+
+// evaluate every line from r, writing the results to w. this is the same
+// pipeline as eval_string4, except the tree goes in an arena that gets reused.
+// tokenizer_init needs a NUL-terminated string, so each line is copied out first.
+// blank lines are skipped.
+void stream_eval(struct LineReader* r, struct Writer* w) {
+  struct Arena a = arena_init();
+  size_t cap = 256;
+  char* line = malloc(cap);
+  const char* s;
+  size_t n;
+  while (line_reader_next(r, &s, &n)) {
+    if (n == 0) {
+      continue;
+    }
+    if (n + 1 > cap) {
+      while (n + 1 > cap) {
+        cap *= 2;
+      }
+      line = realloc(line, cap);
+    }
+    memcpy(line, s, n);
+    line[n] = '\0';
+    writer_int(w, eval_string_in(&a, line));
+    writer_char(w, '\n');
+  }
+  writer_flush(w);
+  free(line);
+  arena_free(&a);
+}
+
+// usage: --stream [FILE]
+// reads from stdin if FILE is missing or "-"
+int open_input(int argc, char** argv) {
+  if (argc < 3 || strcmp(argv[2], "-") == 0) {
+    return 0;
+  }
+  int fd = open(argv[2], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", argv[2], strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+struct Writer STDOUT_WRITER;
+
+int run_stream(int argc, char** argv) {
+  int fd = open_input(argc, argv);
+  struct LineReader r = line_reader_init(fd);
+  writer_init(&STDOUT_WRITER, 1);
+  stream_eval(&r, &STDOUT_WRITER);
+  line_reader_free(&r);
+  if (fd != 0) {
+    close(fd);
+  }
+  return 0;
+}
+
+// run stream_eval from one temporary file to another, and return the output
+char* stream_eval_through_files(const char* input, int use_pipe) {
+  FILE* in = tmpfile();
+  FILE* out = tmpfile();
+  fputs(input, in);
+  fflush(in);
+  rewind(in);
+
+  int fd = fileno(in);
+  int fds[2];
+  if (use_pipe) {
+    // a pipe can't be mmap'd, so this exercises the read() path
+    pipe(fds);
+    write(fds[1], input, strlen(input));
+    close(fds[1]);
+    fd = fds[0];
+  }
+  struct LineReader r = line_reader_init(fd);
+  struct Writer* w = malloc(sizeof *w);
+  writer_init(w, fileno(out));
+  stream_eval(&r, w);
+  line_reader_free(&r);
+  free(w);
+  if (use_pipe) {
+    close(fds[0]);
+  }
+
+  long size = lseek(fileno(out), 0, SEEK_END);
+  char* result = malloc(size + 1);
+  pread(fileno(out), result, size, 0);
+  result[size] = '\0';
+  fclose(in);
+  fclose(out);
+  return result;
+}
+
+void assert_str_eq(const char* actual, const char* expected) {
+  if (strcmp(actual, expected) != 0) {
+    printf("assertion failure: expected \"%s\", got \"%s\"\n", expected, actual);
+    TEST_FAILURES++;
+  }
+}
+
+void test_stream1() {
+  const char* input = "(+ 1 2)\n(* (- 7 4) (+ (/ 26 2) 1))\n\n(- 0 5)\n  7";
+  for (int use_pipe = 0; use_pipe <= 1; use_pipe++) {
+    char* out = stream_eval_through_files(input, use_pipe);
+    assert_str_eq(out, "3\n42\n-5\n7\n");
+    free(out);
+  }
+}
+
+// lines longer than the read buffer, and lines that straddle a refill
+void test_stream2() {
+  size_t saved = LINE_READER_BUFSIZE;
+  LINE_READER_BUFSIZE = 16;
+  char* deep = make_deep_expression(100, 1);
+  size_t n = strlen(deep);
+  char* input = malloc(n * 2 + 64);
+  sprintf(input, "%s\n(+ 1 1)\n(+ 2 2)\n%s\n", deep, deep);
+  char* out = stream_eval_through_files(input, 1);
+  assert_str_eq(out, "101\n2\n4\n101\n");
+  free(out);
+  free(input);
+  free(deep);
+  LINE_READER_BUFSIZE = saved;
+}
+
+__attribute__((constructor(101))) void register_stream() {
+  register_command("--stream", run_stream);
+  register_test("test_stream1", test_stream1);
+  register_test("test_stream2", test_stream2);
+}
+
+// tokenizer_init calls strlen, which means an extra pass over the input, and the
+// input has to be NUL-terminated, which is why stream_eval copies every line.
+// but the tokenizer itself never looks past tz->n, so all it takes to run over a
+// slice of a bigger buffer is an init function that takes the length.
+
+struct Tokenizer tokenizer_init_n(const char* p, size_t n) {
+  struct Tokenizer tz;
+  tz.p = p;
+  tz.i = 0;
+  tz.n = n;
+  return tz;
+}
+
+// the parser is another story: strtol keeps reading digits until it finds
+// something that isn't one, which could be past the end of the slice. so read the
+// number from the token instead. this matches strtol exactly, including clamping
+// to LONG_MAX before the conversion to int.
+#include <limits.h>
+
+int token_to_int(struct Token t) {
+  unsigned long v = 0;
+  for (size_t i = 0; i < t.n; i++) {
+    unsigned d = t.s[i] - '0';
+    if (v > ((unsigned long)LONG_MAX - d) / 10) {
+      v = LONG_MAX;
+      break;
+    }
+    v = v * 10 + d;
+  }
+  return (int)(long)v;
+}
+
+struct Tree* match_binary_expression5(struct Parser2* p);
+
+struct Tree* match_expression5(struct Parser2* p) {
+  struct Token t = parser_current(&p->p);
+  if (t.t == TOKEN_LPAREN) {
+    return match_binary_expression5(p);
+  } else if (t.t == TOKEN_NUM) {
+    parser_advance(&p->p);
+    return arena_leaf_node(p->arena, token_to_int(t));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_binary_expression5(struct Parser2* p) {
+  consume2(&p->p, TOKEN_LPAREN);
+  struct Token t = parser_current(&p->p);
+  if (!is_op_token(t.t)) {
+    parser_bail("expected op");
+  }
+  parser_advance(&p->p);
+  struct Tree* left = match_expression5(p);
+  struct Tree* right = match_expression5(p);
+  consume2(&p->p, TOKEN_RPAREN);
+  return arena_binary_node(p->arena, *t.s, left, right);
+}
+
+struct Tree* parser_parse6(struct Parser2* p) {
+  struct Tree* r = match_expression5(p);
+  if (!parser_done(&p->p)) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// like eval_string_in, but for the n bytes at s, which need not be
+// NUL-terminated
+int eval_string_n(struct Arena* a, const char* s, size_t n) {
+  struct Tokenizer tz = tokenizer_init_n(s, n);
+  tokenizer_advance(&tz);
+  struct Parser2 pr;
+  pr.p = parser_init(&tz);
+  pr.arena = a;
+  struct Tree* tr = parser_parse6(&pr);
+  int r = eval2(tr);
+  arena_reset(a);
+  return r;
+}
+
+// and now the streaming mode can evaluate lines right where they sit in the
+// read buffer (or the mmap'd file)
+void stream_eval2(struct LineReader* r, struct Writer* w) {
+  struct Arena a = arena_init();
+  const char* s;
+  size_t n;
+  while (line_reader_next(r, &s, &n)) {
+    if (n == 0) {
+      continue;
+    }
+    writer_int(w, eval_string_n(&a, s, n));
+    writer_char(w, '\n');
+  }
+  writer_flush(w);
+  arena_free(&a);
+}
+
+int run_stream2(int argc, char** argv) {
+  int fd = open_input(argc, argv);
+  struct LineReader r = line_reader_init(fd);
+  writer_init(&STDOUT_WRITER, 1);
+  stream_eval2(&r, &STDOUT_WRITER);
+  line_reader_free(&r);
+  if (fd != 0) {
+    close(fd);
+  }
+  return 0;
+}
+
+// stream_eval_through_files only knows about stream_eval, so here's a version
+// that takes the function to test
+char* stream_through_files(const char* input, int use_pipe, void (*f)(struct LineReader*, struct Writer*)) {
+  FILE* in = tmpfile();
+  FILE* out = tmpfile();
+  fputs(input, in);
+  fflush(in);
+  rewind(in);
+
+  int fd = fileno(in);
+  int fds[2];
+  if (use_pipe) {
+    pipe(fds);
+    write(fds[1], input, strlen(input));
+    close(fds[1]);
+    fd = fds[0];
+  }
+  struct LineReader r = line_reader_init(fd);
+  struct Writer* w = malloc(sizeof *w);
+  writer_init(w, fileno(out));
+  f(&r, w);
+  line_reader_free(&r);
+  free(w);
+  if (use_pipe) {
+    close(fds[0]);
+  }
+
+  long size = lseek(fileno(out), 0, SEEK_END);
+  char* result = malloc(size + 1);
+  pread(fileno(out), result, size, 0);
+  result[size] = '\0';
+  fclose(in);
+  fclose(out);
+  return result;
+}
+
+void test_eval_n1() {
+  struct Arena a = arena_init();
+  // only the first 7 bytes are the expression
+  const char* buf = "(+ 1 2)(* 3 4)99";
+  assert_int_eq2(eval_string_n(&a, buf, 7), 3);
+  assert_int_eq2(eval_string_n(&a, buf + 7, 7), 12);
+  // the number must stop at the end of the slice, even though more digits follow
+  assert_int_eq2(eval_string_n(&a, "12345", 2), 12);
+  assert_int_eq2(eval_string_n(&a, "(- 1 23)456", 8), -22);
+  arena_free(&a);
+}
+
+void test_eval_n2() {
+  const char* nums[] = { "0", "7", "2147483647", "2147483648", "99999999999999999999999" };
+  for (size_t i = 0; i < sizeof nums / sizeof nums[0]; i++) {
+    struct Token t;
+    t.t = TOKEN_NUM;
+    t.s = nums[i];
+    t.n = strlen(nums[i]);
+    assert_int_eq2(token_to_int(t), (int)strtol(nums[i], NULL, 10));
+  }
+}
+
+void test_stream3() {
+  const char* input = "(+ 1 2)\n(* (- 7 4) (+ (/ 26 2) 1))\n\n(- 0 5)\n  7";
+  for (int use_pipe = 0; use_pipe <= 1; use_pipe++) {
+    char* out = stream_through_files(input, use_pipe, stream_eval2);
+    assert_str_eq(out, "3\n42\n-5\n7\n");
+    free(out);
+  }
+}
+
+__attribute__((constructor(101))) void register_eval_n() {
+  register_command("--stream", run_stream2);
+  register_test("test_eval_n1", test_eval_n1);
+  register_test("test_eval_n2", test_eval_n2);
+  register_test("test_stream3", test_stream3);
+}
+
+// the tokenizer is slower than it needs to be: it tests characters one at a time
+// with isspace/isdigit and an if/else chain, and then the parser goes back and
+// re-reads the digits of every number. here's a faster one: a lookup table
+// classifies each byte, runs of whitespace get skipped 16 bytes at a time with
+// SSE2, and number tokens carry their value so nobody has to parse them twice.
+
+struct Token2 {
+  int t;
+  const char* s;
+  size_t n;
+  // for TOKEN_NUM, the number's value (same as token_to_int)
+  int value;
+};
+
+struct Tokenizer2 {
+  const char* p;
+  size_t i;
+  size_t n;
+  struct Token2 t;
+};
+
+// maps each byte to the type of token it starts. token types start at 1, so 0 is
+// free to mean whitespace.
+unsigned char CHAR_CLASS[256];
+
+// the token types aren't compile-time constants, so fill in the table at startup
+__attribute__((constructor(101))) void init_char_class() {
+  for (int c = 0; c < 256; c++) {
+    CHAR_CLASS[c] = TOKEN_UNKNOWN;
+  }
+  // the same characters isspace accepts in the C locale
+  const char* spaces = " \t\n\v\f\r";
+  for (const char* s = spaces; *s != '\0'; s++) {
+    CHAR_CLASS[(unsigned char)*s] = 0;
+  }
+  for (int c = '0'; c <= '9'; c++) {
+    CHAR_CLASS[c] = TOKEN_NUM;
+  }
+  CHAR_CLASS['('] = TOKEN_LPAREN;
+  CHAR_CLASS[')'] = TOKEN_RPAREN;
+  CHAR_CLASS['+'] = TOKEN_PLUS;
+  CHAR_CLASS['-'] = TOKEN_MINUS;
+  CHAR_CLASS['*'] = TOKEN_MUL;
+  CHAR_CLASS['/'] = TOKEN_DIV;
+}
+
+struct Tokenizer2 tokenizer2_init(const char* p, size_t n) {
+  struct Tokenizer2 tz;
+  tz.p = p;
+  tz.i = 0;
+  tz.n = n;
+  return tz;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t skip_whitespace2(const char* p, size_t i, size_t n) {
+  // almost always there's at most one space between tokens, so check the first
+  // byte before bothering with SIMD
+  if (i >= n || CHAR_CLASS[(unsigned char)p[i]] != 0) {
+    return i;
+  }
+  i++;
+#ifdef __SSE2__
+  __m128i space = _mm_set1_epi8(' ');
+  __m128i nine = _mm_set1_epi8(9);
+  __m128i four = _mm_set1_epi8(4);
+  while (i + 16 <= n) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    // a byte is whitespace if it's ' ', or if it's in '\t'..'\r' (9 through 13),
+    // i.e. c - 9 <= 4 as an unsigned byte
+    __m128i d = _mm_sub_epi8(v, nine);
+    __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(d, four), d);
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), ctrl);
+    unsigned mask = (unsigned)_mm_movemask_epi8(ws);
+    if (mask != 0xFFFF) {
+      return i + __builtin_ctz(~mask);
+    }
+    i += 16;
+  }
+#endif
+  while (i < n && CHAR_CLASS[(unsigned char)p[i]] == 0) {
+    i++;
+  }
+  return i;
+}
+
+void tokenizer2_advance(struct Tokenizer2* tz) {
+  const char* p = tz->p;
+  size_t i = skip_whitespace2(p, tz->i, tz->n);
+  tz->t.s = p + i;
+  if (i >= tz->n) {
+    tz->t.t = TOKEN_EOF;
+    tz->t.n = 0;
+    tz->i = i;
+    return;
+  }
+
+  int cls = CHAR_CLASS[(unsigned char)p[i]];
+  if (cls == TOKEN_NUM) {
+    // same clamping as token_to_int
+    size_t start = i;
+    unsigned long v = 0;
+    int clamped = 0;
+    while (i < tz->n && CHAR_CLASS[(unsigned char)p[i]] == TOKEN_NUM) {
+      unsigned d = p[i] - '0';
+      if (!clamped && v > ((unsigned long)LONG_MAX - d) / 10) {
+        v = LONG_MAX;
+        clamped = 1;
+      } else if (!clamped) {
+        v = v * 10 + d;
+      }
+      i++;
+    }
+    tz->t.t = TOKEN_NUM;
+    tz->t.n = i - start;
+    tz->t.value = (int)(long)v;
+  } else {
+    tz->t.t = cls;
+    tz->t.n = 1;
+    i++;
+  }
+  tz->i = i;
+}
+
+int tokenizer2_done(struct Tokenizer2* tz) {
+  return tz->i >= tz->n;
+}
+
+// a parser on top of Tokenizer2. there's no point in wrapping the old functions
+// this time, since they all take the old Tokenizer.
+
+struct Parser3 {
+  struct Tokenizer2 tz;
+  struct Arena* arena;
+};
+
+void consume3(struct Parser3* p, int t) {
+  if (p->tz.t.t != t) {
+    parser_bail("unexpected token type");
+  }
+  tokenizer2_advance(&p->tz);
+}
+
+struct Tree* match_binary_expression6(struct Parser3* p);
+
+struct Tree* match_expression6(struct Parser3* p) {
+  struct Token2 t = p->tz.t;
+  if (t.t == TOKEN_LPAREN) {
+    return match_binary_expression6(p);
+  } else if (t.t == TOKEN_NUM) {
+    tokenizer2_advance(&p->tz);
+    return arena_leaf_node(p->arena, t.value);
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_binary_expression6(struct Parser3* p) {
+  consume3(p, TOKEN_LPAREN);
+  struct Token2 t = p->tz.t;
+  if (!is_op_token(t.t)) {
+    parser_bail("expected op");
+  }
+  tokenizer2_advance(&p->tz);
+  struct Tree* left = match_expression6(p);
+  struct Tree* right = match_expression6(p);
+  consume3(p, TOKEN_RPAREN);
+  return arena_binary_node(p->arena, *t.s, left, right);
+}
+
+struct Tree* parser_parse7(struct Parser3* p) {
+  struct Tree* r = match_expression6(p);
+  if (!tokenizer2_done(&p->tz)) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+int eval_string_n2(struct Arena* a, const char* s, size_t n) {
+  struct Parser3 pr;
+  pr.tz = tokenizer2_init(s, n);
+  tokenizer2_advance(&pr.tz);
+  pr.arena = a;
+  struct Tree* tr = parser_parse7(&pr);
+  int r = eval2(tr);
+  arena_reset(a);
+  return r;
+}
+
+void assert_token2(struct Tokenizer2* tz, int t) {
+  if (tz->t.t != t) {
+    printf("assertion failure: expected token %d, got %d\n", t, tz->t.t);
+    TEST_FAILURES++;
+  }
+}
+
+// test_tokenizer1, again
+void test_tokenizer2() {
+  struct Tokenizer2 tz = tokenizer2_init("(+ 1 1)", 7);
+  tokenizer2_advance(&tz);
+  assert_token2(&tz, TOKEN_LPAREN);
+  tokenizer2_advance(&tz);
+  assert_token2(&tz, TOKEN_PLUS);
+  tokenizer2_advance(&tz);
+  assert_token2(&tz, TOKEN_NUM);
+  assert_int_eq2(tz.t.value, 1);
+  tokenizer2_advance(&tz);
+  assert_token2(&tz, TOKEN_NUM);
+  tokenizer2_advance(&tz);
+  assert_token2(&tz, TOKEN_RPAREN);
+  tokenizer2_advance(&tz);
+  assert_token2(&tz, TOKEN_EOF);
+}
+
+// the two tokenizers should produce exactly the same tokens on any input
+void test_tokenizer3() {
+  const char alphabet[] = "  \t\n\r\v\f()+-*/0123456789x%\x80\xff";
+  char buf[200];
+  srand(1);
+  for (int iter = 0; iter < 2000; iter++) {
+    size_t n = rand() % (sizeof buf - 1);
+    // sometimes throw in a long run of spaces so the SIMD loop gets exercised
+    int run = rand() % 4 == 0;
+    for (size_t i = 0; i < n; i++) {
+      buf[i] = run && i % 50 < 40 ? ' ' : alphabet[rand() % (sizeof alphabet - 1)];
+    }
+    buf[n] = '\0';
+
+    struct Tokenizer tz1 = tokenizer_init(buf);
+    struct Tokenizer2 tz2 = tokenizer2_init(buf, n);
+    for (;;) {
+      tokenizer_advance(&tz1);
+      tokenizer2_advance(&tz2);
+      struct Token t1 = tokenizer_current(&tz1);
+      if (t1.t != tz2.t.t || t1.s != tz2.t.s || t1.n != tz2.t.n) {
+        printf("assertion failure: tokenizers disagree on \"%s\" at offset %d\n", buf, (int)(t1.s - buf));
+        TEST_FAILURES++;
+        break;
+      }
+      if (t1.t == TOKEN_NUM) {
+        assert_int_eq2(tz2.t.value, token_to_int(t1));
+      }
+      if (t1.t == TOKEN_EOF) {
+        break;
+      }
+    }
+  }
+}
+
+void test_eval_n3() {
+  struct Arena a = arena_init();
+  const char* s = "  (*   (- 7\t4)\n(+ (/ 26 2)                       1))  ";
+  assert_int_eq2(eval_string_n2(&a, s, strlen(s)), 42);
+  assert_int_eq2(eval_string_n2(&a, "(+ 1 2)(* 3 4)", 7), 3);
+  assert_int_eq2(eval_string_n2(&a, "12345", 2), 12);
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_tokenizer2_tests() {
+  register_test("test_tokenizer2", test_tokenizer2);
+  register_test("test_tokenizer3", test_tokenizer3);
+  register_test("test_eval_n3", test_eval_n3);
+}
+
+// the parser still pulls tokens one at a time and copies a whole Token around
+// for each one. instead, lex the whole input up front into a packed array of
+// tokens, and let the parser index into it. besides being simpler for the parser,
+// this makes it cheap to look more than one token ahead, which we'll want once
+// the grammar gets more interesting.
+
+struct PackedToken {
+  // offset and length in the source
+  uint32_t off;
+  uint32_t len;
+  // for TOKEN_NUM, the value
+  int32_t value;
+  unsigned char t;
+};
+
+struct TokenBuffer {
+  const char* src;
+  struct PackedToken* toks;
+  // always ends with a TOKEN_EOF
+  size_t n;
+  size_t cap;
+};
+
+struct TokenBuffer token_buffer_init(void) {
+  struct TokenBuffer tb;
+  tb.src = NULL;
+  tb.toks = NULL;
+  tb.n = 0;
+  tb.cap = 0;
+  return tb;
+}
+
+void token_buffer_free(struct TokenBuffer* tb) {
+  free(tb->toks);
+  *tb = token_buffer_init();
+}
+
+// replaces whatever was in tb before
+void lex_all(struct TokenBuffer* tb, const char* s, size_t n) {
+  if (n > UINT32_MAX) {
+    parser_bail("input too long");
+  }
+  tb->src = s;
+  tb->n = 0;
+  struct Tokenizer2 tz = tokenizer2_init(s, n);
+  do {
+    tokenizer2_advance(&tz);
+    if (tb->n == tb->cap) {
+      tb->cap = tb->cap == 0 ? 64 : tb->cap * 2;
+      tb->toks = realloc(tb->toks, tb->cap * sizeof *tb->toks);
+      if (tb->toks == NULL) {
+        fprintf(stderr, "lexer: out of memory\n");
+        exit(1);
+      }
+    }
+    struct PackedToken* pt = &tb->toks[tb->n++];
+    pt->off = (uint32_t)(tz.t.s - s);
+    pt->len = (uint32_t)tz.t.n;
+    pt->value = tz.t.t == TOKEN_NUM ? tz.t.value : 0;
+    pt->t = (unsigned char)tz.t.t;
+  } while (tz.t.t != TOKEN_EOF);
+}
+
+struct Parser4 {
+  struct TokenBuffer* tb;
+  // index of the current token
+  size_t i;
+  struct Arena* arena;
+};
+
+// the type of the token k places ahead of the current one. past the end, it's
+// TOKEN_EOF forever.
+int parser4_peek(struct Parser4* p, size_t k) {
+  size_t j = p->i + k;
+  if (j >= p->tb->n) {
+    j = p->tb->n - 1;
+  }
+  return p->tb->toks[j].t;
+}
+
+struct PackedToken* parser4_current(struct Parser4* p) {
+  return &p->tb->toks[p->i];
+}
+
+void parser4_advance(struct Parser4* p) {
+  // don't run off the EOF token
+  if (p->i + 1 < p->tb->n) {
+    p->i++;
+  }
+}
+
+void consume4(struct Parser4* p, int t) {
+  if (parser4_current(p)->t != t) {
+    parser_bail("unexpected token type");
+  }
+  parser4_advance(p);
+}
+
+struct Tree* match_binary_expression7(struct Parser4* p);
+
+struct Tree* match_expression7(struct Parser4* p) {
+  struct PackedToken* t = parser4_current(p);
+  if (t->t == TOKEN_LPAREN) {
+    return match_binary_expression7(p);
+  } else if (t->t == TOKEN_NUM) {
+    parser4_advance(p);
+    return arena_leaf_node(p->arena, t->value);
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_binary_expression7(struct Parser4* p) {
+  consume4(p, TOKEN_LPAREN);
+  struct PackedToken* t = parser4_current(p);
+  if (!is_op_token(t->t)) {
+    parser_bail("expected op");
+  }
+  char op = p->tb->src[t->off];
+  parser4_advance(p);
+  struct Tree* left = match_expression7(p);
+  struct Tree* right = match_expression7(p);
+  consume4(p, TOKEN_RPAREN);
+  return arena_binary_node(p->arena, op, left, right);
+}
+
+struct Tree* parser_parse8(struct Parser4* p) {
+  struct Tree* r = match_expression7(p);
+  if (parser4_current(p)->t != TOKEN_EOF) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// tb is scratch space; pass the same one in every time to avoid reallocating
+int eval_string_n3(struct Arena* a, struct TokenBuffer* tb, const char* s, size_t n) {
+  lex_all(tb, s, n);
+  struct Parser4 pr;
+  pr.tb = tb;
+  pr.i = 0;
+  pr.arena = a;
+  int r = eval2(parser_parse8(&pr));
+  arena_reset(a);
+  return r;
+}
+
+void test_token_buffer1() {
+  struct TokenBuffer tb = token_buffer_init();
+  lex_all(&tb, "(+ 12 3)", 8);
+  assert_int_eq2(tb.n, 6);
+  assert_int_eq2(tb.toks[0].t, TOKEN_LPAREN);
+  assert_int_eq2(tb.toks[1].t, TOKEN_PLUS);
+  assert_int_eq2(tb.toks[2].t, TOKEN_NUM);
+  assert_int_eq2(tb.toks[2].off, 3);
+  assert_int_eq2(tb.toks[2].len, 2);
+  assert_int_eq2(tb.toks[2].value, 12);
+  assert_int_eq2(tb.toks[5].t, TOKEN_EOF);
+
+  struct Parser4 p;
+  p.tb = &tb;
+  p.i = 0;
+  p.arena = NULL;
+  assert_int_eq2(parser4_peek(&p, 0), TOKEN_LPAREN);
+  assert_int_eq2(parser4_peek(&p, 3), TOKEN_NUM);
+  assert_int_eq2(parser4_peek(&p, 100), TOKEN_EOF);
+  token_buffer_free(&tb);
+}
+
+void test_token_buffer2() {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  const char* exprs[] = {
+    "7",
+    "(* (- 7 4) (+ (/ 26 2) 1))",
+    "(- 100 (- 50 (- 25 5)))",
+    "(* (+ 1 (* 2 3)) (- (/ 81 9) (+ 4 (- 2 10))))",
+  };
+  for (size_t i = 0; i < sizeof exprs / sizeof exprs[0]; i++) {
+    assert_int_eq2(eval_string_n3(&a, &tb, exprs[i], strlen(exprs[i])), eval_string4(exprs[i]));
+  }
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_token_buffer_tests() {
+  register_test("test_token_buffer1", test_token_buffer1);
+  register_test("test_token_buffer2", test_token_buffer2);
+}
+
+// time for variables. the idea is to compile a formula like (* (- x 4) (+ y 1))
+// once, and then evaluate it against lots of different values for x and y.
+//
+// first, a new token type for names. the old tokenizers can't be taught about it,
+// so Tokenizer2 gets a new advance function with its own character table.
+
+int TOKEN_SYMBOL = 10;
+
+unsigned char CHAR_CLASS2[256];
+
+__attribute__((constructor(101))) void init_char_class2() {
+  // CHAR_CLASS has already been filled in by init_char_class
+  memcpy(CHAR_CLASS2, CHAR_CLASS, sizeof CHAR_CLASS2);
+  for (int c = 'a'; c <= 'z'; c++) {
+    CHAR_CLASS2[c] = TOKEN_SYMBOL;
+  }
+  for (int c = 'A'; c <= 'Z'; c++) {
+    CHAR_CLASS2[c] = TOKEN_SYMBOL;
+  }
+  CHAR_CLASS2['_'] = TOKEN_SYMBOL;
+}
+
+// names start with a letter or underscore, and may contain digits after that
+void tokenizer3_advance(struct Tokenizer2* tz) {
+  size_t i = skip_whitespace2(tz->p, tz->i, tz->n);
+  if (i >= tz->n || CHAR_CLASS2[(unsigned char)tz->p[i]] != TOKEN_SYMBOL) {
+    tz->i = i;
+    tokenizer2_advance(tz);
+    return;
+  }
+  size_t start = i;
+  while (i < tz->n) {
+    int cls = CHAR_CLASS2[(unsigned char)tz->p[i]];
+    if (cls != TOKEN_SYMBOL && cls != TOKEN_NUM) {
+      break;
+    }
+    i++;
+  }
+  tz->t.t = TOKEN_SYMBOL;
+  tz->t.s = tz->p + start;
+  tz->t.n = i - start;
+  tz->t.value = 0;
+  tz->i = i;
+}
+
+// lex_all, but with names
+void lex_all2(struct TokenBuffer* tb, const char* s, size_t n) {
+  if (n > UINT32_MAX) {
+    parser_bail("input too long");
+  }
+  tb->src = s;
+  tb->n = 0;
+  struct Tokenizer2 tz = tokenizer2_init(s, n);
+  do {
+    tokenizer3_advance(&tz);
+    if (tb->n == tb->cap) {
+      tb->cap = tb->cap == 0 ? 64 : tb->cap * 2;
+      tb->toks = realloc(tb->toks, tb->cap * sizeof *tb->toks);
+      if (tb->toks == NULL) {
+        fprintf(stderr, "lexer: out of memory\n");
+        exit(1);
+      }
+    }
+    struct PackedToken* pt = &tb->toks[tb->n++];
+    pt->off = (uint32_t)(tz.t.s - s);
+    pt->len = (uint32_t)tz.t.n;
+    pt->value = tz.t.t == TOKEN_NUM ? tz.t.value : 0;
+    pt->t = (unsigned char)tz.t.t;
+  } while (tz.t.t != TOKEN_EOF);
+}
+
+// in the tree, a variable is a leaf whose op is '$', and whose value is the
+// variable's slot in the inputs array. this is why the arena leaf nodes set op
+// to 0: leaf_node leaves it uninitialized, so trees from parser_parse4 can't have
+// variables.
+
+char VAR_OP = '$';
+
+struct Tree* arena_var_node(struct Arena* a, int slot) {
+  struct Tree* r = arena_leaf_node(a, slot);
+  r->op = VAR_OP;
+  return r;
+}
+
+int is_var_node(struct Tree* tr) {
+  return tr->left == NULL && tr->op == VAR_OP;
+}
+
+// the parser takes the list of parameter names, and resolves each name to its
+// index in that list as it goes
+struct Parser5 {
+  struct Parser4 p;
+  const char** params;
+  int nparams;
+};
+
+int resolve_param(struct Parser5* p, struct PackedToken* t) {
+  const char* name = p->p.tb->src + t->off;
+  for (int i = 0; i < p->nparams; i++) {
+    if (strlen(p->params[i]) == t->len && memcmp(p->params[i], name, t->len) == 0) {
+      return i;
+    }
+  }
+  parser_bail("unknown variable");
+  return -1;
+}
+
+struct Tree* match_binary_expression8(struct Parser5* p);
+
+struct Tree* match_expression8(struct Parser5* p) {
+  struct PackedToken* t = parser4_current(&p->p);
+  if (t->t == TOKEN_LPAREN) {
+    return match_binary_expression8(p);
+  } else if (t->t == TOKEN_NUM) {
+    parser4_advance(&p->p);
+    return arena_leaf_node(p->p.arena, t->value);
+  } else if (t->t == TOKEN_SYMBOL) {
+    parser4_advance(&p->p);
+    return arena_var_node(p->p.arena, resolve_param(p, t));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_binary_expression8(struct Parser5* p) {
+  consume4(&p->p, TOKEN_LPAREN);
+  struct PackedToken* t = parser4_current(&p->p);
+  if (!is_op_token(t->t)) {
+    parser_bail("expected op");
+  }
+  char op = p->p.tb->src[t->off];
+  parser4_advance(&p->p);
+  struct Tree* left = match_expression8(p);
+  struct Tree* right = match_expression8(p);
+  consume4(&p->p, TOKEN_RPAREN);
+  return arena_binary_node(p->p.arena, op, left, right);
+}
+
+struct Tree* parser_parse9(struct Parser5* p) {
+  struct Tree* r = match_expression8(p);
+  if (parser4_current(&p->p)->t != TOKEN_EOF) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// the tree evaluator needs to know about variables too
+int eval3(struct Tree* tr, const int* inputs) {
+  if (tr->left == NULL) {
+    return is_var_node(tr) ? inputs[tr->value] : tr->value;
+  }
+  return apply_op(tr->op, eval3(tr->left, inputs), eval3(tr->right, inputs));
+}
+
+// as promised, a version of fold_constants that leaves variables alone and only
+// folds the subtrees that don't depend on them
+void fold_constants2(struct Tree* tr, void (*discard)(struct Tree*)) {
+  if (tr->left == NULL) {
+    return;
+  }
+  fold_constants2(tr->left, discard);
+  fold_constants2(tr->right, discard);
+  if (tr->left->left != NULL || tr->right->left != NULL) {
+    return;
+  }
+  if (is_var_node(tr->left) || is_var_node(tr->right)) {
+    return;
+  }
+  int value = apply_op(tr->op, tr->left->value, tr->right->value);
+  if (discard != NULL) {
+    discard(tr->left);
+    discard(tr->right);
+  }
+  tr->left = NULL;
+  tr->right = NULL;
+  tr->value = value;
+  tr->op = 0;
+}
+
+// and the VM gets an instruction to load an input. it goes after the old
+// opcodes so they keep their values.
+enum {
+  OP_LOAD_VAR = OP_RET + 1,
+};
+
+void compile_tree2(struct Program* prog, struct Tree* tr, int depth) {
+  if (tr->left == NULL) {
+    program_emit(prog, is_var_node(tr) ? OP_LOAD_VAR : OP_PUSH_CONST);
+    program_emit(prog, tr->value);
+    if (depth + 1 > prog->max_stack) {
+      prog->max_stack = depth + 1;
+    }
+  } else {
+    compile_tree2(prog, tr->left, depth);
+    compile_tree2(prog, tr->right, depth + 1);
+    program_emit(prog, op_to_opcode(tr->op));
+  }
+}
+
+struct Program* compile2(struct Tree* tr) {
+  struct Program* prog = program_new();
+  compile_tree2(prog, tr, 0);
+  program_emit(prog, OP_RET);
+  return prog;
+}
+
+int vm_run2(const struct Program* prog, const int* inputs) {
+  int small[256];
+  int* stack = small;
+  if (prog->max_stack > VM_SMALL_STACK) {
+    stack = malloc(prog->max_stack * sizeof *stack);
+  }
+  int* sp = stack;
+  const int* pc = prog->code;
+  int r;
+
+#ifdef __GNUC__
+  static void* labels[] = {
+    &&do_push_const, &&do_add, &&do_sub, &&do_mul, &&do_div, &&do_ret, &&do_load_var,
+  };
+#define VM_NEXT() goto *labels[*pc++]
+  VM_NEXT();
+do_push_const:
+  *sp++ = *pc++;
+  VM_NEXT();
+do_load_var:
+  *sp++ = inputs[*pc++];
+  VM_NEXT();
+do_add:
+  sp--;
+  sp[-1] = sp[-1] + sp[0];
+  VM_NEXT();
+do_sub:
+  sp--;
+  sp[-1] = sp[-1] - sp[0];
+  VM_NEXT();
+do_mul:
+  sp--;
+  sp[-1] = sp[-1] * sp[0];
+  VM_NEXT();
+do_div:
+  sp--;
+  sp[-1] = sp[-1] / sp[0];
+  VM_NEXT();
+do_ret:
+  r = sp[-1];
+#undef VM_NEXT
+#else
+  for (;;) {
+    switch (*pc++) {
+      case OP_PUSH_CONST: *sp++ = *pc++; continue;
+      case OP_LOAD_VAR: *sp++ = inputs[*pc++]; continue;
+      case OP_ADD: sp--; sp[-1] = sp[-1] + sp[0]; continue;
+      case OP_SUB: sp--; sp[-1] = sp[-1] - sp[0]; continue;
+      case OP_MUL: sp--; sp[-1] = sp[-1] * sp[0]; continue;
+      case OP_DIV: sp--; sp[-1] = sp[-1] / sp[0]; continue;
+    }
+    r = sp[-1];
+    break;
+  }
+#endif
+
+  if (stack != small) {
+    free(stack);
+  }
+  return r;
+}
+
+// the public API: compile once with a list of parameter names, then evaluate
+// with inputs[i] bound to params[i]
+struct Formula {
+  struct Program* prog;
+  int nparams;
+};
+
+struct Formula* formula_compile(const char* s, size_t n, const char** params, int nparams) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  lex_all2(&tb, s, n);
+  struct Parser5 pr;
+  pr.p.tb = &tb;
+  pr.p.i = 0;
+  pr.p.arena = &a;
+  pr.params = params;
+  pr.nparams = nparams;
+  struct Tree* tr = parser_parse9(&pr);
+  fold_constants2(tr, NULL);
+
+  struct Formula* f = malloc(sizeof *f);
+  f->prog = compile2(tr);
+  f->nparams = nparams;
+  token_buffer_free(&tb);
+  arena_free(&a);
+  return f;
+}
+
+void formula_free(struct Formula* f) {
+  program_free(f->prog);
+  free(f);
+}
+
+int formula_eval(const struct Formula* f, const int* inputs) {
+  return vm_run2(f->prog, inputs);
+}
+
+// rows holds nrows rows of f->nparams inputs each, one after the other
+void formula_eval_rows(const struct Formula* f, const int* rows, size_t nrows, int* out) {
+  for (size_t i = 0; i < nrows; i++) {
+    out[i] = vm_run2(f->prog, rows + i * f->nparams);
+  }
+}
+
+void test_symbols1() {
+  struct TokenBuffer tb = token_buffer_init();
+  const char* s = "(+ x_1 (* Foo 2))";
+  lex_all2(&tb, s, strlen(s));
+  assert_int_eq2(tb.toks[2].t, TOKEN_SYMBOL);
+  assert_int_eq2(tb.toks[2].len, 3);
+  assert_int_eq2(tb.toks[5].t, TOKEN_SYMBOL);
+  assert_int_eq2(tb.toks[6].t, TOKEN_NUM);
+  token_buffer_free(&tb);
+}
+
+void test_formula1() {
+  const char* params[] = { "x", "y" };
+  const char* s = "(* (- x 4) (+ y 1))";
+  struct Formula* f = formula_compile(s, strlen(s), params, 2);
+  int in1[] = { 10, 2 };
+  assert_int_eq2(formula_eval(f, in1), 18);
+  int in2[] = { 4, 100 };
+  assert_int_eq2(formula_eval(f, in2), 0);
+
+  int rows[] = { 10, 2, 4, 100, 0, 0, 7, -3 };
+  int out[4];
+  formula_eval_rows(f, rows, 4, out);
+  assert_int_eq2(out[0], 18);
+  assert_int_eq2(out[1], 0);
+  assert_int_eq2(out[2], -4);
+  assert_int_eq2(out[3], -6);
+  formula_free(f);
+}
+
+// the constant parts should get folded, and nothing else
+void test_formula2() {
+  const char* params[] = { "rate", "n" };
+  const char* s = "(+ (* (+ 2 3) rate) (/ n (- 10 8)))";
+  struct Formula* f = formula_compile(s, strlen(s), params, 2);
+  // PUSH 5, LOAD rate, MUL, LOAD n, PUSH 2, DIV, ADD, RET
+  assert_int_eq2(f->prog->n, 12);
+  int in[] = { 3, 9 };
+  assert_int_eq2(formula_eval(f, in), 19);
+  formula_free(f);
+
+  // no variables at all should match the old evaluator
+  s = "(* (- 7 4) (+ (/ 26 2) 1))";
+  f = formula_compile(s, strlen(s), NULL, 0);
+  assert_int_eq2(formula_eval(f, NULL), 42);
+  formula_free(f);
+}
+
+__attribute__((constructor(101))) void register_formula_tests() {
+  register_test("test_symbols1", test_symbols1);
+  register_test("test_formula1", test_formula1);
+  register_test("test_formula2", test_formula2);
+}
+
+// when the inputs come as whole columns (x[0..n), y[0..n)), running the VM once
+// per row does a lot of dispatching for very little arithmetic. instead, run the
+// program once per block of rows, where each instruction operates on a whole
+// block at a time. the stack then holds columns instead of ints, and the inner
+// loops are plain elementwise arithmetic, which the compiler turns into SIMD
+// (gcc's vector extensions map onto AVX2, SSE2, or NEON, whichever the target
+// has).
+
+#define COLUMN_BLOCK 1024
+
+typedef int32_t v8i32 __attribute__((vector_size(32)));
+
+struct ColumnScratch {
+  // one block per stack slot; reused across calls
+  int32_t* stack;
+  int cap;
+};
+
+struct ColumnScratch column_scratch_init(void) {
+  struct ColumnScratch cs;
+  cs.stack = NULL;
+  cs.cap = 0;
+  return cs;
+}
+
+void column_scratch_free(struct ColumnScratch* cs) {
+  free(cs->stack);
+  *cs = column_scratch_init();
+}
+
+#define COLUMN_BINOP(name, op)                                          \
+  void name(int32_t* restrict a, const int32_t* restrict b, size_t n) { \
+    size_t i = 0;                                                       \
+    for (; i + 8 <= n; i += 8) {                                        \
+      v8i32 x;                                                          \
+      v8i32 y;                                                          \
+      memcpy(&x, a + i, sizeof x);                                      \
+      memcpy(&y, b + i, sizeof y);                                      \
+      x = x op y;                                                       \
+      memcpy(a + i, &x, sizeof x);                                      \
+    }                                                                   \
+    for (; i < n; i++) {                                                \
+      a[i] = a[i] op b[i];                                              \
+    }                                                                   \
+  }
+
+COLUMN_BINOP(column_add, +)
+COLUMN_BINOP(column_sub, -)
+COLUMN_BINOP(column_mul, *)
+
+// there are no SIMD integer division instructions, and we have to match
+// eval_binary exactly, so this one stays scalar
+void column_div(int32_t* restrict a, const int32_t* restrict b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    a[i] = a[i] / b[i];
+  }
+}
+
+void column_fill(int32_t* a, int32_t x, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    a[i] = x;
+  }
+}
+
+// cols[k] is the column for parameter k. each of them, and out, has n rows.
+void formula_eval_columns(const struct Formula* f, const int32_t* const* cols, size_t n, int32_t* out,
+                          struct ColumnScratch* cs) {
+  const struct Program* prog = f->prog;
+  if (cs->cap < prog->max_stack) {
+    free(cs->stack);
+    cs->cap = prog->max_stack;
+    cs->stack = malloc((size_t)cs->cap * COLUMN_BLOCK * sizeof *cs->stack);
+  }
+
+  for (size_t base = 0; base < n; base += COLUMN_BLOCK) {
+    size_t len = n - base < COLUMN_BLOCK ? n - base : COLUMN_BLOCK;
+    // sp points at the block that the next push goes into
+    int32_t* sp = cs->stack;
+    const int* pc = prog->code;
+    for (;;) {
+      int op = *pc++;
+      if (op == OP_PUSH_CONST) {
+        column_fill(sp, *pc++, len);
+        sp += COLUMN_BLOCK;
+      } else if (op == OP_LOAD_VAR) {
+        memcpy(sp, cols[*pc++] + base, len * sizeof *sp);
+        sp += COLUMN_BLOCK;
+      } else if (op == OP_RET) {
+        memcpy(out + base, sp - COLUMN_BLOCK, len * sizeof *out);
+        break;
+      } else {
+        sp -= COLUMN_BLOCK;
+        int32_t* a = sp - COLUMN_BLOCK;
+        if (op == OP_ADD) {
+          column_add(a, sp, len);
+        } else if (op == OP_SUB) {
+          column_sub(a, sp, len);
+        } else if (op == OP_MUL) {
+          column_mul(a, sp, len);
+        } else {
+          column_div(a, sp, len);
+        }
+      }
+    }
+  }
+}
+
+void test_columns1() {
+  const char* params[] = { "x", "y" };
+  const char* s = "(* (- x 4) (+ y 1))";
+  struct Formula* f = formula_compile(s, strlen(s), params, 2);
+
+  // enough rows for a couple of full blocks plus a ragged end
+  size_t n = 2 * COLUMN_BLOCK + 13;
+  int32_t* x = malloc(n * sizeof *x);
+  int32_t* y = malloc(n * sizeof *y);
+  int32_t* out = malloc(n * sizeof *out);
+  for (size_t i = 0; i < n; i++) {
+    x[i] = (int32_t)i - 500;
+    y[i] = (int32_t)(i * 7 % 101);
+  }
+  const int32_t* cols[] = { x, y };
+  struct ColumnScratch cs = column_scratch_init();
+  formula_eval_columns(f, cols, n, out, &cs);
+  for (size_t i = 0; i < n; i++) {
+    int in[] = { x[i], y[i] };
+    assert_int_eq2(out[i], formula_eval(f, in));
+  }
+  column_scratch_free(&cs);
+  free(x);
+  free(y);
+  free(out);
+  formula_free(f);
+}
+
+void test_columns2() {
+  const char* params[] = { "a", "b", "c" };
+  const char* s = "(/ (- (* a a) (* 4 (* b c))) (+ (* 2 a) 1))";
+  struct Formula* f = formula_compile(s, strlen(s), params, 3);
+  int32_t a[5] = { 1, 2, 3, -4, 100 };
+  int32_t b[5] = { 0, 1, -2, 3, 7 };
+  int32_t c[5] = { 9, 8, 7, 6, 5 };
+  int32_t out[5];
+  const int32_t* cols[] = { a, b, c };
+  struct ColumnScratch cs = column_scratch_init();
+  formula_eval_columns(f, cols, 5, out, &cs);
+  for (size_t i = 0; i < 5; i++) {
+    int in[] = { a[i], b[i], c[i] };
+    assert_int_eq2(out[i], formula_eval(f, in));
+  }
+  // a constant formula fills the whole column
+  struct Formula* g = formula_compile("(+ 1 2)", 7, NULL, 0);
+  formula_eval_columns(g, NULL, 5, out, &cs);
+  assert_int_eq2(out[4], 3);
+  column_scratch_free(&cs);
+  formula_free(f);
+  formula_free(g);
+}
+
+__attribute__((constructor(101))) void register_column_tests() {
+  register_test("test_columns1", test_columns1);
+  register_test("test_columns2", test_columns2);
+}
+
+// for the formulas that run billions of times, even the VM's dispatch is
+// overhead. so: a tiny JIT that turns a program into x86-64 machine code. it's
+// a direct translation of the bytecode, except that the top of the VM stack
+// lives in eax and the rest of it lives on the machine stack.
+//
+// the generated function is int f(const int* inputs), so inputs arrives in rdi.
+// division is idiv, which is exactly what eval_binary's `left / right` compiles
+// to, including trapping on zero and on INT_MIN / -1.
+//
+// on other architectures, jit_compile returns NULL and callers stay on the VM.
+
+struct JitCode {
+  unsigned char* mem;
+  size_t size;
+  int (*fn)(const int* inputs);
+};
+
+// each VM stack slot costs 8 bytes of machine stack, so don't JIT anything that
+// could go deeper than this
+int JIT_MAX_STACK = 4096;
+
+struct JitBuf {
+  unsigned char* p;
+  size_t n;
+  size_t cap;
+};
+
+void jit_byte(struct JitBuf* b, unsigned char x) {
+  if (b->n == b->cap) {
+    b->cap = b->cap == 0 ? 256 : b->cap * 2;
+    b->p = realloc(b->p, b->cap);
+  }
+  b->p[b->n++] = x;
+}
+
+void jit_u32(struct JitBuf* b, uint32_t x) {
+  for (int i = 0; i < 4; i++) {
+    jit_byte(b, (unsigned char)(x >> (8 * i)));
+  }
+}
+
+struct JitCode* jit_compile(const struct Program* prog) {
+#ifdef __x86_64__
+  if (prog->max_stack > JIT_MAX_STACK) {
+    return NULL;
+  }
+  struct JitBuf b = { NULL, 0, 0 };
+  // how many values are on the VM stack, counting the one in eax
+  int depth = 0;
+  const int* pc = prog->code;
+  for (;;) {
+    int op = *pc++;
+    if (op == OP_PUSH_CONST || op == OP_LOAD_VAR) {
+      if (depth > 0) {
+        // push rax
+        jit_byte(&b, 0x50);
+      }
+      if (op == OP_PUSH_CONST) {
+        // mov eax, imm32
+        jit_byte(&b, 0xB8);
+        jit_u32(&b, (uint32_t)*pc++);
+      } else {
+        // mov eax, [rdi + disp32]
+        jit_byte(&b, 0x8B);
+        jit_byte(&b, 0x87);
+        jit_u32(&b, (uint32_t)(*pc++ * 4));
+      }
+      depth++;
+    } else if (op == OP_RET) {
+      // ret
+      jit_byte(&b, 0xC3);
+      break;
+    } else {
+      // pop rcx -- the left operand is now in ecx, the right one in eax
+      jit_byte(&b, 0x59);
+      if (op == OP_ADD) {
+        // add eax, ecx
+        jit_byte(&b, 0x01);
+        jit_byte(&b, 0xC8);
+      } else if (op == OP_SUB) {
+        // sub ecx, eax; mov eax, ecx
+        jit_byte(&b, 0x29);
+        jit_byte(&b, 0xC1);
+        jit_byte(&b, 0x89);
+        jit_byte(&b, 0xC8);
+      } else if (op == OP_MUL) {
+        // imul eax, ecx
+        jit_byte(&b, 0x0F);
+        jit_byte(&b, 0xAF);
+        jit_byte(&b, 0xC1);
+      } else {
+        // xchg eax, ecx; cdq; idiv ecx
+        jit_byte(&b, 0x91);
+        jit_byte(&b, 0x99);
+        jit_byte(&b, 0xF7);
+        jit_byte(&b, 0xF9);
+      }
+      depth--;
+    }
+  }
+
+  // write the code into fresh pages, then flip them to read+execute
+  long page = sysconf(_SC_PAGESIZE);
+  size_t size = (b.n + page - 1) / page * page;
+  void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    free(b.p);
+    return NULL;
+  }
+  memcpy(mem, b.p, b.n);
+  free(b.p);
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    return NULL;
+  }
+
+  struct JitCode* jc = malloc(sizeof *jc);
+  jc->mem = mem;
+  jc->size = size;
+  jc->fn = (int (*)(const int*))mem;
+  return jc;
+#else
+  (void)prog;
+  return NULL;
+#endif
+}
+
+void jit_free(struct JitCode* jc) {
+  if (jc != NULL) {
+    munmap(jc->mem, jc->size);
+    free(jc);
+  }
+}
+
+// compiling machine code isn't free, so only do it once a formula has proven
+// itself hot: run on the VM for the first JIT_THRESHOLD calls, then switch over.
+// (ExprCache entries count their uses the same way, so a cached program can be
+// promoted with jit_compile too.)
+
+unsigned long JIT_THRESHOLD = 1000;
+
+struct TieredFormula {
+  struct Formula* f;
+  struct JitCode* jit;
+  unsigned long calls;
+  // set if jit_compile declined, so we don't keep retrying
+  int jit_failed;
+};
+
+struct TieredFormula* tiered_new(struct Formula* f) {
+  struct TieredFormula* tf = malloc(sizeof *tf);
+  tf->f = f;
+  tf->jit = NULL;
+  tf->calls = 0;
+  tf->jit_failed = 0;
+  return tf;
+}
+
+// frees the formula too
+void tiered_free(struct TieredFormula* tf) {
+  jit_free(tf->jit);
+  formula_free(tf->f);
+  free(tf);
+}
+
+int tiered_eval(struct TieredFormula* tf, const int* inputs) {
+  if (tf->jit != NULL) {
+    return tf->jit->fn(inputs);
+  }
+  if (!tf->jit_failed && ++tf->calls >= JIT_THRESHOLD) {
+    tf->jit = jit_compile(tf->f->prog);
+    tf->jit_failed = tf->jit == NULL;
+  }
+  return formula_eval(tf->f, inputs);
+}
+
+// what the JIT's machine code computes, i.e. two's complement wraparound, for
+// checking it on inputs that overflow (where formula_eval's int arithmetic is
+// undefined). division by 0 isn't anything in particular, so it gives 0.
+int vm_run_wrapping(const struct Program* prog, const int* inputs) {
+  unsigned* stack = malloc((prog->max_stack > 0 ? prog->max_stack : 1) * sizeof *stack);
+  unsigned* sp = stack;
+  const int* pc = prog->code;
+  for (;;) {
+    int op = *pc++;
+    if (op == OP_PUSH_CONST) {
+      *sp++ = (unsigned)*pc++;
+    } else if (op == OP_LOAD_VAR) {
+      *sp++ = (unsigned)inputs[*pc++];
+    } else if (op == OP_ADD) {
+      sp--;
+      sp[-1] += sp[0];
+    } else if (op == OP_SUB) {
+      sp--;
+      sp[-1] -= sp[0];
+    } else if (op == OP_MUL) {
+      sp--;
+      sp[-1] *= sp[0];
+    } else if (op == OP_DIV) {
+      sp--;
+      int l = (int)sp[-1];
+      int r = (int)sp[0];
+      sp[-1] = r == 0 ? 0 : r == -1 ? 0u - sp[-1] : (unsigned)(l / r);
+    } else {
+      break;
+    }
+  }
+  int x = (int)sp[-1];
+  free(stack);
+  return x;
+}
+
+void test_jit1() {
+  const char* params[] = { "x", "y" };
+  const char* exprs[] = {
+    "(* (- x 4) (+ y 1))",
+    "(/ (- (* x x) (* 4 y)) (+ (* 2 y) 1))",
+    "(- 7 (- x (- y (- 3 x))))",
+    "(/ x 3)",
+    "42",
+    "y",
+  };
+  // the last two overflow, so those are only checked against vm_run_wrapping
+  int inputs[][2] = { { 0, 0 }, { 10, 2 }, { -7, 3 }, { 2147483647, 1 }, { -2147483647 - 1, 5 } };
+  for (size_t i = 0; i < sizeof exprs / sizeof exprs[0]; i++) {
+    struct Formula* f = formula_compile(exprs[i], strlen(exprs[i]), params, 2);
+    struct JitCode* jc = jit_compile(f->prog);
+#ifdef __x86_64__
+    assert_int_eq2(jc != NULL, 1);
+#endif
+    if (jc != NULL) {
+      for (size_t j = 0; j < sizeof inputs / sizeof inputs[0]; j++) {
+        int want = j < 3 ? formula_eval(f, inputs[j]) : vm_run_wrapping(f->prog, inputs[j]);
+        assert_int_eq2(jc->fn(inputs[j]), want);
+      }
+    }
+    jit_free(jc);
+    formula_free(f);
+  }
+}
+
+void test_jit2() {
+  const char* params[] = { "x" };
+  const char* s = "(+ (* x 3) 1)";
+  struct TieredFormula* tf = tiered_new(formula_compile(s, strlen(s), params, 1));
+  unsigned long saved = JIT_THRESHOLD;
+  JIT_THRESHOLD = 10;
+  for (int x = 0; x < 20; x++) {
+    assert_int_eq2(tiered_eval(tf, &x), 3 * x + 1);
+  }
+#ifdef __x86_64__
+  assert_int_eq2(tf->jit != NULL, 1);
+#endif
+  JIT_THRESHOLD = saved;
+  tiered_free(tf);
+
+  // too deep for the machine stack, so it should stay on the VM
+  // (with a variable at the bottom so that it doesn't all fold away)
+  int depth = JIT_MAX_STACK + 10;
+  char* deep = make_deep_expression(depth, 1);
+  deep[depth * 5] = 'x';
+  struct Formula* f = formula_compile(deep, strlen(deep), params, 1);
+  assert_int_eq2(jit_compile(f->prog) == NULL, 1);
+  formula_free(f);
+  free(deep);
+}
+
+__attribute__((constructor(101))) void register_jit_tests() {
+  register_test("test_jit1", test_jit1);
+  register_test("test_jit2", test_jit2);
+}
+
+// the grammar only has binary operators, so summing 10,000 terms takes a
+// 10,000-deep tree. let's allow (+ a b c ...) and (* a b c ...), and store the
+// operands in an array on the node. - and / still take exactly two operands.
+// struct Tree has nowhere to put an array of children, so this needs a new kind
+// of node.
+
+struct NTree {
+  // an operator, or 0 for a literal, or VAR_OP for a variable
+  char op;
+  // the literal's value, or the variable's slot
+  int value;
+  uint32_t n;
+  struct NTree* children[];
+};
+
+struct NTree* arena_nleaf(struct Arena* a, char op, int value) {
+  struct NTree* r = arena_alloc(a, sizeof *r);
+  r->op = op;
+  r->value = value;
+  r->n = 0;
+  return r;
+}
+
+struct NTree* arena_nnode(struct Arena* a, char op, struct NTree** children, uint32_t n) {
+  struct NTree* r = arena_alloc(a, sizeof *r + n * sizeof *children);
+  r->op = op;
+  r->value = 0;
+  r->n = n;
+  memcpy(r->children, children, n * sizeof *children);
+  return r;
+}
+
+// while parsing an operator's operands we don't know how many there will be, so
+// they go on a scratch stack first and get copied into the node at the end
+struct Parser6 {
+  struct Parser5 p;
+  struct NTree** scratch;
+  size_t n;
+  size_t cap;
+};
+
+struct NTree* match_nary_expression(struct Parser6* p);
+
+struct NTree* match_nexpression(struct Parser6* p) {
+  struct PackedToken* t = parser4_current(&p->p.p);
+  if (t->t == TOKEN_LPAREN) {
+    return match_nary_expression(p);
+  } else if (t->t == TOKEN_NUM) {
+    parser4_advance(&p->p.p);
+    return arena_nleaf(p->p.p.arena, 0, t->value);
+  } else if (t->t == TOKEN_SYMBOL) {
+    parser4_advance(&p->p.p);
+    return arena_nleaf(p->p.p.arena, VAR_OP, resolve_param(&p->p, t));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct NTree* match_nary_expression(struct Parser6* p) {
+  struct Parser4* p4 = &p->p.p;
+  consume4(p4, TOKEN_LPAREN);
+  struct PackedToken* t = parser4_current(p4);
+  if (!is_op_token(t->t)) {
+    parser_bail("expected op");
+  }
+  char op = p4->tb->src[t->off];
+  parser4_advance(p4);
+
+  size_t base = p->n;
+  while (parser4_current(p4)->t != TOKEN_RPAREN) {
+    struct NTree* child = match_nexpression(p);
+    if (p->n == p->cap) {
+      p->cap = p->cap == 0 ? 64 : p->cap * 2;
+      p->scratch = realloc(p->scratch, p->cap * sizeof *p->scratch);
+    }
+    p->scratch[p->n++] = child;
+  }
+  uint32_t n = (uint32_t)(p->n - base);
+  if (n < 2) {
+    parser_bail("expected at least two operands");
+  }
+  if (n > 2 && op != '+' && op != '*') {
+    parser_bail("expected exactly two operands");
+  }
+  consume4(p4, TOKEN_RPAREN);
+  struct NTree* r = arena_nnode(p4->arena, op, p->scratch + base, n);
+  p->n = base;
+  return r;
+}
+
+struct NTree* parser_parse10(struct Parser6* p) {
+  struct NTree* r = match_nexpression(p);
+  if (parser4_current(&p->p.p)->t != TOKEN_EOF) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// evaluating a node is one loop over its operands
+int eval_ntree(struct NTree* t, const int* inputs) {
+  if (t->n == 0) {
+    return t->op == VAR_OP ? inputs[t->value] : t->value;
+  }
+  int acc = eval_ntree(t->children[0], inputs);
+  if (t->op == '+') {
+    for (uint32_t i = 1; i < t->n; i++) {
+      acc += eval_ntree(t->children[i], inputs);
+    }
+  } else if (t->op == '*') {
+    for (uint32_t i = 1; i < t->n; i++) {
+      acc *= eval_ntree(t->children[i], inputs);
+    }
+  } else {
+    acc = apply_op(t->op, acc, eval_ntree(t->children[1], inputs));
+  }
+  return acc;
+}
+
+int is_nconst(struct NTree* t) {
+  return t->n == 0 && t->op != VAR_OP;
+}
+
+// fold constants. + and * wrap around on overflow, so they're associative and
+// commutative, and all the constant operands of one node can be combined into a
+// single one no matter where they appear.
+void fold_ntree(struct NTree* t) {
+  if (t->n == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < t->n; i++) {
+    fold_ntree(t->children[i]);
+  }
+
+  if (t->op != '+' && t->op != '*') {
+    if (is_nconst(t->children[0]) && is_nconst(t->children[1])) {
+      int l = t->children[0]->value;
+      int r = t->children[1]->value;
+      if (t->op == '/') {
+        // dividing by 0 (or INT_MIN by -1) would trap here, in the compiler;
+        // leave it for the program to do at runtime
+        if (r == 0 || r == -1) {
+          return;
+        }
+        t->value = l / r;
+      } else {
+        t->value = (int)((unsigned)l - (unsigned)r);
+      }
+      t->op = 0;
+      t->n = 0;
+    }
+    return;
+  }
+
+  // move all the constants to the end, combined into one
+  uint32_t k = 0;
+  int nconst = 0;
+  // use unsigned arithmetic so the wraparound is well defined
+  unsigned acc = t->op == '+' ? 0 : 1;
+  struct NTree* last_const = NULL;
+  for (uint32_t i = 0; i < t->n; i++) {
+    struct NTree* c = t->children[i];
+    if (is_nconst(c)) {
+      acc = t->op == '+' ? acc + (unsigned)c->value : acc * (unsigned)c->value;
+      nconst++;
+      last_const = c;
+    } else {
+      t->children[k++] = c;
+    }
+  }
+  if (k == 0) {
+    t->value = (int)acc;
+    t->op = 0;
+    t->n = 0;
+    return;
+  }
+  if (nconst > 0) {
+    // reuse one of the constant leaves for the combined value
+    last_const->value = (int)acc;
+    t->children[k++] = last_const;
+  }
+  // there's at least one non-constant operand, and if there were any constants
+  // they're now one more, so the node still has at least two operands
+  t->n = k;
+}
+
+// compiling an n-ary node pushes the first operand, then alternates pushing the
+// next operand and combining, so the VM stack never holds more than two of a
+// node's operands at once
+void compile_ntree(struct Program* prog, struct NTree* t, int depth) {
+  if (t->n == 0) {
+    program_emit(prog, t->op == VAR_OP ? OP_LOAD_VAR : OP_PUSH_CONST);
+    program_emit(prog, t->value);
+    if (depth + 1 > prog->max_stack) {
+      prog->max_stack = depth + 1;
+    }
+    return;
+  }
+  int opcode = op_to_opcode(t->op);
+  compile_ntree(prog, t->children[0], depth);
+  for (uint32_t i = 1; i < t->n; i++) {
+    compile_ntree(prog, t->children[i], depth + 1);
+    program_emit(prog, opcode);
+  }
+}
+
+struct Program* compile3(struct NTree* t) {
+  struct Program* prog = program_new();
+  compile_ntree(prog, t, 0);
+  program_emit(prog, OP_RET);
+  return prog;
+}
+
+// parse s into a (n-ary) tree in the given arena, without folding
+struct NTree* parse_ntree(struct Arena* a, struct TokenBuffer* tb, const char* s, size_t n,
+                          const char** params, int nparams) {
+  lex_all2(tb, s, n);
+  struct Parser6 pr;
+  pr.p.p.tb = tb;
+  pr.p.p.i = 0;
+  pr.p.p.arena = a;
+  pr.p.params = params;
+  pr.p.nparams = nparams;
+  pr.scratch = NULL;
+  pr.n = 0;
+  pr.cap = 0;
+  struct NTree* t = parser_parse10(&pr);
+  free(pr.scratch);
+  return t;
+}
+
+// fold_ntree and then some, defined along with the algebraic simplifier further
+// down
+struct NTree* simplify_for_compile(struct NTree* t);
+
+// formula_compile, but with the n-ary grammar. the result works with everything
+// that takes a Formula (the VM, the column evaluator, the JIT).
+struct Formula* formula_compile2(const char* s, size_t n, const char** params, int nparams) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct NTree* t = simplify_for_compile(parse_ntree(&a, &tb, s, n, params, nparams));
+
+  struct Formula* f = malloc(sizeof *f);
+  f->prog = compile3(t);
+  f->nparams = nparams;
+  token_buffer_free(&tb);
+  arena_free(&a);
+  return f;
+}
+
+void test_nary1() {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  const char* params[] = { "x", "y" };
+  int in[] = { 5, -2 };
+
+  const char* s = "(+ 1 2 3 4)";
+  struct NTree* t = parse_ntree(&a, &tb, s, strlen(s), NULL, 0);
+  assert_int_eq2(t->n, 4);
+  assert_int_eq2(eval_ntree(t, NULL), 10);
+
+  s = "(* x (+ y y y) 2)";
+  t = parse_ntree(&a, &tb, s, strlen(s), params, 2);
+  assert_int_eq2(eval_ntree(t, in), -60);
+
+  // the binary forms still work the same as before
+  s = "(* (- 7 4) (+ (/ 26 2) 1))";
+  t = parse_ntree(&a, &tb, s, strlen(s), NULL, 0);
+  assert_int_eq2(eval_ntree(t, NULL), 42);
+
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+void test_nary2() {
+  const char* params[] = { "x", "y" };
+  int in[] = { 5, -2 };
+
+  // the constants should all get combined into one
+  const char* s = "(+ 1 x 2 (* 3 4) y 5)";
+  struct Formula* f = formula_compile2(s, strlen(s), params, 2);
+  // LOAD x, LOAD y, ADD, PUSH 20, ADD, RET
+  assert_int_eq2(f->prog->n, 9);
+  assert_int_eq2(formula_eval(f, in), 23);
+  formula_free(f);
+
+  // a long sum should need a constant amount of stack
+  int terms = 10000;
+  char* sum = malloc(terms * 2 + 8);
+  size_t n = 0;
+  memcpy(sum, "(+", 2);
+  n += 2;
+  for (int i = 0; i < terms; i++) {
+    sum[n++] = ' ';
+    sum[n++] = i % 2 ? 'x' : 'y';
+  }
+  sum[n++] = ')';
+  f = formula_compile2(sum, n, params, 2);
+  assert_int_eq2(f->prog->max_stack, 2);
+  assert_int_eq2(formula_eval(f, in), terms / 2 * 3);
+  formula_free(f);
+  free(sum);
+
+  // folding a constant division by 0 mustn't trap in the compiler: it stays
+  // in the program (PUSH 1, PUSH 0, DIV)
+  s = "(/ x (/ 1 0))";
+  f = formula_compile2(s, strlen(s), params, 2);
+  assert_int_eq2(f->prog->n, 2 + 2 + 2 + 1 + 1 + 1);
+  formula_free(f);
+  // and neither does -1, though that one's fine at runtime
+  s = "(/ 10 (- 0 1))";
+  f = formula_compile2(s, strlen(s), params, 2);
+  assert_int_eq2(formula_eval(f, in), -10);
+  formula_free(f);
+  // subtraction wraps around, same as +
+  s = "(- (- 0 2147483647) 2)";
+  f = formula_compile2(s, strlen(s), params, 2);
+  assert_int_eq2(f->prog->n, 3);
+  assert_int_eq2(formula_eval(f, in), 2147483647);
+  formula_free(f);
+}
+
+__attribute__((constructor(101))) void register_nary_tests() {
+  register_test("test_nary1", test_nary1);
+  register_test("test_nary2", test_nary2);
+}
+
+// the VM (like eval_binary) does raw int arithmetic, so overflow is undefined
+// behavior and dividing by zero kills the process. here are checked variants that
+// report a status instead.
+//
+// for + - *, the overflow flags from the __builtin_*_overflow intrinsics get
+// or'ed together and only looked at once at the end, so the fast path has no
+// extra branches. division has to be checked before it happens.
+//
+// these are separate functions, so vm_run2 is exactly as fast as it was.
+
+enum {
+  EVAL_OK,
+  EVAL_OVERFLOW,
+  EVAL_DIV_ZERO,
+};
+
+const char* eval_status_string(int status) {
+  if (status == EVAL_OK) {
+    return "ok";
+  } else if (status == EVAL_OVERFLOW) {
+    return "integer overflow";
+  } else if (status == EVAL_DIV_ZERO) {
+    return "division by zero";
+  } else {
+    return "unknown error";
+  }
+}
+
+// the checked VMs for int and int64_t are identical apart from the types, so
+// write it once as a macro
+#define DEFINE_CHECKED_VM(name, T, T_MIN)                                  \
+  int name(const struct Program* prog, const T* inputs, T* out) {          \
+    T small[256];                                                          \
+    T* stack = small;                                                      \
+    if (prog->max_stack > VM_SMALL_STACK) {                                \
+      stack = malloc(prog->max_stack * sizeof *stack);                     \
+    }                                                                      \
+    T* sp = stack;                                                         \
+    const int* pc = prog->code;                                            \
+    int overflow = 0;                                                      \
+    int status = EVAL_OK;                                                  \
+    for (;;) {                                                             \
+      int op = *pc++;                                                      \
+      if (op == OP_PUSH_CONST) {                                           \
+        *sp++ = *pc++;                                                     \
+      } else if (op == OP_LOAD_VAR) {                                      \
+        *sp++ = inputs[*pc++];                                             \
+      } else if (op == OP_ADD) {                                           \
+        sp--;                                                              \
+        overflow |= __builtin_add_overflow(sp[-1], sp[0], &sp[-1]);        \
+      } else if (op == OP_SUB) {                                           \
+        sp--;                                                              \
+        overflow |= __builtin_sub_overflow(sp[-1], sp[0], &sp[-1]);        \
+      } else if (op == OP_MUL) {                                           \
+        sp--;                                                              \
+        overflow |= __builtin_mul_overflow(sp[-1], sp[0], &sp[-1]);        \
+      } else if (op == OP_DIV) {                                           \
+        sp--;                                                              \
+        if (sp[0] == 0) {                                                  \
+          status = EVAL_DIV_ZERO;                                          \
+          break;                                                           \
+        }                                                                  \
+        if (sp[-1] == T_MIN && sp[0] == -1) {                              \
+          status = EVAL_OVERFLOW;                                          \
+          break;                                                           \
+        }                                                                  \
+        sp[-1] = sp[-1] / sp[0];                                           \
+      } else {                                                             \
+        *out = sp[-1];                                                     \
+        break;                                                             \
+      }                                                                    \
+    }                                                                      \
+    if (stack != small) {                                                  \
+      free(stack);                                                         \
+    }                                                                      \
+    if (status == EVAL_OK && overflow) {                                   \
+      status = EVAL_OVERFLOW;                                              \
+    }                                                                      \
+    return status;                                                         \
+  }
+
+DEFINE_CHECKED_VM(vm_run_checked, int, INT_MIN)
+DEFINE_CHECKED_VM(vm_run_checked64, int64_t, INT64_MIN)
+
+int formula_eval_checked(const struct Formula* f, const int* inputs, int* out) {
+  return vm_run_checked(f->prog, inputs, out);
+}
+
+// literals are still parsed as ints, but all arithmetic (and the inputs) are
+// 64-bit
+int formula_eval_checked64(const struct Formula* f, const int64_t* inputs, int64_t* out) {
+  return vm_run_checked64(f->prog, inputs, out);
+}
+
+// one status per row, so a bad row doesn't take the others down with it.
+// returns the number of rows that failed.
+size_t formula_eval_rows_checked(const struct Formula* f, const int* rows, size_t nrows, int* out, int* status) {
+  size_t failed = 0;
+  for (size_t i = 0; i < nrows; i++) {
+    status[i] = vm_run_checked(f->prog, rows + i * f->nparams, &out[i]);
+    failed += status[i] != EVAL_OK;
+  }
+  return failed;
+}
+
+// fold_ntree wraps around and leaves trapping divisions alone, so a program from
+// formula_compile2 could have an overflow folded away before the checked VM ever
+// sees it. this fold only combines constants whose result is exactly what the VM
+// would have computed; the rest stays in the program for the VM to report.
+//
+// operands are combined left to right, so merging constants from anywhere in
+// the node could skip an overflow in between: only the leading ones are folded.
+void fold_ntree_checked(struct NTree* t) {
+  if (t->n == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < t->n; i++) {
+    fold_ntree_checked(t->children[i]);
+  }
+  if (!is_nconst(t->children[0])) {
+    return;
+  }
+
+  int acc = t->children[0]->value;
+  uint32_t k = 1;
+  while (k < t->n && is_nconst(t->children[k])) {
+    int r = t->children[k]->value;
+    int v;
+    if (t->op == '+') {
+      if (__builtin_add_overflow(acc, r, &v)) {
+        break;
+      }
+    } else if (t->op == '-') {
+      if (__builtin_sub_overflow(acc, r, &v)) {
+        break;
+      }
+    } else if (t->op == '*') {
+      if (__builtin_mul_overflow(acc, r, &v)) {
+        break;
+      }
+    } else {
+      if (r == 0 || (acc == INT_MIN && r == -1)) {
+        break;
+      }
+      v = acc / r;
+    }
+    acc = v;
+    k++;
+  }
+  if (k == 1) {
+    return;
+  }
+  if (k == t->n) {
+    t->value = acc;
+    t->op = 0;
+    t->n = 0;
+    return;
+  }
+  // only an n-ary + or * gets here, and it keeps at least two operands
+  t->children[0]->value = acc;
+  memmove(&t->children[1], &t->children[k], (t->n - k) * sizeof *t->children);
+  t->n -= k - 1;
+}
+
+// formula_compile2 for the checked VMs
+struct Formula* formula_compile_for_checked(const char* s, size_t n, const char** params, int nparams) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct NTree* t = parse_ntree(&a, &tb, s, n, params, nparams);
+  fold_ntree_checked(t);
+
+  struct Formula* f = malloc(sizeof *f);
+  f->prog = compile3(t);
+  f->nparams = nparams;
+  token_buffer_free(&tb);
+  arena_free(&a);
+  return f;
+}
+
+void test_checked1() {
+  const char* params[] = { "x", "y" };
+  const char* s = "(/ (* x 2) y)";
+  struct Formula* f = formula_compile_for_checked(s, strlen(s), params, 2);
+  int out;
+  int in1[] = { 21, 3 };
+  assert_int_eq2(formula_eval_checked(f, in1, &out), EVAL_OK);
+  assert_int_eq2(out, 14);
+  int in2[] = { 21, 0 };
+  assert_int_eq2(formula_eval_checked(f, in2, &out), EVAL_DIV_ZERO);
+  int in3[] = { INT_MAX, 1 };
+  assert_int_eq2(formula_eval_checked(f, in3, &out), EVAL_OVERFLOW);
+  int in4[] = { INT_MIN / 2, -1 };
+  assert_int_eq2(formula_eval_checked(f, in4, &out), EVAL_OVERFLOW);
+
+  // the same inputs are fine with 64 bits
+  int64_t in5[] = { INT_MAX, 1 };
+  int64_t out64;
+  assert_int_eq2(formula_eval_checked64(f, in5, &out64), EVAL_OK);
+  assert_int_eq2(out64 == (int64_t)INT_MAX * 2, 1);
+  int64_t in6[] = { INT64_MAX, 1 };
+  assert_int_eq2(formula_eval_checked64(f, in6, &out64), EVAL_OVERFLOW);
+  formula_free(f);
+
+  s = "(- 0 x)";
+  f = formula_compile_for_checked(s, strlen(s), params, 2);
+  int in7[] = { INT_MIN, 0 };
+  assert_int_eq2(formula_eval_checked(f, in7, &out), EVAL_OVERFLOW);
+  formula_free(f);
+}
+
+void test_checked2() {
+  const char* params[] = { "x", "y" };
+  const char* s = "(+ (/ x y) 1)";
+  struct Formula* f = formula_compile_for_checked(s, strlen(s), params, 2);
+  int rows[] = { 10, 2, 1, 0, INT_MAX, 1, -9, 3 };
+  int out[4];
+  int status[4];
+  assert_int_eq2(formula_eval_rows_checked(f, rows, 4, out, status), 2);
+  assert_int_eq2(status[0], EVAL_OK);
+  assert_int_eq2(out[0], 6);
+  assert_int_eq2(status[1], EVAL_DIV_ZERO);
+  assert_int_eq2(status[2], EVAL_OVERFLOW);
+  assert_int_eq2(status[3], EVAL_OK);
+  assert_int_eq2(out[3], -2);
+  formula_free(f);
+}
+
+void test_checked3() {
+  const char* params[] = { "x", "y" };
+  int in[] = { 1, 0 };
+  int out;
+
+  // an overflow in a constant subtree is still reported, not folded away
+  const char* s = "(+ 2147483647 1 x)";
+  struct Formula* f = formula_compile_for_checked(s, strlen(s), params, 2);
+  assert_int_eq2(formula_eval_checked(f, in, &out), EVAL_OVERFLOW);
+  formula_free(f);
+  // even when the constants on either side would cancel out
+  s = "(+ 2000000000 x 2000000000 (- 0 2000000000))";
+  f = formula_compile_for_checked(s, strlen(s), params, 2);
+  assert_int_eq2(formula_eval_checked(f, in, &out), EVAL_OVERFLOW);
+  formula_free(f);
+  s = "(- (- 0 2147483647) 2)";
+  f = formula_compile_for_checked(s, strlen(s), params, 2);
+  assert_int_eq2(formula_eval_checked(f, in, &out), EVAL_OVERFLOW);
+  formula_free(f);
+
+  // and a constant division by zero doesn't trap in the compiler
+  s = "(/ x (/ 1 0))";
+  f = formula_compile_for_checked(s, strlen(s), params, 2);
+  assert_int_eq2(formula_eval_checked(f, in, &out), EVAL_DIV_ZERO);
+  formula_free(f);
+  s = "(/ (- (- 0 2147483647) 1) (- 0 1))";
+  f = formula_compile_for_checked(s, strlen(s), params, 2);
+  assert_int_eq2(formula_eval_checked(f, in, &out), EVAL_OVERFLOW);
+  formula_free(f);
+
+  // what can be folded still is
+  s = "(* 2 3 x 7)";
+  f = formula_compile_for_checked(s, strlen(s), params, 2);
+  assert_int_eq2(f->prog->n, 2 + 2 + 1 + 2 + 1 + 1);
+  assert_int_eq2(formula_eval_checked(f, in, &out), EVAL_OK);
+  assert_int_eq2(out, 42);
+  formula_free(f);
+}
+
+__attribute__((constructor(101))) void register_checked_tests() {
+  register_test("test_checked1", test_checked1);
+  register_test("test_checked2", test_checked2);
+  register_test("test_checked3", test_checked3);
+}
+
+// parser_bail calls exit, so one bad expression in a batch of a million takes
+// the whole process down with it. here's a version of the n-ary parser that
+// reports errors instead. on failure it stops at the first error, records where
+// it happened, and returns NULL all the way up.
+
+enum {
+  EVAL_PARSE_ERROR = EVAL_DIV_ZERO + 1,
+};
+
+struct EvalError {
+  // one of the EVAL_* codes
+  int status;
+  const char* msg;
+  // for parse errors, where in the input things went wrong, and the token found
+  // there (at the end of the input, that's a TOKEN_EOF with length 0)
+  size_t offset;
+  struct Token token;
+};
+
+void eval_error_clear(struct EvalError* err) {
+  err->status = EVAL_OK;
+  err->msg = NULL;
+  err->offset = 0;
+  err->token.t = 0;
+  err->token.s = NULL;
+  err->token.n = 0;
+}
+
+// so that a failed parse doesn't leave garbage in the arena, remember where the
+// arena was before starting and roll back to there
+struct ArenaMark {
+  struct ArenaBlock* block;
+  size_t used;
+};
+
+struct ArenaMark arena_mark(struct Arena* a) {
+  struct ArenaMark m;
+  m.block = a->current;
+  m.used = a->current == NULL ? 0 : a->current->used;
+  return m;
+}
+
+void arena_release(struct Arena* a, struct ArenaMark m) {
+  if (m.block == NULL) {
+    arena_reset(a);
+    return;
+  }
+  m.block->used = m.used;
+  // arena_alloc expects the blocks after `current` to be empty
+  for (struct ArenaBlock* b = m.block->next; b != NULL; b = b->next) {
+    b->used = 0;
+  }
+  a->current = m.block;
+}
+
+struct Parser7 {
+  struct Parser6 p;
+  struct EvalError* err;
+  // how many parens deep we are
+  int depth;
+};
+
+// the parser, the checked evaluator, the folds and the compiler all recurse once
+// per level of nesting, so anything deeper than this is a parse error rather
+// than a stack overflow
+int PARSE_MAX_DEPTH = 10000;
+
+struct NTree* parse_fail(struct Parser7* p, const char* msg) {
+  struct Parser4* p4 = &p->p.p.p;
+  struct PackedToken* t = parser4_current(p4);
+  p->err->status = EVAL_PARSE_ERROR;
+  p->err->msg = msg;
+  p->err->offset = t->off;
+  p->err->token.t = t->t;
+  p->err->token.s = p4->tb->src + t->off;
+  p->err->token.n = t->len;
+  return NULL;
+}
+
+// resolve_param, without the bail
+int find_param(struct Parser5* p, struct PackedToken* t) {
+  const char* name = p->p.tb->src + t->off;
+  for (int i = 0; i < p->nparams; i++) {
+    if (strlen(p->params[i]) == t->len && memcmp(p->params[i], name, t->len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// the lexers clamp literals (the way strtol does, and then some), so a number
+// that doesn't fit in an int would quietly turn into some other number. the
+// checked parser asks this instead. a literal is only ever digits.
+int literal_fits_int(const char* s, size_t n) {
+  while (n > 1 && *s == '0') {
+    s++;
+    n--;
+  }
+  return n < 10 || (n == 10 && memcmp(s, "2147483647", 10) <= 0);
+}
+
+struct NTree* match_nary_expression2(struct Parser7* p);
+
+struct NTree* match_nexpression2(struct Parser7* p) {
+  struct Parser4* p4 = &p->p.p.p;
+  struct PackedToken* t = parser4_current(p4);
+  if (t->t == TOKEN_LPAREN) {
+    if (p->depth == PARSE_MAX_DEPTH) {
+      return parse_fail(p, "too deeply nested");
+    }
+    p->depth++;
+    struct NTree* r = match_nary_expression2(p);
+    p->depth--;
+    return r;
+  } else if (t->t == TOKEN_NUM) {
+    if (!literal_fits_int(p4->tb->src + t->off, t->len)) {
+      return parse_fail(p, "number out of range");
+    }
+    parser4_advance(p4);
+    return arena_nleaf(p4->arena, 0, t->value);
+  } else if (t->t == TOKEN_SYMBOL) {
+    int slot = find_param(&p->p.p, t);
+    if (slot < 0) {
+      return parse_fail(p, "unknown variable");
+    }
+    parser4_advance(p4);
+    return arena_nleaf(p4->arena, VAR_OP, slot);
+  } else {
+    return parse_fail(p, "expected expression");
+  }
+}
+
+struct NTree* match_nary_expression2(struct Parser7* p) {
+  struct Parser6* p6 = &p->p;
+  struct Parser4* p4 = &p->p.p.p;
+  // we know the current token is a paren, since that's how we got here
+  parser4_advance(p4);
+  struct PackedToken* t = parser4_current(p4);
+  if (!is_op_token(t->t)) {
+    return parse_fail(p, "expected op");
+  }
+  char op = p4->tb->src[t->off];
+  parser4_advance(p4);
+
+  size_t base = p6->n;
+  while (parser4_current(p4)->t != TOKEN_RPAREN) {
+    if (parser4_current(p4)->t == TOKEN_EOF) {
+      p6->n = base;
+      return parse_fail(p, "expected ')'");
+    }
+    struct NTree* child = match_nexpression2(p);
+    if (child == NULL) {
+      p6->n = base;
+      return NULL;
+    }
+    if (p6->n == p6->cap) {
+      p6->cap = p6->cap == 0 ? 64 : p6->cap * 2;
+      p6->scratch = realloc(p6->scratch, p6->cap * sizeof *p6->scratch);
+    }
+    p6->scratch[p6->n++] = child;
+  }
+  uint32_t n = (uint32_t)(p6->n - base);
+  if (n < 2) {
+    p6->n = base;
+    return parse_fail(p, "expected at least two operands");
+  }
+  if (n > 2 && op != '+' && op != '*') {
+    p6->n = base;
+    return parse_fail(p, "expected exactly two operands");
+  }
+  parser4_advance(p4);
+  struct NTree* r = arena_nnode(p4->arena, op, p6->scratch + base, n);
+  p6->n = base;
+  return r;
+}
+
+// returns EVAL_OK or EVAL_PARSE_ERROR. on failure, *out is NULL, err says what
+// went wrong, and anything allocated from the arena has been given back.
+int parse_ntree_checked(struct Arena* a, struct TokenBuffer* tb, const char* s, size_t n,
+                        const char** params, int nparams, struct NTree** out, struct EvalError* err) {
+  eval_error_clear(err);
+  *out = NULL;
+  if (n > UINT32_MAX) {
+    err->status = EVAL_PARSE_ERROR;
+    err->msg = "input too long";
+    return err->status;
+  }
+  struct ArenaMark mark = arena_mark(a);
+  lex_all2(tb, s, n);
+  struct Parser7 pr;
+  pr.p.p.p.tb = tb;
+  pr.p.p.p.i = 0;
+  pr.p.p.p.arena = a;
+  pr.p.p.params = params;
+  pr.p.p.nparams = nparams;
+  pr.p.scratch = NULL;
+  pr.p.n = 0;
+  pr.p.cap = 0;
+  pr.err = err;
+  pr.depth = 0;
+  struct NTree* t = match_nexpression2(&pr);
+  if (t != NULL && parser4_current(&pr.p.p.p)->t != TOKEN_EOF) {
+    t = parse_fail(&pr, "trailing input");
+  }
+  free(pr.p.scratch);
+  if (t == NULL) {
+    arena_release(a, mark);
+    return err->status;
+  }
+  *out = t;
+  return EVAL_OK;
+}
+
+// a checked evaluator for trees, with the same rules as vm_run_checked
+int eval_ntree_checked(struct NTree* t, const int* inputs, int* out) {
+  if (t->n == 0) {
+    *out = t->op == VAR_OP ? inputs[t->value] : t->value;
+    return EVAL_OK;
+  }
+  int acc;
+  int status = eval_ntree_checked(t->children[0], inputs, &acc);
+  for (uint32_t i = 1; i < t->n && status == EVAL_OK; i++) {
+    int x;
+    status = eval_ntree_checked(t->children[i], inputs, &x);
+    if (status != EVAL_OK) {
+      break;
+    }
+    int overflow = 0;
+    if (t->op == '+') {
+      overflow = __builtin_add_overflow(acc, x, &acc);
+    } else if (t->op == '-') {
+      overflow = __builtin_sub_overflow(acc, x, &acc);
+    } else if (t->op == '*') {
+      overflow = __builtin_mul_overflow(acc, x, &acc);
+    } else if (x == 0) {
+      status = EVAL_DIV_ZERO;
+    } else if (acc == INT_MIN && x == -1) {
+      overflow = 1;
+    } else {
+      acc /= x;
+    }
+    if (overflow) {
+      status = EVAL_OVERFLOW;
+    }
+  }
+  *out = acc;
+  return status;
+}
+
+// counters for the entry points that real traffic goes through:
+// eval_string_checked (and so --batch, !batch, and the checked batch APIs), the
+// --stream pipeline, and server_eval. every call adds what it did to
+// EVAL_STATS_TOTAL, and since all of those run on several threads at once, the
+// totals are atomic. counting costs a couple of clock reads per call, a walk of
+// the tree, and the atomic adds, so it's opt-in: build with -DEVAL_STATS=1, and
+// --stats prints the totals.
+
+#ifndef EVAL_STATS
+#define EVAL_STATS 0
+#endif
+
+struct EvalStats {
+  unsigned long calls;
+  unsigned long tokens;
+  unsigned long nodes;
+  unsigned long bytes;
+  unsigned long max_depth;
+  // the next three are only split out by eval_string_stats. everywhere else,
+  // lexing and allocating count as parsing.
+  // tokenizer_init (i.e. strlen)
+  uint64_t cycles_init;
+  // tokenizer_advance
+  uint64_t cycles_lex;
+  // malloc in binary_node/leaf_node
+  uint64_t cycles_alloc;
+  // the rest of parsing (for server_eval, the cache lookup)
+  uint64_t cycles_parse;
+  uint64_t cycles_eval;
+};
+
+// the same, but safe to add to from any thread
+struct EvalStatsTotal {
+  _Atomic unsigned long calls;
+  _Atomic unsigned long tokens;
+  _Atomic unsigned long nodes;
+  _Atomic unsigned long bytes;
+  _Atomic unsigned long max_depth;
+  _Atomic uint64_t cycles_init;
+  _Atomic uint64_t cycles_lex;
+  _Atomic uint64_t cycles_alloc;
+  _Atomic uint64_t cycles_parse;
+  _Atomic uint64_t cycles_eval;
+};
+
+// totals over every call so far
+struct EvalStatsTotal EVAL_STATS_TOTAL;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+uint64_t cycles_now(void) {
+  return __rdtsc();
+}
+#else
+#include <time.h>
+// no cycle counter handy, so count nanoseconds instead
+uint64_t cycles_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#if EVAL_STATS
+#define STAT_ADD(st, field, x) ((st)->field += (x))
+#define STAT_MAX(st, field, x) ((st)->field = (x) > (st)->field ? (x) : (st)->field)
+#define STAT_CLOCK() cycles_now()
+#else
+// sizeof doesn't evaluate its operand, so these generate no code, but they still
+// count as uses of their arguments as far as the compiler's warnings go
+#define STAT_ADD(st, field, x) ((void)sizeof((st)->field += (x)))
+#define STAT_MAX(st, field, x) ((void)sizeof((st)->field = (x)))
+#define STAT_CLOCK() ((uint64_t)0)
+#endif
+
+// the counters are independent of each other, so relaxed is enough
+void stats_accumulate(struct EvalStatsTotal* total, const struct EvalStats* st) {
+  atomic_fetch_add_explicit(&total->calls, st->calls, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->tokens, st->tokens, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->nodes, st->nodes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->bytes, st->bytes, memory_order_relaxed);
+  unsigned long depth = atomic_load_explicit(&total->max_depth, memory_order_relaxed);
+  while (st->max_depth > depth &&
+         !atomic_compare_exchange_weak_explicit(&total->max_depth, &depth, st->max_depth, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+  atomic_fetch_add_explicit(&total->cycles_init, st->cycles_init, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->cycles_lex, st->cycles_lex, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->cycles_alloc, st->cycles_alloc, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->cycles_parse, st->cycles_parse, memory_order_relaxed);
+  atomic_fetch_add_explicit(&total->cycles_eval, st->cycles_eval, memory_order_relaxed);
+}
+
+// a copy of the totals. with calls still going on, the fields can be from
+// slightly different moments.
+void stats_snapshot(struct EvalStats* out) {
+  out->calls = atomic_load(&EVAL_STATS_TOTAL.calls);
+  out->tokens = atomic_load(&EVAL_STATS_TOTAL.tokens);
+  out->nodes = atomic_load(&EVAL_STATS_TOTAL.nodes);
+  out->bytes = atomic_load(&EVAL_STATS_TOTAL.bytes);
+  out->max_depth = atomic_load(&EVAL_STATS_TOTAL.max_depth);
+  out->cycles_init = atomic_load(&EVAL_STATS_TOTAL.cycles_init);
+  out->cycles_lex = atomic_load(&EVAL_STATS_TOTAL.cycles_lex);
+  out->cycles_alloc = atomic_load(&EVAL_STATS_TOTAL.cycles_alloc);
+  out->cycles_parse = atomic_load(&EVAL_STATS_TOTAL.cycles_parse);
+  out->cycles_eval = atomic_load(&EVAL_STATS_TOTAL.cycles_eval);
+}
+
+void stats_count_ntree(struct EvalStats* st, const struct NTree* t, unsigned long depth) {
+  st->nodes++;
+  st->bytes += sizeof *t + t->n * sizeof t->children[0];
+  if (depth > st->max_depth) {
+    st->max_depth = depth;
+  }
+  for (uint32_t i = 0; i < t->n; i++) {
+    stats_count_ntree(st, t->children[i], depth + 1);
+  }
+}
+
+// add one checked parse and/or evaluation to the totals. tb is what the parse
+// was lexed into and t is its tree; either can be NULL when there's nothing to
+// count, e.g. for a cache hit or a parse that failed.
+void stats_record(unsigned long calls, const struct TokenBuffer* tb, const struct NTree* t, uint64_t parse,
+                  uint64_t eval) {
+#if EVAL_STATS
+  struct EvalStats st;
+  memset(&st, 0, sizeof st);
+  st.calls = calls;
+  if (tb != NULL) {
+    st.tokens = tb->n;
+  }
+  if (t != NULL) {
+    stats_count_ntree(&st, t, 1);
+  }
+  st.cycles_parse = parse;
+  st.cycles_eval = eval;
+  stats_accumulate(&EVAL_STATS_TOTAL, &st);
+#else
+  (void)calls;
+  (void)tb;
+  (void)t;
+  (void)parse;
+  (void)eval;
+#endif
+}
+
+void stats_print(FILE* f, const struct EvalStats* st) {
+#if EVAL_STATS
+  uint64_t total = st->cycles_init + st->cycles_lex + st->cycles_alloc + st->cycles_parse + st->cycles_eval;
+  if (total == 0) {
+    total = 1;
+  }
+  fprintf(f, "calls:     %lu\n", st->calls);
+  fprintf(f, "tokens:    %lu\n", st->tokens);
+  fprintf(f, "nodes:     %lu\n", st->nodes);
+  fprintf(f, "bytes:     %lu\n", st->bytes);
+  fprintf(f, "max depth: %lu\n", st->max_depth);
+  const char* names[] = { "init", "lex", "alloc", "parse", "eval" };
+  uint64_t cycles[] = { st->cycles_init, st->cycles_lex, st->cycles_alloc, st->cycles_parse, st->cycles_eval };
+  for (int i = 0; i < 5; i++) {
+    fprintf(f, "%-6s %14llu cycles (%5.1f%%)\n", names[i], (unsigned long long)cycles[i], 100.0 * cycles[i] / total);
+  }
+#else
+  (void)st;
+  fprintf(f, "stats were compiled out (EVAL_STATS=0)\n");
+#endif
+}
+
+// print the totals to stderr, for the modes that do a whole run's worth of
+// calls (in a -DEVAL_STATS=0 build, this does nothing)
+void stats_report(void) {
+#if EVAL_STATS
+  struct EvalStats st;
+  stats_snapshot(&st);
+  stats_print(stderr, &st);
+#endif
+}
+
+// parse and evaluate the n bytes at s, never exiting. returns an EVAL_* code,
+// with the details in err. the arena is reset afterwards either way.
+int eval_string_checked(struct Arena* a, struct TokenBuffer* tb, const char* s, size_t n, int* out,
+                        struct EvalError* err) {
+  struct NTree* t;
+  uint64_t t0 = STAT_CLOCK();
+  int status = parse_ntree_checked(a, tb, s, n, NULL, 0, &t, err);
+  uint64_t t1 = STAT_CLOCK();
+  if (status == EVAL_OK) {
+    status = eval_ntree_checked(t, NULL, out);
+    err->status = status;
+    err->msg = status == EVAL_OK ? NULL : eval_status_string(status);
+  }
+  stats_record(1, tb, t, t1 - t0, STAT_CLOCK() - t1);
+  arena_reset(a);
+  return status;
+}
+
+// formula_compile_for_checked, with errors
+int formula_compile_checked(const char* s, size_t n, const char** params, int nparams, struct Formula** out,
+                            struct EvalError* err) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct NTree* t;
+  *out = NULL;
+  int status = parse_ntree_checked(&a, &tb, s, n, params, nparams, &t, err);
+  if (status == EVAL_OK) {
+    fold_ntree_checked(t);
+    struct Formula* f = malloc(sizeof *f);
+    f->prog = compile3(t);
+    f->nparams = nparams;
+    *out = f;
+  }
+  token_buffer_free(&tb);
+  arena_free(&a);
+  return status;
+}
+
+// writes e.g. "error: expected expression at offset 3 (')')"
+void writer_error(struct Writer* w, struct EvalError* err) {
+  writer_bytes(w, "error: ", 7);
+  writer_bytes(w, err->msg, strlen(err->msg));
+  if (err->status == EVAL_PARSE_ERROR) {
+    writer_bytes(w, " at offset ", 11);
+    writer_int(w, (int)err->offset);
+    if (err->token.n > 0) {
+      writer_bytes(w, " ('", 3);
+      writer_bytes(w, err->token.s, err->token.n);
+      writer_bytes(w, "')", 2);
+    }
+  }
+}
+
+// the streaming mode, for the third time: a bad line produces an error line in
+// the output (so results still line up with the input) and we carry on
+void stream_eval3(struct LineReader* r, struct Writer* w) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  const char* s;
+  size_t n;
+  while (line_reader_next(r, &s, &n)) {
+    if (n == 0) {
+      continue;
+    }
+    int x;
+    if (eval_string_checked(&a, &tb, s, n, &x, &err) == EVAL_OK) {
+      writer_int(w, x);
+    } else {
+      writer_error(w, &err);
+    }
+    writer_char(w, '\n');
+  }
+  writer_flush(w);
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+int run_stream3(int argc, char** argv) {
+  int fd = open_input(argc, argv);
+  struct LineReader r = line_reader_init(fd);
+  writer_init(&STDOUT_WRITER, 1);
+  stream_eval3(&r, &STDOUT_WRITER);
+  line_reader_free(&r);
+  if (fd != 0) {
+    close(fd);
+  }
+  return 0;
+}
+
+// and a batch API that gives each expression its own status. Worker doesn't have
+// a token buffer, so the job carries one per worker.
+struct CheckedBatchJob {
+  const char** exprs;
+  int* results;
+  // one of these is NULL
+  int* status;
+  struct EvalError* errs;
+  struct TokenBuffer* tbs;
+};
+
+void checked_batch_task(struct Worker* w, size_t i, void* ctx) {
+  struct CheckedBatchJob* job = ctx;
+  struct EvalError local;
+  struct EvalError* err = job->errs != NULL ? &job->errs[i] : &local;
+  const char* s = job->exprs[i];
+  int status = eval_string_checked(&w->arena, &job->tbs[w->id], s, strlen(s), &job->results[i], err);
+  if (job->status != NULL) {
+    job->status[i] = status;
+  }
+}
+
+// returns how many expressions failed
+size_t pool_eval_batch_checked(struct WorkerPool* pool, const char** exprs, int* results, int* status, size_t n) {
+  struct CheckedBatchJob job;
+  job.exprs = exprs;
+  job.results = results;
+  job.status = status;
+  job.errs = NULL;
+  job.tbs = calloc(pool->nworkers, sizeof *job.tbs);
+  pool_run(pool, n, checked_batch_task, &job);
+  for (int i = 0; i < pool->nworkers; i++) {
+    token_buffer_free(&job.tbs[i]);
+  }
+  free(job.tbs);
+  size_t failed = 0;
+  for (size_t i = 0; i < n; i++) {
+    failed += status[i] != EVAL_OK;
+  }
+  return failed;
+}
+
+size_t eval_batch_checked(const char** exprs, int* results, int* status, size_t n) {
+  return pool_eval_batch_checked(default_pool(), exprs, results, status, n);
+}
+
+// the same, but with the whole EvalError for each expression (the status is in
+// errs[i].status), so parse errors come with their offset and token. the tokens
+// point into exprs.
+size_t pool_eval_batch_errors(struct WorkerPool* pool, const char** exprs, int* results, struct EvalError* errs,
+                              size_t n) {
+  struct CheckedBatchJob job;
+  job.exprs = exprs;
+  job.results = results;
+  job.status = NULL;
+  job.errs = errs;
+  job.tbs = calloc(pool->nworkers, sizeof *job.tbs);
+  pool_run(pool, n, checked_batch_task, &job);
+  for (int i = 0; i < pool->nworkers; i++) {
+    token_buffer_free(&job.tbs[i]);
+  }
+  free(job.tbs);
+  size_t failed = 0;
+  for (size_t i = 0; i < n; i++) {
+    failed += errs[i].status != EVAL_OK;
+  }
+  return failed;
+}
+
+size_t eval_batch_errors(const char** exprs, int* results, struct EvalError* errs, size_t n) {
+  return pool_eval_batch_errors(default_pool(), exprs, results, errs, n);
+}
+
+// usage: --batch EXPR...
+// this version prints an error for each bad expression instead of exiting
+int run_batch2(int argc, char** argv) {
+  size_t n = argc - 2;
+  int* results = malloc((n > 0 ? n : 1) * sizeof *results);
+  struct EvalError* errs = malloc((n > 0 ? n : 1) * sizeof *errs);
+  size_t failed = eval_batch_errors((const char**)argv + 2, results, errs, n);
+  writer_init(&STDOUT_WRITER, 1);
+  for (size_t i = 0; i < n; i++) {
+    if (errs[i].status == EVAL_OK) {
+      writer_int(&STDOUT_WRITER, results[i]);
+    } else {
+      writer_error(&STDOUT_WRITER, &errs[i]);
+    }
+    writer_char(&STDOUT_WRITER, '\n');
+  }
+  writer_flush(&STDOUT_WRITER);
+  free(results);
+  free(errs);
+  stats_report();
+  return failed != 0;
+}
+
+void assert_parse_error(const char* s, const char* msg, size_t offset) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  int x;
+  int status = eval_string_checked(&a, &tb, s, strlen(s), &x, &err);
+  if (status != EVAL_PARSE_ERROR || strcmp(err.msg, msg) != 0 || err.offset != offset) {
+    printf("assertion failure: expected \"%s\" at %d for \"%s\", got \"%s\" at %d\n", msg, (int)offset, s,
+           err.msg == NULL ? "(none)" : err.msg, (int)err.offset);
+    TEST_FAILURES++;
+  }
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+void test_errors1() {
+  assert_parse_error("", "expected expression", 0);
+  assert_parse_error("(+ 1 2", "expected ')'", 6);
+  assert_parse_error("(+ 1 2))", "trailing input", 7);
+  assert_parse_error("(% 1 2)", "expected op", 1);
+  assert_parse_error("(+ 1 x)", "unknown variable", 5);
+  assert_parse_error("(- 1 2 3)", "expected exactly two operands", 8);
+  assert_parse_error("(* 1)", "expected at least two operands", 4);
+  assert_parse_error("(+ 1 (* 2 ))", "expected at least two operands", 10);
+  assert_parse_error("(+ 2147483648 0)", "number out of range", 3);
+  assert_parse_error("(+ 0 99999999999999999999)", "number out of range", 5);
+
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  int x;
+  assert_int_eq2(eval_string_checked(&a, &tb, "(/ 1 (- 2 2))", 13, &x, &err), EVAL_DIV_ZERO);
+  assert_int_eq2(eval_string_checked(&a, &tb, "(* 65536 65536)", 15, &x, &err), EVAL_OVERFLOW);
+  assert_int_eq2(eval_string_checked(&a, &tb, "(* (- 7 4) (+ (/ 26 2) 1))", 26, &x, &err), EVAL_OK);
+  assert_int_eq2(x, 42);
+  // the token is a slice of the input
+  assert_int_eq2(eval_string_checked(&a, &tb, "(+ 1 abc)", 9, &x, &err), EVAL_PARSE_ERROR);
+  assert_int_eq2(err.token.t, TOKEN_SYMBOL);
+  assert_int_eq2(err.token.n, 3);
+  // the biggest int is fine, leading zeros or not
+  assert_int_eq2(eval_string_checked(&a, &tb, "(+ 2147483647 0)", 16, &x, &err), EVAL_OK);
+  assert_int_eq2(x, INT_MAX);
+  assert_int_eq2(eval_string_checked(&a, &tb, "(+ 0002147483647 0)", 19, &x, &err), EVAL_OK);
+  assert_int_eq2(x, INT_MAX);
+  assert_int_eq2(eval_string_checked(&a, &tb, "(+ 2147483648 0)", 16, &x, &err), EVAL_PARSE_ERROR);
+  assert_int_eq2(err.token.t, TOKEN_NUM);
+  assert_int_eq2(err.token.n, 10);
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+// a failed parse should give the arena back, even in the middle of other work
+void test_errors2() {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  struct NTree* t;
+  arena_alloc(&a, 100);
+  struct ArenaMark before = arena_mark(&a);
+  char* deep = make_deep_expression(50000, 1);
+  // chop off the closing parens
+  deep[strlen(deep) - 10] = '\0';
+  assert_int_eq2(parse_ntree_checked(&a, &tb, deep, strlen(deep), NULL, 0, &t, &err), EVAL_PARSE_ERROR);
+  struct ArenaMark after = arena_mark(&a);
+  assert_int_eq2(after.block == before.block && after.used == before.used, 1);
+  free(deep);
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+void test_errors3() {
+  const char* input = "(+ 1 2)\n(+ 1\n(/ 1 0)\n(* 2 3)\n";
+  char* out = stream_through_files(input, 0, stream_eval3);
+  assert_str_eq(out, "3\nerror: expected ')' at offset 4\nerror: division by zero\n6\n");
+  free(out);
+
+  const char* exprs[] = { "(+ 1 2)", "(+ 1", "(- 3 1)" };
+  int results[3];
+  int status[3];
+  assert_int_eq2(eval_batch_checked(exprs, results, status, 3), 1);
+  assert_int_eq2(results[0], 3);
+  assert_int_eq2(status[1], EVAL_PARSE_ERROR);
+  assert_int_eq2(results[2], 2);
+  // and with the details
+  struct EvalError errs[3];
+  assert_int_eq2(eval_batch_errors(exprs, results, errs, 3), 1);
+  assert_int_eq2(errs[0].status, EVAL_OK);
+  assert_int_eq2(errs[1].status, EVAL_PARSE_ERROR);
+  assert_str_eq(errs[1].msg, "expected ')'");
+  assert_int_eq2(errs[1].offset, 4);
+  assert_int_eq2(errs[1].token.t, TOKEN_EOF);
+  assert_int_eq2(results[2], 2);
+
+  const char* params[] = { "x" };
+  struct Formula* f;
+  struct EvalError err;
+  assert_int_eq2(formula_compile_checked("(+ x y)", 7, params, 1, &f, &err), EVAL_PARSE_ERROR);
+  assert_int_eq2(f == NULL, 1);
+  assert_int_eq2(err.offset, 5);
+  assert_int_eq2(formula_compile_checked("(+ x 1)", 7, params, 1, &f, &err), EVAL_OK);
+  int in = 4;
+  assert_int_eq2(formula_eval(f, &in), 5);
+  formula_free(f);
+
+  // constants are folded the way the checked VM would compute them
+  int x;
+  assert_int_eq2(formula_compile_checked("(/ x (/ 1 0))", 13, params, 1, &f, &err), EVAL_OK);
+  assert_int_eq2(formula_eval_checked(f, &in, &x), EVAL_DIV_ZERO);
+  formula_free(f);
+  assert_int_eq2(formula_compile_checked("(+ 2147483647 1 x)", 18, params, 1, &f, &err), EVAL_OK);
+  assert_int_eq2(formula_eval_checked(f, &in, &x), EVAL_OVERFLOW);
+  formula_free(f);
+}
+
+// too much nesting is a parse error, not a crash
+void test_errors4() {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  int x;
+  for (int right = 0; right <= 1; right++) {
+    char* deep = make_deep_expression(300000, right);
+    assert_int_eq2(eval_string_checked(&a, &tb, deep, strlen(deep), &x, &err), EVAL_PARSE_ERROR);
+    assert_str_eq(err.msg, "too deeply nested");
+    free(deep);
+    deep = make_deep_expression(PARSE_MAX_DEPTH, right);
+    assert_int_eq2(eval_string_checked(&a, &tb, deep, strlen(deep), &x, &err), EVAL_OK);
+    assert_int_eq2(x, PARSE_MAX_DEPTH + 1);
+    free(deep);
+  }
+  token_buffer_free(&tb);
+  arena_free(&a);
+
+  struct Formula* f;
+  char* deep = make_deep_expression(300000, 1);
+  assert_int_eq2(formula_compile_checked(deep, strlen(deep), NULL, 0, &f, &err), EVAL_PARSE_ERROR);
+  free(deep);
+
+  // just past the limit, through both a file and a pipe. the pipe in
+  // stream_through_files only holds 64KB, which is just enough.
+  deep = make_deep_expression(PARSE_MAX_DEPTH + 1, 1);
+  size_t n = strlen(deep);
+  deep = realloc(deep, n + 10);
+  memcpy(deep + n, "\n(+ 1 2)\n", 10);
+  char want[64];
+  snprintf(want, sizeof want, "error: too deeply nested at offset %d ('(')\n3\n", PARSE_MAX_DEPTH * 5);
+  for (int use_pipe = 0; use_pipe <= 1; use_pipe++) {
+    char* out = stream_through_files(deep, use_pipe, stream_eval3);
+    assert_str_eq(out, want);
+    free(out);
+  }
+  free(deep);
+}
+
+__attribute__((constructor(101))) void register_error_tests() {
+  register_command("--stream", run_stream3);
+  register_command("--batch", run_batch2);
+  register_test("test_errors1", test_errors1);
+  register_test("test_errors2", test_errors2);
+  register_test("test_errors3", test_errors3);
+  register_test("test_errors4", test_errors4);
+}
+
+// all of these backends are supposedly faster, but nothing actually measures
+// that. so here's a benchmark mode. it generates expressions of a few different
+// shapes, at sizes from 10 nodes up to a given maximum (10^6 nodes by default,
+// 10^7 at most), and times each stage of the pipeline on them.
+//
+// usage: --bench [MAX_NODES [REPS]]
+
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// bytes currently handed out by malloc, for counting allocations
+size_t heap_in_use(void) {
+#ifdef __GLIBC__
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+struct StrBuf {
+  char* s;
+  size_t n;
+  size_t cap;
+};
+
+void strbuf_reserve(struct StrBuf* b, size_t k) {
+  if (b->n + k + 1 > b->cap) {
+    while (b->n + k + 1 > b->cap) {
+      b->cap = b->cap == 0 ? 256 : b->cap * 2;
+    }
+    b->s = realloc(b->s, b->cap);
+  }
+}
+
+void strbuf_append(struct StrBuf* b, const char* s, size_t k) {
+  strbuf_reserve(b, k);
+  memcpy(b->s + b->n, s, k);
+  b->n += k;
+  b->s[b->n] = '\0';
+}
+
+void strbuf_int(struct StrBuf* b, int x) {
+  char tmp[16];
+  int k = snprintf(tmp, sizeof tmp, "%d", x);
+  strbuf_append(b, tmp, k);
+}
+
+// the generators only use + - *, since random division would hit zero sooner or
+// later. ops and literals come from rand(), so runs are repeatable.
+
+char bench_op(void) {
+  return "+-*"[rand() % 3];
+}
+
+// a tree with `leaves` leaves, returning its value. if balanced, split them
+// evenly at every node; otherwise, split at a random point.
+//
+// random products would overflow soon enough, and then every stage is computing
+// undefined behavior. so, like fuzz_gen, each node's operator is picked after
+// its operands, starting from a random one, out of those that keep the value
+// within half an int either way. one of + and - always does, since one of them
+// is no bigger than the bigger operand.
+int64_t gen_tree(struct StrBuf* b, size_t leaves, int balanced) {
+  if (leaves == 1) {
+    int x = balanced ? 1 + rand() % 9 : rand() % 100000;
+    strbuf_int(b, x);
+    return x;
+  }
+  size_t left = balanced ? leaves / 2 : 1 + (size_t)rand() % (leaves - 1);
+  size_t start = b->n;
+  strbuf_append(b, "(? ", 3);
+  int64_t l = gen_tree(b, left, balanced);
+  strbuf_append(b, " ", 1);
+  int64_t r = gen_tree(b, leaves - left, balanced);
+  strbuf_append(b, ")", 1);
+
+  const char* ops = "+-*";
+  int k = rand() % 3;
+  for (int tries = 0; tries < 3; tries++, k = (k + 1) % 3) {
+    int64_t x = ops[k] == '+' ? l + r : ops[k] == '-' ? l - r : l * r;
+    if (x >= -(INT_MAX / 2) && x <= INT_MAX / 2) {
+      b->s[start + 1] = ops[k];
+      return x;
+    }
+  }
+  // not reachable
+  b->s[start + 1] = '-';
+  return l - r;
+}
+
+void gen_deep(struct StrBuf* b, size_t leaves, int right_leaning) {
+  for (size_t i = 1; i < leaves; i++) {
+    char head[4] = { '(', bench_op(), ' ', 0 };
+    strbuf_append(b, head, 3);
+    if (right_leaning) {
+      strbuf_append(b, "1 ", 2);
+    }
+  }
+  strbuf_append(b, "1", 1);
+  for (size_t i = 1; i < leaves; i++) {
+    strbuf_append(b, right_leaning ? ")" : " 1)", right_leaning ? 1 : 3);
+  }
+}
+
+// (+ 1 2 3 ...), which only the n-ary grammar accepts
+void gen_wide(struct StrBuf* b, size_t leaves) {
+  strbuf_append(b, "(+", 2);
+  for (size_t i = 0; i < leaves; i++) {
+    strbuf_append(b, " ", 1);
+    strbuf_int(b, (int)(i % 100));
+  }
+  strbuf_append(b, ")", 1);
+}
+
+struct BenchInput {
+  const char* shape;
+  char* s;
+  size_t len;
+  // number of tree nodes, counting leaves
+  size_t nodes;
+  // nesting depth
+  size_t depth;
+  // only parseable with the n-ary grammar
+  int nary;
+};
+
+// stack overflows are no fun in the middle of a benchmark, so the recursive stages
+// skip anything nested deeper than this
+size_t BENCH_MAX_RECURSION = 100000;
+
+struct BenchState {
+  struct BenchInput* in;
+  struct Arena arena;
+  struct TokenBuffer tb;
+  struct Tree* tree;
+  struct FlatTree flat;
+  uint32_t flat_root;
+  struct Formula* formula;
+  struct JitCode* jit;
+};
+
+// each stage's run function returns something to free after the clock stops
+// (or NULL)
+struct BenchStage {
+  const char* name;
+  // can only handle the binary grammar
+  int binary_only;
+  // recurses once per level of nesting
+  int recursive;
+  void (*setup)(struct BenchState*);
+  void* (*run)(struct BenchState*);
+  void (*release)(void*);
+  // how many allocations a run made, given what it returned and how many blocks
+  // st->arena gained. NULL if there's no telling from out here, e.g. because the
+  // stage grows scratch buffers of its own.
+  long (*allocs)(struct BenchState*, void*, size_t);
+};
+
+volatile long BENCH_SINK;
+
+void* bench_tokenize(struct BenchState* st) {
+  struct Tokenizer tz = tokenizer_init(st->in->s);
+  long n = 0;
+  do {
+    tokenizer_advance(&tz);
+    n++;
+  } while (tokenizer_current(&tz).t != TOKEN_EOF);
+  BENCH_SINK = n;
+  return NULL;
+}
+
+void* bench_tokenize2(struct BenchState* st) {
+  struct Tokenizer2 tz = tokenizer2_init(st->in->s, st->in->len);
+  long n = 0;
+  do {
+    tokenizer2_advance(&tz);
+    n++;
+  } while (tz.t.t != TOKEN_EOF);
+  BENCH_SINK = n;
+  return NULL;
+}
+
+void* bench_parse4(struct BenchState* st) {
+  struct Tokenizer tz = tokenizer_init(st->in->s);
+  tokenizer_advance(&tz);
+  struct Parser pr = parser_init(&tz);
+  return parser_parse4(&pr);
+}
+
+// parser_parse4 trees are made of individual mallocs
+void bench_free_tree(void* p) {
+  struct Tree* tr = p;
+  if (tr->left != NULL) {
+    bench_free_tree(tr->left);
+    bench_free_tree(tr->right);
+  }
+  free(tr);
+}
+
+void* bench_parse_arena(struct BenchState* st) {
+  struct Parser3 pr;
+  pr.tz = tokenizer2_init(st->in->s, st->in->len);
+  tokenizer2_advance(&pr.tz);
+  pr.arena = &st->arena;
+  BENCH_SINK = (long)parser_parse7(&pr);
+  arena_reset(&st->arena);
+  return NULL;
+}
+
+void* bench_parse_nary(struct BenchState* st) {
+  BENCH_SINK = (long)parse_ntree(&st->arena, &st->tb, st->in->s, st->in->len, NULL, 0);
+  arena_reset(&st->arena);
+  return NULL;
+}
+
+void setup_tree(struct BenchState* st) {
+  struct Parser3 pr;
+  pr.tz = tokenizer2_init(st->in->s, st->in->len);
+  tokenizer2_advance(&pr.tz);
+  pr.arena = &st->arena;
+  st->tree = parser_parse7(&pr);
+}
+
+void* bench_eval2(struct BenchState* st) {
+  BENCH_SINK = eval2(st->tree);
+  return NULL;
+}
+
+void setup_flat(struct BenchState* st) {
+  struct Tokenizer tz = tokenizer_init(st->in->s);
+  tokenizer_advance(&tz);
+  struct Parser pr = parser_init(&tz);
+  st->flat_root = parser_parse_flat(&pr, &st->flat);
+  // the first eval allocates the scratch space, so get that out of the way
+  eval_flat(&st->flat, st->flat_root);
+}
+
+void* bench_eval_flat(struct BenchState* st) {
+  BENCH_SINK = eval_flat(&st->flat, st->flat_root);
+  return NULL;
+}
+
+void setup_formula(struct BenchState* st) {
+  st->formula = formula_compile2(st->in->s, st->in->len, NULL, 0);
+}
+
+// the folder would turn every benchmark into a single PUSH_CONST, so compile
+// without it
+void setup_formula_unfolded(struct BenchState* st) {
+  struct NTree* t = parse_ntree(&st->arena, &st->tb, st->in->s, st->in->len, NULL, 0);
+  st->formula = malloc(sizeof *st->formula);
+  st->formula->prog = compile3(t);
+  st->formula->nparams = 0;
+}
+
+void* bench_vm(struct BenchState* st) {
+  BENCH_SINK = vm_run2(st->formula->prog, NULL);
+  return NULL;
+}
+
+void setup_jit(struct BenchState* st) {
+  setup_formula_unfolded(st);
+  st->jit = jit_compile(st->formula->prog);
+}
+
+void* bench_jit(struct BenchState* st) {
+  if (st->jit != NULL) {
+    BENCH_SINK = st->jit->fn(NULL);
+  }
+  return NULL;
+}
+
+void* bench_compile(struct BenchState* st) {
+  return formula_compile2(st->in->s, st->in->len, NULL, 0);
+}
+
+void bench_free_formula(void* p) {
+  formula_free(p);
+}
+
+// eval_string4 leaks its tree, so there's nothing to release
+void* bench_eval_string4(struct BenchState* st) {
+  BENCH_SINK = eval_string4(st->in->s);
+  return NULL;
+}
+
+void* bench_eval_string_checked(struct BenchState* st) {
+  struct EvalError err;
+  int x;
+  eval_string_checked(&st->arena, &st->tb, st->in->s, st->in->len, &x, &err);
+  BENCH_SINK = x;
+  return NULL;
+}
+
+// counting allocations one stage at a time, rather than by wrapping malloc for
+// the whole process: most stages allocate nothing, or only arena blocks, and
+// the ones that malloc every node return (or leak) exactly one per node
+
+long bench_allocs_none(struct BenchState* st, void* result, size_t blocks) {
+  (void)st;
+  (void)result;
+  (void)blocks;
+  return 0;
+}
+
+long bench_allocs_arena(struct BenchState* st, void* result, size_t blocks) {
+  (void)st;
+  (void)result;
+  return (long)blocks;
+}
+
+long bench_allocs_tree(struct BenchState* st, void* result, size_t blocks) {
+  (void)result;
+  (void)blocks;
+  return (long)st->in->nodes;
+}
+
+// vm_run2 only mallocs a stack when the small one won't do
+long bench_allocs_vm(struct BenchState* st, void* result, size_t blocks) {
+  (void)result;
+  (void)blocks;
+  return st->formula->prog->max_stack > VM_SMALL_STACK;
+}
+
+size_t arena_blocks(const struct Arena* a) {
+  size_t n = 0;
+  for (struct ArenaBlock* b = a->first; b != NULL; b = b->next) {
+    n++;
+  }
+  return n;
+}
+
+struct BenchStage BENCH_STAGES[] = {
+  { "tokenizer_advance", 0, 0, NULL, bench_tokenize, NULL, bench_allocs_none },
+  { "tokenizer2_advance", 0, 0, NULL, bench_tokenize2, NULL, bench_allocs_none },
+  { "parser_parse4", 1, 1, NULL, bench_parse4, bench_free_tree, bench_allocs_tree },
+  { "parser_parse7", 1, 1, NULL, bench_parse_arena, NULL, bench_allocs_arena },
+  { "parse_ntree", 0, 1, NULL, bench_parse_nary, NULL, NULL },
+  { "eval2", 1, 1, setup_tree, bench_eval2, NULL, bench_allocs_none },
+  { "eval_flat", 1, 1, setup_flat, bench_eval_flat, NULL, bench_allocs_none },
+  { "vm_run2", 0, 1, setup_formula_unfolded, bench_vm, NULL, bench_allocs_vm },
+  { "jit", 0, 1, setup_jit, bench_jit, NULL, bench_allocs_none },
+  { "formula_compile2", 0, 1, NULL, bench_compile, bench_free_formula, NULL },
+  { "eval_string4", 1, 1, NULL, bench_eval_string4, NULL, bench_allocs_tree },
+  { "eval_string_checked", 0, 1, NULL, bench_eval_string_checked, NULL, NULL },
+};
+
+struct BenchInput bench_input(const char* shape, size_t nodes) {
+  struct StrBuf b = { NULL, 0, 0 };
+  size_t leaves = (nodes + 1) / 2;
+  struct BenchInput in;
+  in.shape = shape;
+  in.nary = 0;
+  in.nodes = 2 * leaves - 1;
+  in.depth = 0;
+  if (strcmp(shape, "balanced") == 0) {
+    gen_tree(&b, leaves, 1);
+    for (size_t k = leaves; k > 1; k = (k + 1) / 2) {
+      in.depth++;
+    }
+  } else if (strcmp(shape, "random") == 0) {
+    gen_tree(&b, leaves, 0);
+    // we don't know the depth offhand, so measure it
+    size_t d = 0;
+    for (size_t i = 0; i < b.n; i++) {
+      if (b.s[i] == '(') {
+        d++;
+        if (d > in.depth) {
+          in.depth = d;
+        }
+      } else if (b.s[i] == ')') {
+        d--;
+      }
+    }
+  } else if (strcmp(shape, "wide") == 0) {
+    gen_wide(&b, nodes);
+    in.nodes = nodes + 1;
+    in.depth = 1;
+    in.nary = 1;
+  } else {
+    gen_deep(&b, leaves, strcmp(shape, "deep-right") == 0);
+    in.depth = leaves - 1;
+  }
+  in.s = b.s;
+  in.len = b.n;
+  return in;
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+double percentile(double* sorted, int n, double p) {
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+void bench_one(struct BenchStage* stage, struct BenchInput* in, int reps) {
+  if (in->nary && stage->binary_only) {
+    return;
+  }
+  if (stage->recursive && in->depth > BENCH_MAX_RECURSION) {
+    printf("%-20s %-10s %9zu   (skipped: too deep to recurse)\n", stage->name, in->shape, in->nodes);
+    return;
+  }
+  // eval_string4 leaks every node, so keep that from getting out of hand
+  if (stage->run == bench_eval_string4 && in->nodes * reps > 20000000) {
+    reps = (int)(20000000 / in->nodes);
+    if (reps < 1) {
+      reps = 1;
+    }
+  }
+
+  struct BenchState st;
+  memset(&st, 0, sizeof st);
+  st.in = in;
+  st.arena = arena_init();
+  st.tb = token_buffer_init();
+  st.flat = flat_init();
+  if (stage->setup != NULL) {
+    stage->setup(&st);
+  }
+  if (stage->run == bench_jit && st.jit == NULL) {
+    printf("%-20s %-10s %9zu   (skipped: jit_compile declined)\n", stage->name, in->shape, in->nodes);
+    formula_free(st.formula);
+    token_buffer_free(&st.tb);
+    arena_free(&st.arena);
+    return;
+  }
+
+  double* ns = malloc(reps * sizeof *ns);
+  size_t bytes = 0;
+  long allocs = -1;
+  for (int r = 0; r < reps; r++) {
+    size_t heap = heap_in_use();
+    size_t blocks = arena_blocks(&st.arena);
+    uint64_t t0 = now_ns();
+    void* garbage = stage->run(&st);
+    uint64_t t1 = now_ns();
+    if (stage->allocs != NULL) {
+      allocs = stage->allocs(&st, garbage, arena_blocks(&st.arena) - blocks);
+    }
+    // the heap can shrink, if the stage frees more than it allocates
+    size_t after = heap_in_use();
+    // the first rep pays for warming up arenas and buffers, so report the last
+    bytes = after > heap ? after - heap : 0;
+    if (garbage != NULL) {
+      stage->release(garbage);
+    }
+    ns[r] = (double)(t1 - t0) / in->nodes;
+  }
+  qsort(ns, reps, sizeof *ns, compare_doubles);
+  char per_node[32] = "-";
+  if (allocs >= 0) {
+    snprintf(per_node, sizeof per_node, "%.3f", (double)allocs / in->nodes);
+  }
+  printf("%-20s %-10s %9zu %9.2f %9.2f %9.2f %10.1f %10.1f %10s\n", stage->name, in->shape, in->nodes,
+         percentile(ns, reps, 0.5), percentile(ns, reps, 0.9), ns[reps - 1], 1000.0 / ns[0],
+         (double)bytes / in->nodes, per_node);
+  free(ns);
+
+  if (st.jit != NULL) {
+    jit_free(st.jit);
+  }
+  if (st.formula != NULL) {
+    formula_free(st.formula);
+  }
+  flat_free(&st.flat);
+  token_buffer_free(&st.tb);
+  arena_free(&st.arena);
+}
+
+int run_bench(int argc, char** argv) {
+  size_t max_nodes = argc >= 3 ? strtoul(argv[2], NULL, 10) : 1000000;
+  int reps = argc >= 4 ? atoi(argv[3]) : 9;
+  if (max_nodes > 10000000) {
+    max_nodes = 10000000;
+  }
+  if (reps < 1) {
+    reps = 1;
+  }
+  const char* shapes[] = { "balanced", "deep-left", "deep-right", "wide", "random" };
+
+  printf("%-20s %-10s %9s %9s %9s %9s %10s %10s %10s\n", "stage", "shape", "nodes", "p50 ns", "p90 ns", "max ns",
+         "Mnodes/s", "bytes", "allocs");
+  for (size_t nodes = 10; nodes <= max_nodes; nodes *= 10) {
+    for (size_t i = 0; i < sizeof shapes / sizeof shapes[0]; i++) {
+      srand(42);
+      struct BenchInput in = bench_input(shapes[i], nodes);
+      for (size_t j = 0; j < sizeof BENCH_STAGES / sizeof BENCH_STAGES[0]; j++) {
+        bench_one(&BENCH_STAGES[j], &in, reps);
+      }
+      free(in.s);
+    }
+  }
+  printf("(times are per node; Mnodes/s is from the fastest run; bytes is heap growth per node, and allocs is\n"
+         "allocations per node, both from the last run; - means the stage's allocations can't be counted)\n");
+  return 0;
+}
+
+// the generators had better produce things that parse, with the right counts
+void test_bench1() {
+  const char* shapes[] = { "balanced", "deep-left", "deep-right", "wide", "random" };
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  for (size_t i = 0; i < sizeof shapes / sizeof shapes[0]; i++) {
+    srand(7);
+    struct BenchInput in = bench_input(shapes[i], 999);
+    struct NTree* t = parse_ntree(&a, &tb, in.s, in.len, NULL, 0);
+    // count nodes in the n-ary tree
+    size_t count = 0;
+    struct NTree* stack[2048];
+    size_t n = 0;
+    stack[n++] = t;
+    while (n > 0) {
+      struct NTree* x = stack[--n];
+      count++;
+      for (uint32_t j = 0; j < x->n; j++) {
+        stack[n++] = x->children[j];
+      }
+    }
+    assert_int_eq2((int)count, (int)in.nodes);
+    if (!in.nary) {
+      assert_int_eq2(eval_string_n2(&a, in.s, in.len), eval_ntree(t, NULL));
+    }
+    arena_reset(&a);
+    free(in.s);
+  }
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+void test_bench2() {
+  char src[] = "(* (- 7 4) (+ (/ 26 2) 1))";
+  struct BenchInput in = { "test", src, strlen(src), 9, 3, 0 };
+  struct BenchState st;
+  memset(&st, 0, sizeof st);
+  st.in = &in;
+  st.arena = arena_init();
+  // one malloc per node
+  struct Tree* tr = bench_parse4(&st);
+  size_t count = 0;
+  struct Tree* stack[16];
+  size_t n = 0;
+  stack[n++] = tr;
+  while (n > 0) {
+    struct Tree* x = stack[--n];
+    count++;
+    if (x->left != NULL) {
+      stack[n++] = x->left;
+      stack[n++] = x->right;
+    }
+  }
+  assert_int_eq2((int)bench_allocs_tree(&st, tr, 0), (int)count);
+  bench_free_tree(tr);
+  // the first arena parse takes a block, and the next one reuses it
+  size_t blocks = arena_blocks(&st.arena);
+  bench_parse_arena(&st);
+  assert_int_eq2((int)(arena_blocks(&st.arena) - blocks), 1);
+  bench_parse_arena(&st);
+  assert_int_eq2((int)arena_blocks(&st.arena), 1);
+  arena_free(&st.arena);
+}
+
+__attribute__((constructor(101))) void register_bench() {
+  register_command("--bench", run_bench);
+  register_test("test_bench1", test_bench1);
+  register_test("test_bench2", test_bench2);
+}
+
+// the benchmark tells us which backend is fastest, but not where the time goes
+// on a call to eval_string4: strlen in tokenizer_init, the tokenizer, malloc in
+// binary_node, or eval2. so here's an instrumented copy of its pipeline that
+// splits those out, on top of the counters that the checked entry points keep.
+// like those, it only counts in a -DEVAL_STATS=1 build.
+//
+// usage: --stats EXPR...
+
+struct StatsParser {
+  struct Parser p;
+  struct EvalStats* st;
+};
+
+void stats_advance(struct StatsParser* p) {
+  uint64_t t0 = STAT_CLOCK();
+  parser_advance(&p->p);
+  STAT_ADD(p->st, cycles_lex, STAT_CLOCK() - t0);
+  STAT_ADD(p->st, tokens, 1);
+}
+
+struct Tree* stats_leaf_node(struct StatsParser* p, int x) {
+  uint64_t t0 = STAT_CLOCK();
+  struct Tree* r = leaf_node(x);
+  STAT_ADD(p->st, cycles_alloc, STAT_CLOCK() - t0);
+  STAT_ADD(p->st, nodes, 1);
+  STAT_ADD(p->st, bytes, sizeof *r);
+  return r;
+}
+
+struct Tree* stats_binary_node(struct StatsParser* p, char op, struct Tree* left, struct Tree* right) {
+  uint64_t t0 = STAT_CLOCK();
+  struct Tree* r = binary_node(op, left, right);
+  STAT_ADD(p->st, cycles_alloc, STAT_CLOCK() - t0);
+  STAT_ADD(p->st, nodes, 1);
+  STAT_ADD(p->st, bytes, sizeof *r);
+  return r;
+}
+
+// match_expression3, with counting
+struct Tree* stats_match_expression(struct StatsParser* p, unsigned long depth) {
+  STAT_MAX(p->st, max_depth, depth);
+  struct Token t = parser_current(&p->p);
+  if (t.t == TOKEN_LPAREN) {
+    stats_advance(p);
+    struct Token op = parser_current(&p->p);
+    if (!is_op_token(op.t)) {
+      parser_bail("expected op");
+    }
+    stats_advance(p);
+    struct Tree* left = stats_match_expression(p, depth + 1);
+    struct Tree* right = stats_match_expression(p, depth + 1);
+    if (parser_current(&p->p).t != TOKEN_RPAREN) {
+      parser_bail("unexpected token type");
+    }
+    stats_advance(p);
+    return stats_binary_node(p, *op.s, left, right);
+  } else if (t.t == TOKEN_NUM) {
+    stats_advance(p);
+    return stats_leaf_node(p, strtol(t.s, NULL, 10));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+// like eval_string4, but fills in *st for this call (if st isn't NULL) and adds
+// it to EVAL_STATS_TOTAL. unlike eval_string4, it frees its tree.
+int eval_string_stats(const char* s, struct EvalStats* st) {
+  struct EvalStats local;
+  memset(&local, 0, sizeof local);
+  local.calls = 1;
+
+  uint64_t t0 = STAT_CLOCK();
+  struct Tokenizer tz = tokenizer_init(s);
+  uint64_t t1 = STAT_CLOCK();
+  STAT_ADD(&local, cycles_init, t1 - t0);
+
+  struct StatsParser pr;
+  pr.p = parser_init(&tz);
+  pr.st = &local;
+  stats_advance(&pr);
+  uint64_t lex_before = local.cycles_lex;
+  uint64_t t2 = STAT_CLOCK();
+  struct Tree* tr = stats_match_expression(&pr, 1);
+  if (!parser_done(&pr.p)) {
+    parser_bail("trailing input");
+  }
+  uint64_t t3 = STAT_CLOCK();
+  STAT_ADD(&local, cycles_parse, (t3 - t2) - (local.cycles_lex - lex_before) - local.cycles_alloc);
+
+  int r = eval2(tr);
+  STAT_ADD(&local, cycles_eval, STAT_CLOCK() - t3);
+
+  bench_free_tree(tr);
+#if EVAL_STATS
+  stats_accumulate(&EVAL_STATS_TOTAL, &local);
+#endif
+  if (st != NULL) {
+    *st = local;
+  }
+  return r;
+}
+
+int run_stats(int argc, char** argv) {
+  for (int i = 2; i < argc; i++) {
+    printf("%d\n", eval_string_stats(argv[i], NULL));
+  }
+  fflush(stdout);
+  struct EvalStats total;
+  stats_snapshot(&total);
+  stats_print(stderr, &total);
+  return 0;
+}
+
+void test_stats1() {
+  struct EvalStats st;
+  struct EvalStats before;
+  struct EvalStats after;
+  stats_snapshot(&before);
+  assert_int_eq2(eval_string_stats("(* (- 7 4) (+ (/ 26 2) 1))", &st), 42);
+  stats_snapshot(&after);
+#if EVAL_STATS
+  assert_int_eq2(after.calls, before.calls + 1);
+  // ( * ( - 7 4 ) ( + ( / 26 2 ) 1 ) ) and EOF
+  assert_int_eq2(st.tokens, 18);
+  assert_int_eq2(st.nodes, 9);
+  assert_int_eq2(st.bytes, 9 * sizeof(struct Tree));
+  assert_int_eq2(st.max_depth, 4);
+#else
+  assert_int_eq2(after.calls, before.calls);
+#endif
+}
+
+// the checked entry points, including from the pool's workers
+void test_stats2() {
+  struct EvalStats before;
+  struct EvalStats after;
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  int x;
+  stats_snapshot(&before);
+  assert_int_eq2(eval_string_checked(&a, &tb, "(+ 1 (* 2 3) 4)", 15, &x, &err), EVAL_OK);
+  stats_snapshot(&after);
+#if EVAL_STATS
+  assert_int_eq2(after.calls, before.calls + 1);
+  // ( + 1 ( * 2 3 ) 4 ) and EOF
+  assert_int_eq2(after.tokens - before.tokens, 11);
+  assert_int_eq2(after.nodes - before.nodes, 6);
+  assert_int_eq2(after.bytes - before.bytes, 6 * sizeof(struct NTree) + 5 * sizeof(struct NTree*));
+#endif
+
+  const char* exprs[] = { "(+ 1 2)", "(/ 1 0)", "(+ 1", "7" };
+  int results[4];
+  struct EvalError errs[4];
+  stats_snapshot(&before);
+  eval_batch_errors(exprs, results, errs, 4);
+  stats_snapshot(&after);
+#if EVAL_STATS
+  // an expression that doesn't parse still counts as a call
+  assert_int_eq2(after.calls - before.calls, 4);
+#else
+  assert_int_eq2(after.calls, before.calls);
+#endif
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_stats() {
+  register_command("--stats", run_stats);
+  register_test("test_stats1", test_stats1);
+  register_test("test_stats2", test_stats2);
+}
+
+// when the binary gets started once per request, every request pays for process
+// startup, for main's self-tests, and for cold caches. so here's a server mode
+// that stays up and keeps everything warm: an arena, the compiled-expression
+// cache, and the worker pool. (like every other mode, it's dispatched before
+// main runs, so the self-tests only run with --self-test.)
+//
+// usage: --server [SOCKET_PATH]
+//
+// without a path, requests come from stdin and responses go to stdout. with one,
+// it listens on a Unix socket and serves connections one at a time. either way,
+// the protocol is one request per line:
+//
+//   EXPR         evaluate EXPR and respond with the result or "error: ..."
+//   !batch N     the next N lines are expressions to evaluate on the worker
+//                pool; responds with N lines. N is at most SERVER_MAX_BATCH.
+//   !stats       respond with the cache's counters
+//
+// responses are flushed whenever there's no complete request left in the input
+// buffer, so a client that pipelines requests gets its responses in big writes.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+uint64_t hash_bytes(const char* s, size_t n) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// cache_lookup compiles with compile_string, which exits on bad input, and needs
+// a NUL-terminated key. this one compiles with formula_compile_checked instead,
+// and returns NULL (without caching anything) if that fails.
+struct CacheEntry* cache_lookup_checked(struct ExprCache* c, const char* s, size_t n, struct EvalError* err) {
+  uint64_t h = hash_bytes(s, n);
+  struct CacheEntry** bucket = &c->buckets[h & (c->nbuckets - 1)];
+  for (struct CacheEntry* e = *bucket; e != NULL; e = e->chain) {
+    if (e->hash == h && e->keylen == n && memcmp(e->key, s, n) == 0) {
+      c->hits++;
+      e->uses++;
+      if (e != c->head) {
+        cache_unlink_lru(c, e);
+        cache_push_front(c, e);
+      }
+      return e;
+    }
+  }
+
+  c->misses++;
+  struct Formula* f;
+  if (formula_compile_checked(s, n, NULL, 0, &f, err) != EVAL_OK) {
+    return NULL;
+  }
+  if (c->size >= c->capacity) {
+    cache_evict(c);
+  }
+  struct CacheEntry* e = malloc(sizeof *e);
+  e->key = malloc(n + 1);
+  memcpy(e->key, s, n);
+  e->key[n] = '\0';
+  e->keylen = n;
+  e->hash = h;
+  e->prog = f->prog;
+  free(f);
+  e->uses = 1;
+  e->chain = *bucket;
+  *bucket = e;
+  cache_push_front(c, e);
+  c->size++;
+  return e;
+}
+
+struct Server {
+  struct ExprCache* cache;
+  struct WorkerPool* pool;
+};
+
+size_t SERVER_CACHE_SIZE = 4096;
+
+struct Server* server_new(struct WorkerPool* pool) {
+  struct Server* sv = malloc(sizeof *sv);
+  sv->cache = cache_new(SERVER_CACHE_SIZE);
+  sv->pool = pool;
+  return sv;
+}
+
+void server_free(struct Server* sv) {
+  cache_free(sv->cache);
+  free(sv);
+}
+
+// is there a complete line waiting in the buffer, i.e. can line_reader_next
+// return without blocking?
+int line_reader_has_line(struct LineReader* r) {
+  return r->eof ? r->pos < r->len : memchr(r->buf + r->pos, '\n', r->len - r->pos) != NULL;
+}
+
+int starts_with(const char* s, size_t n, const char* prefix) {
+  size_t k = strlen(prefix);
+  return n >= k && memcmp(s, prefix, k) == 0;
+}
+
+void server_eval(struct Server* sv, const char* s, size_t n, struct Writer* w) {
+  struct EvalError err;
+  uint64_t t0 = STAT_CLOCK();
+  struct CacheEntry* e = cache_lookup_checked(sv->cache, s, n, &err);
+  uint64_t t1 = STAT_CLOCK();
+  if (e == NULL) {
+    stats_record(1, NULL, NULL, t1 - t0, 0);
+    writer_error(w, &err);
+  } else {
+    int x;
+    int status = vm_run_checked(e->prog, NULL, &x);
+    stats_record(1, NULL, NULL, t1 - t0, STAT_CLOCK() - t1);
+    if (status == EVAL_OK) {
+      writer_int(w, x);
+    } else {
+      err.status = status;
+      err.msg = eval_status_string(status);
+      writer_error(w, &err);
+    }
+  }
+  writer_char(w, '\n');
+}
+
+// the most expressions one !batch can have. the count comes from the client, and
+// everything for the batch is allocated up front.
+size_t SERVER_MAX_BATCH = 1 << 20;
+
+// parse the N in "!batch N": nothing but digits, and no more than
+// SERVER_MAX_BATCH
+int server_batch_count(const char* s, size_t n, size_t* out) {
+  if (n == 0) {
+    return 0;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return 0;
+    }
+    count = count * 10 + (size_t)(s[i] - '0');
+    if (count > SERVER_MAX_BATCH) {
+      return 0;
+    }
+  }
+  *out = count;
+  return 1;
+}
+
+// if there's no memory for the batch, its lines are still read, so that the
+// client gets one response per line either way
+void server_batch(struct Server* sv, struct LineReader* r, size_t count, struct Writer* w) {
+  if (count == 0) {
+    return;
+  }
+  char** exprs = malloc(count * sizeof *exprs);
+  int* results = malloc(count * sizeof *results);
+  struct EvalError* errs = malloc(count * sizeof *errs);
+  int ok = exprs != NULL && results != NULL && errs != NULL;
+  size_t k = 0;
+  size_t kept = 0;
+  const char* s;
+  size_t n;
+  while (k < count && line_reader_next(r, &s, &n)) {
+    k++;
+    if (!ok) {
+      continue;
+    }
+    char* e = malloc(n + 1);
+    if (e == NULL) {
+      ok = 0;
+      continue;
+    }
+    memcpy(e, s, n);
+    e[n] = '\0';
+    exprs[kept++] = e;
+  }
+  if (ok) {
+    pool_eval_batch_errors(sv->pool, (const char**)exprs, results, errs, k);
+  }
+  for (size_t i = 0; i < k; i++) {
+    if (!ok) {
+      writer_bytes(w, "error: out of memory", 20);
+    } else if (errs[i].status == EVAL_OK) {
+      writer_int(w, results[i]);
+    } else {
+      writer_error(w, &errs[i]);
+    }
+    writer_char(w, '\n');
+  }
+  // the error tokens point into the expressions, so free those last
+  for (size_t i = 0; i < kept; i++) {
+    free(exprs[i]);
+  }
+  free(exprs);
+  free(results);
+  free(errs);
+}
+
+void server_stats(struct Server* sv, struct Writer* w) {
+  char buf[160];
+  int k = snprintf(buf, sizeof buf, "hits %lu misses %lu evictions %lu size %zu\n", sv->cache->hits,
+                   sv->cache->misses, sv->cache->evictions, sv->cache->size);
+  writer_bytes(w, buf, k);
+}
+
+// returns once the client has stopped sending, or once writing to it has failed
+void server_serve(struct Server* sv, struct LineReader* r, struct Writer* w) {
+  const char* s;
+  size_t n;
+  while (!w->failed && line_reader_next(r, &s, &n)) {
+    if (n > 0 && s[n - 1] == '\r') {
+      n--;
+    }
+    if (n == 0) {
+      // nothing to do
+    } else if (starts_with(s, n, "!batch ")) {
+      size_t count;
+      if (server_batch_count(s + 7, n - 7, &count)) {
+        server_batch(sv, r, count, w);
+      } else {
+        // there's no telling how many lines were meant to follow, so they're
+        // served as ordinary requests
+        char buf[80];
+        int k = snprintf(buf, sizeof buf, "error: expected a batch size from 0 to %zu\n", SERVER_MAX_BATCH);
+        writer_bytes(w, buf, k);
+      }
+    } else if (n == 6 && memcmp(s, "!stats", 6) == 0) {
+      server_stats(sv, w);
+    } else {
+      server_eval(sv, s, n, w);
+    }
+    if (!line_reader_has_line(r)) {
+      writer_flush(w);
+    }
+  }
+  writer_flush(w);
+}
+
+int serve_unix_socket(struct Server* sv, const char* path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "could not listen on %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  struct Writer* w = malloc(sizeof *w);
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "accept failed: %s\n", strerror(errno));
+      break;
+    }
+    // a client that goes away early only ends its own connection
+    struct LineReader r = line_reader_init(conn);
+    writer_init_socket(w, conn);
+    server_serve(sv, &r, w);
+    line_reader_free(&r);
+    close(conn);
+  }
+  free(w);
+  close(fd);
+  return 1;
+}
+
+int run_server(int argc, char** argv) {
+  struct Server* sv = server_new(default_pool());
+  int status = 0;
+  if (argc >= 3) {
+    status = serve_unix_socket(sv, argv[2]);
+  } else {
+    struct LineReader r = line_reader_init(0);
+    writer_init(&STDOUT_WRITER, 1);
+    server_serve(sv, &r, &STDOUT_WRITER);
+    line_reader_free(&r);
+  }
+  server_free(sv);
+  stats_report();
+  return status;
+}
+
+struct Server* TEST_SERVER;
+
+void serve_test_server(struct LineReader* r, struct Writer* w) {
+  server_serve(TEST_SERVER, r, w);
+}
+
+void test_server1() {
+  TEST_SERVER = server_new(default_pool());
+  const char* input =
+    "(+ 1 2)\n"
+    "(+ 1 2)\n"
+    "(/ 1 0)\n"
+    "(+ 1\n"
+    "\n"
+    "!batch 3\n"
+    "(* 6 7)\n"
+    "(+\n"
+    "(- 10 1)\n"
+    "(+ 1 2)\r\n"
+    "!stats\n";
+  // the second time through (from a pipe), everything that compiled was already
+  // cached, so only the bad line misses again
+  const char* stats[] = { "hits 2 misses 3 evictions 0 size 2\n", "hits 6 misses 4 evictions 0 size 2\n" };
+  for (int use_pipe = 0; use_pipe <= 1; use_pipe++) {
+    char* out = stream_through_files(input, use_pipe, serve_test_server);
+    char want[256];
+    snprintf(want, sizeof want, "%s%s",
+             "3\n3\nerror: division by zero\nerror: expected ')' at offset 4\n"
+             "42\nerror: expected ')' at offset 2\n9\n3\n",
+             stats[use_pipe]);
+    assert_str_eq(out, want);
+    free(out);
+  }
+  assert_int_eq2(TEST_SERVER->cache->misses, 4);
+  server_free(TEST_SERVER);
+}
+
+// bad batch sizes and deep expressions get an error line, and the server keeps
+// going
+void test_server2() {
+  TEST_SERVER = server_new(default_pool());
+  const char* input =
+    "!batch 99999999999999\n"
+    "(+ 1 2)\n"
+    "!batch -1\n"
+    "!batch \n"
+    "!batch 0\n"
+    "(* 6 7)\n";
+  char* out = stream_through_files(input, 0, serve_test_server);
+  assert_str_eq(out,
+                "error: expected a batch size from 0 to 1048576\n3\n"
+                "error: expected a batch size from 0 to 1048576\n"
+                "error: expected a batch size from 0 to 1048576\n42\n");
+  free(out);
+
+  char* deep = make_deep_expression(300000, 1);
+  size_t n = strlen(deep);
+  char* in = malloc(3 * n + 100);
+  snprintf(in, 3 * n + 100, "%s\n!batch 2\n%s\n(+ 1 2)\n%s\n", deep, deep, deep);
+  out = stream_through_files(in, 0, serve_test_server);
+  assert_str_eq(out,
+                "error: too deeply nested at offset 50000 ('(')\n"
+                "error: too deeply nested at offset 50000 ('(')\n3\n"
+                "error: too deeply nested at offset 50000 ('(')\n");
+  free(out);
+  free(in);
+  free(deep);
+  server_free(TEST_SERVER);
+}
+
+// a client that sends its requests and hangs up without reading the responses
+// only ends its own connection. without MSG_NOSIGNAL, the first response to it
+// would kill the whole process with SIGPIPE.
+void test_server3() {
+  TEST_SERVER = server_new(default_pool());
+  int fds[2];
+  assert_int_eq2(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  const char* line = "(+ 1 2)\n";
+  for (int i = 0; i < 100; i++) {
+    assert_int_eq2(write(fds[1], line, strlen(line)), strlen(line));
+  }
+  close(fds[1]);
+  struct LineReader r = line_reader_init(fds[0]);
+  struct Writer* w = malloc(sizeof *w);
+  writer_init_socket(w, fds[0]);
+  server_serve(TEST_SERVER, &r, w);
+  assert_int_eq2(w->failed, 1);
+  line_reader_free(&r);
+  close(fds[0]);
+  free(w);
+
+  char* out = stream_through_files("(* 6 7)\n", 0, serve_test_server);
+  assert_str_eq(out, "42\n");
+  free(out);
+  server_free(TEST_SERVER);
+}
+
+__attribute__((constructor(101))) void register_server() {
+  register_command("--server", run_server);
+  register_test("test_server1", test_server1);
+  register_test("test_server2", test_server2);
+  register_test("test_server3", test_server3);
+}
+
+// generated formulas tend to repeat themselves, like (* (+ x 1) (+ x 1)), and
+// every builder so far makes a fresh node for every occurrence, which every
+// evaluator then recomputes. so here's an interning layer on top of FlatTree:
+// before pushing a node, look it up in a hash table keyed on (tag, op, left,
+// right) or (tag, op, value), and if an identical node already exists, return
+// its index instead. the tree becomes a DAG, where each distinct subexpression
+// appears exactly once.
+//
+// the nice part is that evaluation needs no memo table. a node can only be
+// interned after its children, so the array is still in topological order, and
+// the linear pass from eval_flat computes each shared node exactly once.
+//
+// variables are leaves with op VAR_OP and their slot as the value, same as in
+// struct Tree.
+
+struct Dag {
+  struct FlatTree ft;
+  // open addressing, index + 1 of the node in each slot (0 means empty)
+  uint32_t* slots;
+  uint32_t nslots;
+  // how many times an intern call returned an existing node
+  uint64_t shared;
+};
+
+struct Dag dag_init(void) {
+  struct Dag d;
+  d.ft = flat_init();
+  d.nslots = 64;
+  d.slots = calloc(d.nslots, sizeof *d.slots);
+  d.shared = 0;
+  return d;
+}
+
+void dag_free(struct Dag* d) {
+  flat_free(&d->ft);
+  free(d->slots);
+  d->slots = NULL;
+  d->nslots = 0;
+}
+
+// forget all the nodes but keep the memory, like arena_reset
+void dag_reset(struct Dag* d) {
+  d->ft.n = 0;
+  memset(d->slots, 0, d->nslots * sizeof *d->slots);
+  d->shared = 0;
+}
+
+uint64_t dag_hash(struct FlatNode* node) {
+  uint64_t h = ((uint64_t)node->tag << 8) | (unsigned char)node->op;
+  if (node->tag == FLAT_LEAF) {
+    h = h * 0x9E3779B97F4A7C15ULL + (uint32_t)node->u.value;
+  } else {
+    h = h * 0x9E3779B97F4A7C15ULL + node->u.b.left;
+    h = h * 0x9E3779B97F4A7C15ULL + node->u.b.right;
+  }
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 32);
+}
+
+int dag_node_eq(struct FlatNode* a, struct FlatNode* b) {
+  if (a->tag != b->tag || a->op != b->op) {
+    return 0;
+  }
+  if (a->tag == FLAT_LEAF) {
+    return a->u.value == b->u.value;
+  }
+  return a->u.b.left == b->u.b.left && a->u.b.right == b->u.b.right;
+}
+
+void dag_grow(struct Dag* d) {
+  uint32_t n = d->nslots * 2;
+  uint32_t* slots = calloc(n, sizeof *slots);
+  if (slots == NULL) {
+    fprintf(stderr, "dag: out of memory\n");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < d->nslots; i++) {
+    if (d->slots[i] == 0) {
+      continue;
+    }
+    uint32_t j = dag_hash(&d->ft.nodes[d->slots[i] - 1]) & (n - 1);
+    while (slots[j] != 0) {
+      j = (j + 1) & (n - 1);
+    }
+    slots[j] = d->slots[i];
+  }
+  free(d->slots);
+  d->slots = slots;
+  d->nslots = n;
+}
+
+uint32_t dag_intern(struct Dag* d, struct FlatNode node) {
+  // keep the load factor under 1/2 so the probe sequences stay short
+  if ((d->ft.n + 1) * 2 > d->nslots) {
+    dag_grow(d);
+  }
+  uint32_t mask = d->nslots - 1;
+  uint32_t j = dag_hash(&node) & mask;
+  while (d->slots[j] != 0) {
+    uint32_t k = d->slots[j] - 1;
+    if (dag_node_eq(&d->ft.nodes[k], &node)) {
+      d->shared++;
+      return k;
+    }
+    j = (j + 1) & mask;
+  }
+  uint32_t k = flat_push(&d->ft, node);
+  d->slots[j] = k + 1;
+  return k;
+}
+
+uint32_t dag_leaf_node(struct Dag* d, int x) {
+  struct FlatNode node;
+  memset(&node, 0, sizeof node);
+  node.tag = FLAT_LEAF;
+  node.u.value = x;
+  return dag_intern(d, node);
+}
+
+uint32_t dag_var_node(struct Dag* d, int slot) {
+  struct FlatNode node;
+  memset(&node, 0, sizeof node);
+  node.tag = FLAT_LEAF;
+  node.op = VAR_OP;
+  node.u.value = slot;
+  return dag_intern(d, node);
+}
+
+// + and * are commutative, so put their operands in a canonical order first, and
+// (+ x 1) and (+ 1 x) become the same node
+uint32_t dag_binary_node(struct Dag* d, char op, uint32_t left, uint32_t right) {
+  if ((op == '+' || op == '*') && left > right) {
+    uint32_t tmp = left;
+    left = right;
+    right = tmp;
+  }
+  struct FlatNode node;
+  memset(&node, 0, sizeof node);
+  node.tag = FLAT_BINARY;
+  node.op = op;
+  node.u.b.left = left;
+  node.u.b.right = right;
+  return dag_intern(d, node);
+}
+
+// intern an existing pointer tree, e.g. one from parser_parse4 or parser_parse9
+uint32_t dag_from_tree(struct Dag* d, struct Tree* tr) {
+  if (tr->left == NULL) {
+    return is_var_node(tr) ? dag_var_node(d, tr->value) : dag_leaf_node(d, tr->value);
+  }
+  uint32_t left = dag_from_tree(d, tr->left);
+  uint32_t right = dag_from_tree(d, tr->right);
+  return dag_binary_node(d, tr->op, left, right);
+}
+
+// or skip the pointer tree altogether, and parse straight into the DAG, so
+// repeated subexpressions never take up more than one node
+
+uint32_t match_dag_binary_expression(struct Parser5* p, struct Dag* d);
+
+uint32_t match_dag_expression(struct Parser5* p, struct Dag* d) {
+  struct PackedToken* t = parser4_current(&p->p);
+  if (t->t == TOKEN_LPAREN) {
+    return match_dag_binary_expression(p, d);
+  } else if (t->t == TOKEN_NUM) {
+    parser4_advance(&p->p);
+    return dag_leaf_node(d, t->value);
+  } else if (t->t == TOKEN_SYMBOL) {
+    parser4_advance(&p->p);
+    return dag_var_node(d, resolve_param(p, t));
+  } else {
+    parser_bail("expected expression");
+    return 0;
+  }
+}
+
+uint32_t match_dag_binary_expression(struct Parser5* p, struct Dag* d) {
+  consume4(&p->p, TOKEN_LPAREN);
+  struct PackedToken* t = parser4_current(&p->p);
+  if (!is_op_token(t->t)) {
+    parser_bail("expected op");
+  }
+  char op = p->p.tb->src[t->off];
+  parser4_advance(&p->p);
+  uint32_t left = match_dag_expression(p, d);
+  uint32_t right = match_dag_expression(p, d);
+  consume4(&p->p, TOKEN_RPAREN);
+  return dag_binary_node(d, op, left, right);
+}
+
+// lex and parse the n bytes at s into d, returning the root's index
+uint32_t parse_dag(struct Dag* d, struct TokenBuffer* tb, const char* s, size_t n, const char** params,
+                   int nparams) {
+  lex_all2(tb, s, n);
+  struct Parser5 p;
+  p.p.tb = tb;
+  p.p.i = 0;
+  p.p.arena = NULL;
+  p.params = params;
+  p.nparams = nparams;
+  uint32_t r = match_dag_expression(&p, d);
+  if (parser4_current(&p.p)->t != TOKEN_EOF) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// eval_flat with variables. every node is computed once, however many parents
+// it has.
+int eval_dag(struct Dag* d, uint32_t root, const int* inputs) {
+  struct FlatTree* ft = &d->ft;
+  if (ft->values_cap < ft->n) {
+    free(ft->values);
+    ft->values_cap = ft->cap;
+    ft->values = malloc(ft->values_cap * sizeof *ft->values);
+    if (ft->values == NULL) {
+      fprintf(stderr, "dag: out of memory\n");
+      exit(1);
+    }
+  }
+
+  struct FlatNode* nodes = ft->nodes;
+  int* values = ft->values;
+  for (uint32_t i = 0; i <= root; i++) {
+    struct FlatNode node = nodes[i];
+    if (node.tag == FLAT_LEAF) {
+      values[i] = node.op == VAR_OP ? inputs[node.u.value] : node.u.value;
+    } else {
+      values[i] = apply_op(node.op, values[node.u.b.left], values[node.u.b.right]);
+    }
+  }
+  return values[root];
+}
+
+// (+ e e) nested `depth` times around x, which is x * 2^depth and has 2^depth
+// copies of x, but only depth + 1 distinct subexpressions
+char* make_doubling_expression(int depth) {
+  struct StrBuf sb = { NULL, 0, 0 };
+  strbuf_append(&sb, "x", 1);
+  for (int i = 0; i < depth; i++) {
+    struct StrBuf next = { NULL, 0, 0 };
+    strbuf_append(&next, "(+ ", 3);
+    strbuf_append(&next, sb.s, sb.n);
+    strbuf_append(&next, " ", 1);
+    strbuf_append(&next, sb.s, sb.n);
+    strbuf_append(&next, ")", 1);
+    free(sb.s);
+    sb = next;
+  }
+  return sb.s;
+}
+
+void test_dag1() {
+  const char* params[] = { "x", "y" };
+  struct Dag d = dag_init();
+  struct TokenBuffer tb = token_buffer_init();
+  int inputs[] = { 4, 10 };
+
+  const char* s = "(* (+ x 1) (+ x 1))";
+  uint32_t r = parse_dag(&d, &tb, s, strlen(s), params, 2);
+  // x, 1, (+ x 1), and the product
+  assert_int_eq2(d.ft.n, 4);
+  assert_int_eq2(eval_dag(&d, r, inputs), 25);
+
+  dag_reset(&d);
+  s = "(- (* (+ 1 x) y) (* y (+ x 1)))";
+  r = parse_dag(&d, &tb, s, strlen(s), params, 2);
+  // the operands of + and * are put in canonical order, so both sides match
+  assert_int_eq2(d.ft.n, 6);
+  assert_int_eq2(eval_dag(&d, r, inputs), 0);
+
+  // the same thing by way of a pointer tree
+  dag_reset(&d);
+  struct Tree* tr = arena_binary_node(&EVAL_ARENA, '/', arena_var_node(&EVAL_ARENA, 1),
+                                      arena_binary_node(&EVAL_ARENA, '-', arena_var_node(&EVAL_ARENA, 1),
+                                                        arena_leaf_node(&EVAL_ARENA, 5)));
+  r = dag_from_tree(&d, tr);
+  assert_int_eq2(d.ft.n, 4);
+  assert_int_eq2(eval_dag(&d, r, inputs), 2);
+  arena_reset(&EVAL_ARENA);
+
+  dag_reset(&d);
+  int depth = 16;
+  char* deep = make_doubling_expression(depth);
+  r = parse_dag(&d, &tb, deep, strlen(deep), params, 2);
+  assert_int_eq2(d.ft.n, depth + 1);
+  // every occurrence but the first of each subexpression was shared: 2^depth
+  // copies of x, plus 2^(depth - k) copies of the node at each level k
+  assert_int_eq2(d.shared, 2 * ((1 << depth) - 1) - depth);
+  assert_int_eq2(eval_dag(&d, r, inputs), 4 << depth);
+  free(deep);
+
+  token_buffer_free(&tb);
+  dag_free(&d);
+}
+
+__attribute__((constructor(101))) void register_dag() {
+  register_test("test_dag1", test_dag1);
+}
+
+// incremental evaluation. picture thousands of formulas over a shared set of
+// inputs, where each tick changes one of them: re-running every formula is
+// wasteful when most of the values can't have changed.
+//
+// so all the formulas go into one Dag, which means shared subexpressions are
+// shared across formulas too, and we keep every node's last value. each node also
+// gets a list of its parents. when an input changes, its leaf goes on a worklist;
+// each node taken off the worklist is recomputed from its children's cached
+// values, and only if its value actually changed do its parents go on the
+// worklist. that way a tick costs time in proportion to the part of the DAG that
+// the change reaches, not to the total size of all the formulas.
+//
+// the worklist is a min-heap of node indices. since children always come before
+// their parents in the array, taking nodes in index order means a node is only
+// ever recomputed after all of its dirty children, and only once per tick.
+
+struct ParentEdge {
+  uint32_t parent;
+  // the next edge out of the same child, or UINT32_MAX
+  uint32_t next;
+};
+
+struct IncEval {
+  struct Dag dag;
+  // the current value of each node in the DAG
+  int* values;
+  // the head of each node's list of parent edges
+  uint32_t* first_parent;
+  // whether each node is on the worklist
+  unsigned char* queued;
+  uint32_t node_cap;
+
+  struct ParentEdge* edges;
+  uint32_t nedges;
+  uint32_t edges_cap;
+
+  int* inputs;
+  // the leaf node for each input (there's at most one, thanks to interning), or
+  // UINT32_MAX if no formula uses it
+  uint32_t* input_nodes;
+  int ninputs;
+
+  // the root of each formula
+  uint32_t* roots;
+  uint32_t nroots;
+  uint32_t roots_cap;
+
+  uint32_t* heap;
+  uint32_t heap_n;
+  uint32_t heap_cap;
+
+  // how many nodes have been recomputed, for the tests
+  uint64_t recomputed;
+};
+
+struct IncEval* inc_new(int ninputs) {
+  struct IncEval* e = calloc(1, sizeof *e);
+  e->dag = dag_init();
+  e->ninputs = ninputs;
+  e->inputs = calloc(ninputs > 0 ? ninputs : 1, sizeof *e->inputs);
+  e->input_nodes = malloc((ninputs > 0 ? ninputs : 1) * sizeof *e->input_nodes);
+  for (int i = 0; i < ninputs; i++) {
+    e->input_nodes[i] = UINT32_MAX;
+  }
+  return e;
+}
+
+void inc_free(struct IncEval* e) {
+  dag_free(&e->dag);
+  free(e->values);
+  free(e->first_parent);
+  free(e->queued);
+  free(e->edges);
+  free(e->inputs);
+  free(e->input_nodes);
+  free(e->roots);
+  free(e->heap);
+  free(e);
+}
+
+void* inc_grow(void* p, uint32_t* cap, uint32_t need, size_t size) {
+  if (need <= *cap) {
+    return p;
+  }
+  uint32_t n = *cap == 0 ? 64 : *cap;
+  while (n < need) {
+    n *= 2;
+  }
+  p = realloc(p, (size_t)n * size);
+  if (p == NULL) {
+    fprintf(stderr, "inc: out of memory\n");
+    exit(1);
+  }
+  *cap = n;
+  return p;
+}
+
+void inc_add_edge(struct IncEval* e, uint32_t child, uint32_t parent) {
+  e->edges = inc_grow(e->edges, &e->edges_cap, e->nedges + 1, sizeof *e->edges);
+  e->edges[e->nedges].parent = parent;
+  e->edges[e->nedges].next = e->first_parent[child];
+  e->first_parent[child] = e->nedges++;
+}
+
+int inc_compute(struct IncEval* e, uint32_t i) {
+  struct FlatNode node = e->dag.ft.nodes[i];
+  if (node.tag == FLAT_LEAF) {
+    return node.op == VAR_OP ? e->inputs[node.u.value] : node.u.value;
+  }
+  return apply_op(node.op, e->values[node.u.b.left], e->values[node.u.b.right]);
+}
+
+// the nodes from `start` on were just added to the DAG: give them values and
+// hook them up to their children
+void inc_adopt_nodes(struct IncEval* e, uint32_t start) {
+  uint32_t n = e->dag.ft.n;
+  if (n > e->node_cap) {
+    uint32_t cap = e->node_cap;
+    e->values = inc_grow(e->values, &cap, n, sizeof *e->values);
+    cap = e->node_cap;
+    e->first_parent = inc_grow(e->first_parent, &cap, n, sizeof *e->first_parent);
+    cap = e->node_cap;
+    e->queued = inc_grow(e->queued, &cap, n, sizeof *e->queued);
+    e->node_cap = cap;
+  }
+  for (uint32_t i = start; i < n; i++) {
+    struct FlatNode node = e->dag.ft.nodes[i];
+    e->first_parent[i] = UINT32_MAX;
+    e->queued[i] = 0;
+    if (node.tag == FLAT_BINARY) {
+      inc_add_edge(e, node.u.b.left, i);
+      if (node.u.b.right != node.u.b.left) {
+        inc_add_edge(e, node.u.b.right, i);
+      }
+    } else if (node.op == VAR_OP) {
+      e->input_nodes[node.u.value] = i;
+    }
+    e->values[i] = inc_compute(e, i);
+  }
+}
+
+uint32_t inc_add_root(struct IncEval* e, uint32_t start, uint32_t root) {
+  inc_adopt_nodes(e, start);
+  e->roots = inc_grow(e->roots, &e->roots_cap, e->nroots + 1, sizeof *e->roots);
+  e->roots[e->nroots] = root;
+  return e->nroots++;
+}
+
+void inc_update(struct IncEval* e);
+
+// add a formula from a parsed tree (with variables numbered below ninputs), and
+// return its id. its value is computed from the current inputs.
+uint32_t inc_add_tree(struct IncEval* e, struct Tree* tr) {
+  // new nodes can share old ones, whose values have to be up to date
+  inc_update(e);
+  uint32_t start = e->dag.ft.n;
+  uint32_t root = dag_from_tree(&e->dag, tr);
+  return inc_add_root(e, start, root);
+}
+
+// the same, straight from the source
+uint32_t inc_add(struct IncEval* e, struct TokenBuffer* tb, const char* s, size_t n, const char** params) {
+  inc_update(e);
+  uint32_t start = e->dag.ft.n;
+  uint32_t root = parse_dag(&e->dag, tb, s, n, params, e->ninputs);
+  return inc_add_root(e, start, root);
+}
+
+void inc_push(struct IncEval* e, uint32_t i) {
+  if (e->queued[i]) {
+    return;
+  }
+  e->queued[i] = 1;
+  e->heap = inc_grow(e->heap, &e->heap_cap, e->heap_n + 1, sizeof *e->heap);
+  uint32_t k = e->heap_n++;
+  while (k > 0 && e->heap[(k - 1) / 2] > i) {
+    e->heap[k] = e->heap[(k - 1) / 2];
+    k = (k - 1) / 2;
+  }
+  e->heap[k] = i;
+}
+
+uint32_t inc_pop(struct IncEval* e) {
+  uint32_t top = e->heap[0];
+  uint32_t last = e->heap[--e->heap_n];
+  uint32_t k = 0;
+  for (;;) {
+    uint32_t c = 2 * k + 1;
+    if (c >= e->heap_n) {
+      break;
+    }
+    if (c + 1 < e->heap_n && e->heap[c + 1] < e->heap[c]) {
+      c++;
+    }
+    if (e->heap[c] >= last) {
+      break;
+    }
+    e->heap[k] = e->heap[c];
+    k = c;
+  }
+  e->heap[k] = last;
+  e->queued[top] = 0;
+  return top;
+}
+
+// changes are only recorded here; they're propagated on the next inc_update or
+// inc_value, so setting several inputs in one tick recomputes shared nodes once
+void inc_set_input(struct IncEval* e, int slot, int value) {
+  if (e->inputs[slot] == value) {
+    return;
+  }
+  e->inputs[slot] = value;
+  if (e->input_nodes[slot] != UINT32_MAX) {
+    inc_push(e, e->input_nodes[slot]);
+  }
+}
+
+void inc_update(struct IncEval* e) {
+  while (e->heap_n > 0) {
+    uint32_t i = inc_pop(e);
+    int x = inc_compute(e, i);
+    e->recomputed++;
+    if (x == e->values[i]) {
+      continue;
+    }
+    e->values[i] = x;
+    for (uint32_t j = e->first_parent[i]; j != UINT32_MAX; j = e->edges[j].next) {
+      inc_push(e, e->edges[j].parent);
+    }
+  }
+}
+
+int inc_value(struct IncEval* e, uint32_t id) {
+  inc_update(e);
+  return e->values[e->roots[id]];
+}
+
+struct Tree* parse_tree_with_params(struct Arena* a, struct TokenBuffer* tb, const char* s, const char** params,
+                                    int nparams) {
+  lex_all2(tb, s, strlen(s));
+  struct Parser5 p;
+  p.p.tb = tb;
+  p.p.i = 0;
+  p.p.arena = a;
+  p.params = params;
+  p.nparams = nparams;
+  return parser_parse9(&p);
+}
+
+void test_inc1() {
+  const char* params[] = { "x", "y", "z" };
+  const char* formulas[] = {
+    "(+ (* x x) (* (+ y 1) (- z 2)))",
+    "(* (+ y 1) (- z 2))",
+    "(- (* (* y y) (* y y)) x)",
+    "(/ (+ z 100) (+ (* x x) 1))",
+    "7",
+  };
+  int nformulas = sizeof formulas / sizeof formulas[0];
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct IncEval* e = inc_new(3);
+  struct Tree* trees[5];
+  uint32_t ids[5];
+  for (int i = 0; i < nformulas; i++) {
+    trees[i] = parse_tree_with_params(&a, &tb, formulas[i], params, 3);
+    ids[i] = i % 2 == 0 ? inc_add_tree(e, trees[i]) : inc_add(e, &tb, formulas[i], strlen(formulas[i]), params);
+  }
+
+  int inputs[3] = { 0, 0, 0 };
+  uint64_t seed = 12345;
+  for (int tick = 0; tick < 200; tick++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int slot = (seed >> 33) % 3;
+    int value = (int)((seed >> 40) % 41) - 20;
+    inputs[slot] = value;
+    inc_set_input(e, slot, value);
+    for (int i = 0; i < nformulas; i++) {
+      assert_int_eq2(inc_value(e, ids[i]), eval3(trees[i], inputs));
+    }
+  }
+
+  // changing x only touches x's path: x, (* x x), and the two nodes above it in
+  // the first formula, plus (- ... x) in the third and the division in the fourth
+  inc_update(e);
+  e->recomputed = 0;
+  inc_set_input(e, 0, inputs[0] + 1);
+  inc_update(e);
+  assert_int_eq2(e->recomputed, 6);
+
+  // and setting an input to the value it already has does nothing
+  e->recomputed = 0;
+  inc_set_input(e, 1, inputs[1]);
+  inc_update(e);
+  assert_int_eq2(e->recomputed, 0);
+
+  inc_free(e);
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_inc() {
+  register_test("test_inc1", test_inc1);
+}
+
+// cold start: with tens of thousands of formulas, lexing, parsing, and compiling
+// them all every time the program starts adds up. so here's a file format for
+// compiled formulas that can be mmapped and evaluated in place.
+//
+// there are no pointers in it, only offsets, and everything is a 32-bit word
+// (or two, for the size), so nothing needs fixing up after loading:
+//
+//   header     magic "AOFL", version, byte order mark, formula count, and the
+//              total number of code words
+//   entries    one per formula: offset of its code (in words, from the start of
+//              the code section), code length, max stack depth, and the number of
+//              parameters it takes
+//   code       the bytecode for all of the formulas, back to back
+//
+// the byte order mark is 0x01020304 written in the host's order, so a file from
+// a machine with the other endianness is rejected instead of misread. the
+// version gets bumped whenever the opcodes or the layout change.
+//
+// loading doesn't trust the file: the sizes in the header have to add up to the
+// file's size, and every entry is checked to stay in bounds, use only known
+// opcodes and in-range parameters, and reach exactly the stack depth it claims
+// (the VM sizes its stack from that).
+
+_Static_assert(sizeof(int) == 4, "the bytecode is stored as 32-bit words");
+
+uint32_t LIBRARY_VERSION = 1;
+uint32_t LIBRARY_BYTE_ORDER = 0x01020304;
+
+struct LibraryHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t count;
+  uint64_t code_words;
+};
+
+struct LibraryEntry {
+  uint32_t offset;
+  uint32_t len;
+  uint32_t max_stack;
+  uint32_t nparams;
+};
+
+struct Library {
+  void* map;
+  size_t size;
+  uint32_t count;
+  const struct LibraryEntry* entries;
+  const int* code;
+};
+
+// write the formulas to `out`. returns 0 on success.
+int library_write(FILE* out, struct Formula** fs, uint32_t count) {
+  struct LibraryHeader h;
+  memcpy(h.magic, "AOFL", 4);
+  h.version = LIBRARY_VERSION;
+  h.byte_order = LIBRARY_BYTE_ORDER;
+  h.count = count;
+  h.code_words = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    h.code_words += fs[i]->prog->n;
+  }
+  if (fwrite(&h, sizeof h, 1, out) != 1) {
+    return -1;
+  }
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    struct LibraryEntry e;
+    e.offset = (uint32_t)offset;
+    e.len = (uint32_t)fs[i]->prog->n;
+    e.max_stack = (uint32_t)fs[i]->prog->max_stack;
+    e.nparams = (uint32_t)fs[i]->nparams;
+    if (fwrite(&e, sizeof e, 1, out) != 1) {
+      return -1;
+    }
+    offset += fs[i]->prog->n;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (fwrite(fs[i]->prog->code, sizeof(int), fs[i]->prog->n, out) != fs[i]->prog->n) {
+      return -1;
+    }
+  }
+  return fflush(out) == 0 ? 0 : -1;
+}
+
+// check that one formula's code can't read or write out of bounds
+const char* library_check_entry(const struct LibraryEntry* e, const int* code, uint64_t code_words) {
+  if ((uint64_t)e->offset + e->len > code_words || e->len == 0) {
+    return "code out of bounds";
+  }
+  // Program.max_stack is an int
+  if (e->max_stack > INT_MAX) {
+    return "max_stack out of range";
+  }
+  const int* pc = code + e->offset;
+  const int* end = pc + e->len;
+  uint32_t depth = 0;
+  uint32_t max_depth = 0;
+  while (pc < end) {
+    int op = *pc++;
+    if (op == OP_PUSH_CONST || op == OP_LOAD_VAR) {
+      if (pc == end) {
+        return "truncated instruction";
+      }
+      if (op == OP_LOAD_VAR && (*pc < 0 || (uint32_t)*pc >= e->nparams)) {
+        return "parameter out of range";
+      }
+      pc++;
+      if (++depth > e->max_stack) {
+        return "stack depth exceeds max_stack";
+      }
+      if (depth > max_depth) {
+        max_depth = depth;
+      }
+    } else if (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV) {
+      if (depth < 2) {
+        return "stack underflow";
+      }
+      depth--;
+    } else if (op == OP_RET) {
+      if (depth != 1 || pc != end) {
+        return "bad stack at return";
+      }
+      return max_depth == e->max_stack ? NULL : "wrong max_stack";
+    } else {
+      return "unknown opcode";
+    }
+  }
+  return "missing return";
+}
+
+// map the library in fd and check it. returns 0 on success, or -1 with the
+// reason in *why. the fd can be closed afterwards.
+int library_open_fd(struct Library* lib, int fd, const char** why) {
+  memset(lib, 0, sizeof *lib);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *why = strerror(errno);
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(struct LibraryHeader)) {
+    *why = "file too short";
+    return -1;
+  }
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    *why = strerror(errno);
+    return -1;
+  }
+  const struct LibraryHeader* h = map;
+  *why = NULL;
+  if (memcmp(h->magic, "AOFL", 4) != 0) {
+    *why = "not a formula library";
+  } else if (h->byte_order != LIBRARY_BYTE_ORDER) {
+    *why = "wrong byte order";
+  } else if (h->version != LIBRARY_VERSION) {
+    *why = "unsupported version";
+  } else {
+    // code_words comes from the file, so multiplying it could wrap around.
+    // divide what's left instead.
+    uint64_t rest = size - sizeof *h;
+    if ((uint64_t)h->count * sizeof(struct LibraryEntry) > rest) {
+      *why = "wrong file size";
+    } else {
+      rest -= (uint64_t)h->count * sizeof(struct LibraryEntry);
+      if (rest % sizeof(int) != 0 || h->code_words != rest / sizeof(int)) {
+        *why = "wrong file size";
+      }
+    }
+  }
+  if (*why == NULL) {
+    lib->map = map;
+    lib->size = size;
+    lib->count = h->count;
+    lib->entries = (const struct LibraryEntry*)(h + 1);
+    lib->code = (const int*)(lib->entries + h->count);
+    for (uint32_t i = 0; i < h->count && *why == NULL; i++) {
+      *why = library_check_entry(&lib->entries[i], lib->code, h->code_words);
+    }
+  }
+  if (*why != NULL) {
+    munmap(map, size);
+    memset(lib, 0, sizeof *lib);
+    return -1;
+  }
+  return 0;
+}
+
+int library_open(struct Library* lib, const char* path, const char** why) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    *why = strerror(errno);
+    return -1;
+  }
+  int r = library_open_fd(lib, fd, why);
+  close(fd);
+  return r;
+}
+
+void library_close(struct Library* lib) {
+  if (lib->map != NULL) {
+    munmap(lib->map, lib->size);
+  }
+  memset(lib, 0, sizeof *lib);
+}
+
+// a Program that points straight at the mapped code. it must not be freed.
+struct Program library_program(const struct Library* lib, uint32_t i) {
+  struct Program p;
+  p.code = (int*)(lib->code + lib->entries[i].offset);
+  p.n = lib->entries[i].len;
+  p.cap = 0;
+  p.max_stack = (int)lib->entries[i].max_stack;
+  return p;
+}
+
+int library_eval(const struct Library* lib, uint32_t i, const int* inputs, int* out) {
+  struct Program p = library_program(lib, i);
+  return vm_run_checked(&p, inputs, out);
+}
+
+// usage: --compile INPUT OUTPUT [PARAM...]
+//
+// compiles each line of INPUT (or stdin, if it's "-"; blank lines are skipped)
+// into a library at OUTPUT. every formula can use the parameters named on the
+// command line.
+int run_compile(int argc, char** argv) {
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s --compile INPUT OUTPUT [PARAM...]\n", argv[0]);
+    return 1;
+  }
+  int fd = open_input(argc, argv);
+  const char** params = (const char**)argv + 4;
+  int nparams = argc - 4;
+  struct LineReader r = line_reader_init(fd);
+  struct Formula** fs = NULL;
+  uint32_t count = 0, cap = 0;
+  int status = 0;
+  size_t lineno = 0;
+  const char* s;
+  size_t n;
+  while (line_reader_next(&r, &s, &n)) {
+    lineno++;
+    if (n == 0) {
+      continue;
+    }
+    struct EvalError err;
+    struct Formula* f;
+    if (formula_compile_checked(s, n, params, nparams, &f, &err) != EVAL_OK) {
+      fprintf(stderr, "%s:%zu: %s at offset %zu\n", argv[2], lineno, err.msg, err.offset);
+      status = 1;
+      continue;
+    }
+    fs = inc_grow(fs, &cap, count + 1, sizeof *fs);
+    fs[count++] = f;
+  }
+  line_reader_free(&r);
+  if (fd != 0) {
+    close(fd);
+  }
+
+  if (status == 0) {
+    FILE* out = fopen(argv[3], "wb");
+    if (out == NULL || library_write(out, fs, count) != 0) {
+      fprintf(stderr, "could not write %s: %s\n", argv[3], strerror(errno));
+      status = 1;
+    }
+    if (out != NULL) {
+      fclose(out);
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    formula_free(fs[i]);
+  }
+  free(fs);
+  return status;
+}
+
+// usage: --eval-compiled LIBRARY [INPUT...]
+//
+// evaluates every formula in the library with the given inputs, one result per
+// line
+int run_eval_compiled(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s --eval-compiled LIBRARY [INPUT...]\n", argv[0]);
+    return 1;
+  }
+  struct Library lib;
+  const char* why;
+  if (library_open(&lib, argv[2], &why) != 0) {
+    fprintf(stderr, "%s: %s\n", argv[2], why);
+    return 1;
+  }
+  int ninputs = argc - 3;
+  int* inputs = malloc((ninputs > 0 ? ninputs : 1) * sizeof *inputs);
+  for (int i = 0; i < ninputs; i++) {
+    inputs[i] = (int)strtol(argv[3 + i], NULL, 10);
+  }
+  for (uint32_t i = 0; i < lib.count; i++) {
+    int x;
+    if (lib.entries[i].nparams > (uint32_t)ninputs) {
+      printf("error: needs %u inputs\n", lib.entries[i].nparams);
+      continue;
+    }
+    int status = library_eval(&lib, i, inputs, &x);
+    if (status == EVAL_OK) {
+      printf("%d\n", x);
+    } else {
+      printf("error: %s\n", eval_status_string(status));
+    }
+  }
+  free(inputs);
+  library_close(&lib);
+  return 0;
+}
+
+void test_library1() {
+  const char* params[] = { "x", "y" };
+  const char* sources[] = { "(+ x y)", "(* (- x 1) (+ y (* x 3)))", "42", "(/ y (- x x))" };
+  struct Formula* fs[4];
+  struct EvalError err;
+  for (int i = 0; i < 4; i++) {
+    formula_compile_checked(sources[i], strlen(sources[i]), params, 2, &fs[i], &err);
+  }
+  FILE* f = tmpfile();
+  assert_int_eq2(library_write(f, fs, 4), 0);
+
+  struct Library lib;
+  const char* why;
+  assert_int_eq2(library_open_fd(&lib, fileno(f), &why), 0);
+  assert_int_eq2(lib.count, 4);
+  int inputs[] = { 5, 7 };
+  for (uint32_t i = 0; i < 4; i++) {
+    int want, got;
+    int want_status = formula_eval_checked(fs[i], inputs, &want);
+    assert_int_eq2(library_eval(&lib, i, inputs, &got), want_status);
+    if (want_status == EVAL_OK) {
+      assert_int_eq2(got, want);
+    }
+  }
+  library_close(&lib);
+
+  // corrupt it in a few ways, and make sure it's rejected every time
+  long code_start = sizeof(struct LibraryHeader) + 4 * sizeof(struct LibraryEntry);
+  struct {
+    long offset;
+    uint32_t word;
+  } corruptions[] = {
+    { 4, 2 },                                          // version
+    { sizeof(struct LibraryHeader) + 8, 0 },           // max_stack of the first entry
+    { sizeof(struct LibraryHeader) + 8, 3 },           // more than it needs
+    { sizeof(struct LibraryHeader) + 8, UINT32_MAX },  // more than an int
+    { sizeof(struct LibraryHeader) + 12, 1 },          // nparams of the first entry
+    { code_start, 99 },                                // the first opcode
+    { sizeof(struct LibraryHeader) + 4, 1000000 },     // length of the first entry
+  };
+  for (size_t i = 0; i < sizeof corruptions / sizeof corruptions[0]; i++) {
+    uint32_t old;
+    pread(fileno(f), &old, 4, corruptions[i].offset);
+    pwrite(fileno(f), &corruptions[i].word, 4, corruptions[i].offset);
+    assert_int_eq2(library_open_fd(&lib, fileno(f), &why), -1);
+    pwrite(fileno(f), &old, 4, corruptions[i].offset);
+  }
+  // a code_words that only matches the file size once multiplied by 4 and
+  // wrapped around
+  uint64_t words;
+  pread(fileno(f), &words, 8, 16);
+  uint64_t wrapped = words + (1ULL << 62);
+  pwrite(fileno(f), &wrapped, 8, 16);
+  assert_int_eq2(library_open_fd(&lib, fileno(f), &why), -1);
+  assert_str_eq(why, "wrong file size");
+  pwrite(fileno(f), &words, 8, 16);
+  assert_int_eq2(library_open_fd(&lib, fileno(f), &why), 0);
+  library_close(&lib);
+
+  fclose(f);
+  for (int i = 0; i < 4; i++) {
+    formula_free(fs[i]);
+  }
+}
+
+__attribute__((constructor(101))) void register_library() {
+  register_command("--compile", run_compile);
+  register_command("--eval-compiled", run_eval_compiled);
+  register_test("test_library1", test_library1);
+}
+
+// embedding the interpreter in a multithreaded program. two things stand in the
+// way: the token types are mutable globals, so the compiler has to load them
+// from memory and can't turn read_single_char and is_op_token into jump tables;
+// and the parsers that bail go straight to stderr and exit.
+//
+// the globals can't go away (the old code still refers to them), but from here
+// on, the names refer to compile-time constants instead. nothing ever assigns
+// to the globals, so they can't disagree, and test_interp1 makes sure of it.
+
+const int* TOKEN_GLOBALS[] = {
+  &TOKEN_LPAREN, &TOKEN_RPAREN, &TOKEN_NUM, &TOKEN_PLUS,    &TOKEN_MINUS,  &TOKEN_MUL,
+  &TOKEN_DIV,    &TOKEN_EOF,    &TOKEN_UNKNOWN, &TOKEN_SYMBOL,
+};
+
+#define TOKEN_LPAREN 1
+#define TOKEN_RPAREN 2
+#define TOKEN_NUM 3
+#define TOKEN_PLUS 4
+#define TOKEN_MINUS 5
+#define TOKEN_MUL 6
+#define TOKEN_DIV 7
+#define TOKEN_EOF 8
+#define TOKEN_UNKNOWN 9
+#define TOKEN_SYMBOL 10
+
+int is_op_token2(int t) {
+  switch (t) {
+    case TOKEN_PLUS:
+    case TOKEN_MINUS:
+    case TOKEN_MUL:
+    case TOKEN_DIV:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// read_single_char, but taking the character like it always should have
+int read_single_char2(char c) {
+  switch (c) {
+    case '+': return TOKEN_PLUS;
+    case '-': return TOKEN_MINUS;
+    case '*': return TOKEN_MUL;
+    case '/': return TOKEN_DIV;
+    case '(': return TOKEN_LPAREN;
+    case ')': return TOKEN_RPAREN;
+    default: return TOKEN_UNKNOWN;
+  }
+}
+
+// as for the rest: struct Interp is a context that owns everything an
+// evaluation touches, i.e. its own arena, token buffer, compiled-expression
+// cache, counters, and the last error. the evaluation path goes through the
+// checked parser and VM, which report errors instead of exiting, and the only
+// globals it reads are the character tables, which are filled in before main
+// and never change. so one Interp per thread is safe with no locks at all.
+// (an Interp itself is not meant to be shared between threads.)
+
+struct InterpStats {
+  uint64_t evals;
+  uint64_t errors;
+};
+
+struct Interp {
+  struct Arena arena;
+  struct TokenBuffer tb;
+  struct ExprCache* cache;
+  struct EvalError err;
+  struct InterpStats stats;
+};
+
+// cache_capacity is how many compiled expressions to keep around; with 0,
+// interp_eval doesn't cache at all
+struct Interp* interp_new(size_t cache_capacity) {
+  struct Interp* ip = malloc(sizeof *ip);
+  ip->arena = arena_init();
+  ip->tb = token_buffer_init();
+  ip->cache = cache_capacity > 0 ? cache_new(cache_capacity) : NULL;
+  eval_error_clear(&ip->err);
+  memset(&ip->stats, 0, sizeof ip->stats);
+  return ip;
+}
+
+void interp_free(struct Interp* ip) {
+  arena_free(&ip->arena);
+  token_buffer_free(&ip->tb);
+  if (ip->cache != NULL) {
+    cache_free(ip->cache);
+  }
+  free(ip);
+}
+
+// evaluate the n bytes at s. returns an EVAL_* code; on failure, the details
+// are in interp_error until the next call (and the token in them points into s).
+int interp_eval(struct Interp* ip, const char* s, size_t n, int* out) {
+  ip->stats.evals++;
+  int status;
+  if (ip->cache == NULL) {
+    status = eval_string_checked(&ip->arena, &ip->tb, s, n, out, &ip->err);
+  } else {
+    eval_error_clear(&ip->err);
+    struct CacheEntry* e = cache_lookup_checked(ip->cache, s, n, &ip->err);
+    if (e == NULL) {
+      status = ip->err.status;
+    } else {
+      status = vm_run_checked(e->prog, NULL, out);
+      ip->err.status = status;
+      ip->err.msg = status == EVAL_OK ? NULL : eval_status_string(status);
+    }
+  }
+  if (status != EVAL_OK) {
+    ip->stats.errors++;
+  }
+  return status;
+}
+
+const struct EvalError* interp_error(const struct Interp* ip) {
+  return &ip->err;
+}
+
+struct InterpThreadTest {
+  const char** exprs;
+  const int* want;
+  const int* want_status;
+  size_t n;
+  size_t cache_capacity;
+  int mismatches;
+};
+
+void* interp_thread_test(void* arg) {
+  struct InterpThreadTest* t = arg;
+  struct Interp* ip = interp_new(t->cache_capacity);
+  for (int rep = 0; rep < 20; rep++) {
+    for (size_t i = 0; i < t->n; i++) {
+      int x = 0;
+      int status = interp_eval(ip, t->exprs[i], strlen(t->exprs[i]), &x);
+      if (status != t->want_status[i] || (status == EVAL_OK && x != t->want[i])) {
+        t->mismatches++;
+      }
+    }
+  }
+  interp_free(ip);
+  return NULL;
+}
+
+void test_interp1() {
+  int want_tokens[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+  for (int i = 0; i < 10; i++) {
+    assert_int_eq2(*TOKEN_GLOBALS[i], want_tokens[i]);
+  }
+  for (int c = -128; c < 128; c++) {
+    struct Tokenizer tz = tokenizer_init("");
+    char s[2] = { (char)c, '\0' };
+    tz.p = s;
+    assert_int_eq2(read_single_char2((char)c), read_single_char(&tz));
+  }
+  for (int t = 0; t <= 10; t++) {
+    assert_int_eq2(is_op_token2(t), is_op_token(t));
+  }
+
+  struct Interp* ip = interp_new(16);
+  int x;
+  assert_int_eq2(interp_eval(ip, "(* (- 7 4) (+ (/ 26 2) 1))", 26, &x), EVAL_OK);
+  assert_int_eq2(x, 42);
+  assert_int_eq2(interp_eval(ip, "(+ 1", 4, &x), EVAL_PARSE_ERROR);
+  assert_int_eq2(interp_error(ip)->offset, 4);
+  assert_int_eq2(interp_eval(ip, "(/ 1 0)", 7, &x), EVAL_DIV_ZERO);
+  assert_str_eq(interp_error(ip)->msg, "division by zero");
+  assert_int_eq2(ip->stats.evals, 3);
+  assert_int_eq2(ip->stats.errors, 2);
+  interp_free(ip);
+
+  // now from several threads at once, with and without caches
+  const char* exprs[] = { "(+ 1 2)", "(* (+ 3 4) (- 10 4))", "(/ 100 (- 5 5))", "(- 1",
+                          "(+ 1 2 3 4 5)", "(* 65536 65536)", "17" };
+  size_t n = sizeof exprs / sizeof exprs[0];
+  int want[7], want_status[7];
+  struct EvalError err;
+  struct TokenBuffer tb = token_buffer_init();
+  for (size_t i = 0; i < n; i++) {
+    want_status[i] = eval_string_checked(&EVAL_ARENA, &tb, exprs[i], strlen(exprs[i]), &want[i], &err);
+  }
+  token_buffer_free(&tb);
+  pthread_t threads[4];
+  struct InterpThreadTest tests[4];
+  for (int i = 0; i < 4; i++) {
+    tests[i] = (struct InterpThreadTest){ exprs, want, want_status, n, i % 2 == 0 ? 0 : 4, 0 };
+    pthread_create(&threads[i], NULL, interp_thread_test, &tests[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    assert_int_eq2(tests[i].mismatches, 0);
+  }
+}
+
+__attribute__((constructor(101))) void register_interp() {
+  register_test("test_interp1", test_interp1);
+}
+
+// with an Interp per thread, every thread compiles (and keeps a copy of) every
+// hot formula. so here's a cache shared by the whole process, built so the hit
+// path never takes a lock or writes to memory that another thread reads.
+//
+// - the entries are split into shards by hash, each with its own lock, which is
+//   only taken to insert or evict. the bucket chains are linked through atomic
+//   pointers, so readers walk them without the lock, and an unlinked entry still
+//   points at the rest of its chain.
+// - an evicted entry can't be freed right away, because a reader may be looking
+//   at it. that's what the epochs are for: each reader publishes the global epoch
+//   while it's inside the cache, an evicted entry is stamped with the epoch it
+//   was retired in, and it's only let go of once every reader has either left
+//   or entered a later epoch.
+// - shared_cache_eval runs the program while still inside, so it touches
+//   nothing but its own reader slot. to hold on to a program for longer,
+//   shared_cache_acquire hands out a reference-counted entry instead; the cache
+//   holds one reference of its own, and the last one to let go frees it.
+//
+// a reader is one thread's slot in the cache, from shared_cache_reader_new.
+// there are SHARED_MAX_READERS of them, so at most that many threads can use a
+// cache at once. once they're all taken, shared_cache_reader_new returns -1, and
+// shared_cache_eval and shared_cache_acquire turn that away with
+// EVAL_NO_READER.
+
+#define SHARED_SHARDS 64
+#define SHARED_SHARD_BUCKETS 256
+#define SHARED_MAX_READERS 256
+
+enum {
+  EVAL_NO_READER = EVAL_PARSE_ERROR + 1,
+};
+
+struct SharedEntry {
+  char* key;
+  size_t keylen;
+  uint64_t hash;
+  struct Program* prog;
+  _Atomic(struct SharedEntry*) next;
+  _Atomic uint32_t refs;
+  // insertion order within the shard, for eviction (under the shard lock)
+  struct SharedEntry* newer;
+  // on the retired list
+  uint64_t retired_epoch;
+  struct SharedEntry* retired_next;
+};
+
+struct SharedShard {
+  _Alignas(64) pthread_mutex_t lock;
+  _Atomic(struct SharedEntry*) buckets[SHARED_SHARD_BUCKETS];
+  size_t size;
+  struct SharedEntry* oldest;
+  struct SharedEntry* newest;
+};
+
+struct SharedReader {
+  // the epoch this reader entered in, or 0 if it's not inside the cache
+  _Alignas(64) _Atomic uint64_t epoch;
+  _Atomic int used;
+  // only ever written by the reader's own thread
+  _Atomic uint64_t hits;
+  _Atomic uint64_t misses;
+};
+
+struct SharedCache {
+  struct SharedShard shards[SHARED_SHARDS];
+  struct SharedReader readers[SHARED_MAX_READERS];
+  size_t shard_capacity;
+  // starts at 1, since 0 means "not inside"
+  _Alignas(64) _Atomic uint64_t epoch;
+  pthread_mutex_t retired_lock;
+  struct SharedEntry* retired;
+};
+
+// how many entries are allocated, across every cache, for the tests
+_Atomic long SHARED_LIVE_ENTRIES = 0;
+
+// capacity is the total number of entries, spread over the shards
+struct SharedCache* shared_cache_new(size_t capacity) {
+  struct SharedCache* c = calloc(1, sizeof *c);
+  for (int i = 0; i < SHARED_SHARDS; i++) {
+    pthread_mutex_init(&c->shards[i].lock, NULL);
+  }
+  c->shard_capacity = (capacity + SHARED_SHARDS - 1) / SHARED_SHARDS;
+  if (c->shard_capacity == 0) {
+    c->shard_capacity = 1;
+  }
+  atomic_store(&c->epoch, 1);
+  pthread_mutex_init(&c->retired_lock, NULL);
+  return c;
+}
+
+void shared_entry_release(struct SharedEntry* e) {
+  if (atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) {
+    program_free(e->prog);
+    free(e->key);
+    free(e);
+    atomic_fetch_sub(&SHARED_LIVE_ENTRIES, 1);
+  }
+}
+
+// there must be no readers inside, and no references handed out
+void shared_cache_free(struct SharedCache* c) {
+  for (int i = 0; i < SHARED_SHARDS; i++) {
+    struct SharedEntry* e = c->shards[i].oldest;
+    while (e != NULL) {
+      struct SharedEntry* newer = e->newer;
+      shared_entry_release(e);
+      e = newer;
+    }
+    pthread_mutex_destroy(&c->shards[i].lock);
+  }
+  while (c->retired != NULL) {
+    struct SharedEntry* e = c->retired;
+    c->retired = e->retired_next;
+    shared_entry_release(e);
+  }
+  pthread_mutex_destroy(&c->retired_lock);
+  free(c);
+}
+
+// returns the reader's slot, or -1 if they're all taken
+int shared_cache_reader_new(struct SharedCache* c) {
+  for (int i = 0; i < SHARED_MAX_READERS; i++) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&c->readers[i].used, &expected, 1)) {
+      atomic_store(&c->readers[i].epoch, 0);
+      atomic_store(&c->readers[i].hits, 0);
+      atomic_store(&c->readers[i].misses, 0);
+      return i;
+    }
+  }
+  return -1;
+}
+
+// is reader a slot that shared_cache_reader_new handed out?
+int shared_cache_reader_valid(struct SharedCache* c, int reader) {
+  return reader >= 0 && reader < SHARED_MAX_READERS && atomic_load(&c->readers[reader].used);
+}
+
+// freeing -1 does nothing, so a failed shared_cache_reader_new needs no special
+// case
+void shared_cache_reader_free(struct SharedCache* c, int reader) {
+  if (reader >= 0 && reader < SHARED_MAX_READERS) {
+    atomic_store(&c->readers[reader].used, 0);
+  }
+}
+
+void shared_cache_no_reader(struct EvalError* err) {
+  err->status = EVAL_NO_READER;
+  err->msg = "no free reader slot in the shared cache";
+}
+
+void shared_cache_enter(struct SharedCache* c, int reader) {
+  // this store has to be visible before any of the reader's loads from the
+  // chains (hence seq_cst), so that a writer scanning the readers after
+  // unlinking an entry either sees this reader, or this reader can't see the
+  // entry
+  atomic_store(&c->readers[reader].epoch, atomic_load(&c->epoch));
+}
+
+void shared_cache_exit(struct SharedCache* c, int reader) {
+  atomic_store_explicit(&c->readers[reader].epoch, 0, memory_order_release);
+}
+
+// drop the cache's reference to every retired entry that no reader can still
+// be looking at. called with retired_lock held.
+void shared_cache_reclaim(struct SharedCache* c) {
+  uint64_t min = UINT64_MAX;
+  for (int i = 0; i < SHARED_MAX_READERS; i++) {
+    uint64_t e = atomic_load(&c->readers[i].epoch);
+    if (e != 0 && e < min) {
+      min = e;
+    }
+  }
+  struct SharedEntry** p = &c->retired;
+  while (*p != NULL) {
+    struct SharedEntry* e = *p;
+    if (e->retired_epoch < min) {
+      *p = e->retired_next;
+      shared_entry_release(e);
+    } else {
+      p = &e->retired_next;
+    }
+  }
+}
+
+void shared_cache_retire(struct SharedCache* c, struct SharedEntry* e) {
+  pthread_mutex_lock(&c->retired_lock);
+  e->retired_epoch = atomic_fetch_add(&c->epoch, 1);
+  e->retired_next = c->retired;
+  c->retired = e;
+  shared_cache_reclaim(c);
+  pthread_mutex_unlock(&c->retired_lock);
+}
+
+struct SharedEntry* shared_shard_find(struct SharedShard* sh, const char* s, size_t n, uint64_t h) {
+  struct SharedEntry* e = atomic_load_explicit(&sh->buckets[(h >> 6) & (SHARED_SHARD_BUCKETS - 1)],
+                                               memory_order_acquire);
+  for (; e != NULL; e = atomic_load_explicit(&e->next, memory_order_acquire)) {
+    if (e->hash == h && e->keylen == n && memcmp(e->key, s, n) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// unlink the shard's oldest entry. called with the shard's lock held.
+void shared_shard_evict(struct SharedCache* c, struct SharedShard* sh) {
+  struct SharedEntry* victim = sh->oldest;
+  _Atomic(struct SharedEntry*)* p = &sh->buckets[(victim->hash >> 6) & (SHARED_SHARD_BUCKETS - 1)];
+  while (atomic_load_explicit(p, memory_order_relaxed) != victim) {
+    p = &atomic_load_explicit(p, memory_order_relaxed)->next;
+  }
+  atomic_store_explicit(p, atomic_load_explicit(&victim->next, memory_order_relaxed), memory_order_release);
+  sh->oldest = victim->newer;
+  if (sh->oldest == NULL) {
+    sh->newest = NULL;
+  }
+  sh->size--;
+  shared_cache_retire(c, victim);
+}
+
+// find or compile the entry for the n bytes at s. must be called from inside.
+// returns NULL, with err filled in, if it doesn't compile.
+struct SharedEntry* shared_cache_get(struct SharedCache* c, int reader, const char* s, size_t n,
+                                     struct EvalError* err) {
+  uint64_t h = hash_bytes(s, n);
+  struct SharedShard* sh = &c->shards[h & (SHARED_SHARDS - 1)];
+  struct SharedEntry* e = shared_shard_find(sh, s, n, h);
+  if (e != NULL) {
+    atomic_store_explicit(&c->readers[reader].hits, atomic_load_explicit(&c->readers[reader].hits,
+                          memory_order_relaxed) + 1, memory_order_relaxed);
+    return e;
+  }
+  atomic_store_explicit(&c->readers[reader].misses, atomic_load_explicit(&c->readers[reader].misses,
+                        memory_order_relaxed) + 1, memory_order_relaxed);
+
+  // compile without the lock, then check nobody beat us to it. anything nested
+  // deeper than PARSE_MAX_DEPTH is a parse error, so a single deep formula can't
+  // overflow the stack of whichever thread happens to miss on it.
+  struct Formula* f;
+  if (formula_compile_checked(s, n, NULL, 0, &f, err) != EVAL_OK) {
+    return NULL;
+  }
+  pthread_mutex_lock(&sh->lock);
+  e = shared_shard_find(sh, s, n, h);
+  if (e != NULL) {
+    pthread_mutex_unlock(&sh->lock);
+    formula_free(f);
+    return e;
+  }
+  e = malloc(sizeof *e);
+  e->key = malloc(n + 1);
+  memcpy(e->key, s, n);
+  e->key[n] = '\0';
+  e->keylen = n;
+  e->hash = h;
+  e->prog = f->prog;
+  free(f);
+  atomic_store_explicit(&e->refs, 1, memory_order_relaxed);
+  e->newer = NULL;
+  e->retired_next = NULL;
+  atomic_fetch_add(&SHARED_LIVE_ENTRIES, 1);
+
+  _Atomic(struct SharedEntry*)* bucket = &sh->buckets[(h >> 6) & (SHARED_SHARD_BUCKETS - 1)];
+  atomic_store_explicit(&e->next, atomic_load_explicit(bucket, memory_order_relaxed), memory_order_relaxed);
+  // publishes the entry's contents along with it
+  atomic_store_explicit(bucket, e, memory_order_release);
+  if (sh->newest != NULL) {
+    sh->newest->newer = e;
+  } else {
+    sh->oldest = e;
+  }
+  sh->newest = e;
+  if (++sh->size > c->shard_capacity) {
+    shared_shard_evict(c, sh);
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return e;
+}
+
+// evaluate the n bytes at s, compiling them only if no thread has yet. returns
+// an EVAL_* code, with the details in err.
+int shared_cache_eval(struct SharedCache* c, int reader, const char* s, size_t n, int* out,
+                      struct EvalError* err) {
+  eval_error_clear(err);
+  if (!shared_cache_reader_valid(c, reader)) {
+    shared_cache_no_reader(err);
+    return err->status;
+  }
+  shared_cache_enter(c, reader);
+  struct SharedEntry* e = shared_cache_get(c, reader, s, n, err);
+  int status = err->status;
+  if (e != NULL) {
+    status = vm_run_checked(e->prog, NULL, out);
+    err->status = status;
+    err->msg = status == EVAL_OK ? NULL : eval_status_string(status);
+  }
+  shared_cache_exit(c, reader);
+  return status;
+}
+
+// a reference to the compiled entry for s, which stays valid (even if it's
+// evicted) until shared_entry_release. returns NULL if s doesn't compile (or
+// reader isn't valid).
+struct SharedEntry* shared_cache_acquire(struct SharedCache* c, int reader, const char* s, size_t n,
+                                         struct EvalError* err) {
+  eval_error_clear(err);
+  if (!shared_cache_reader_valid(c, reader)) {
+    shared_cache_no_reader(err);
+    return NULL;
+  }
+  shared_cache_enter(c, reader);
+  struct SharedEntry* e = shared_cache_get(c, reader, s, n, err);
+  if (e != NULL) {
+    // the entry can't have reached 0 yet: the cache only gives up its own
+    // reference once every reader that could have found it has left
+    atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+  }
+  shared_cache_exit(c, reader);
+  return e;
+}
+
+struct SharedCacheTest {
+  struct SharedCache* cache;
+  const char** exprs;
+  const int* want;
+  size_t n;
+  int mismatches;
+};
+
+void* shared_cache_thread_test(void* arg) {
+  struct SharedCacheTest* t = arg;
+  int reader = shared_cache_reader_new(t->cache);
+  if (reader < 0) {
+    t->mismatches++;
+    return NULL;
+  }
+  struct EvalError err;
+  for (int rep = 0; rep < 200; rep++) {
+    for (size_t i = 0; i < t->n; i++) {
+      size_t k = (i * 7 + rep) % t->n;
+      int x = 0;
+      int status = shared_cache_eval(t->cache, reader, t->exprs[k], strlen(t->exprs[k]), &x, &err);
+      if (status != EVAL_OK || x != t->want[k]) {
+        t->mismatches++;
+      }
+    }
+    // and hold on to one across all the evictions the other threads are causing
+    struct SharedEntry* e = shared_cache_acquire(t->cache, reader, t->exprs[rep % t->n],
+                                                 strlen(t->exprs[rep % t->n]), &err);
+    if (e == NULL) {
+      t->mismatches++;
+      continue;
+    }
+    sched_yield();
+    int x = 0;
+    vm_run_checked(e->prog, NULL, &x);
+    if (x != t->want[rep % t->n]) {
+      t->mismatches++;
+    }
+    shared_entry_release(e);
+  }
+  shared_cache_reader_free(t->cache, reader);
+  return NULL;
+}
+
+void test_shared_cache1() {
+  long live_before = atomic_load(&SHARED_LIVE_ENTRIES);
+  struct SharedCache* c = shared_cache_new(16);
+  int reader = shared_cache_reader_new(c);
+  struct EvalError err;
+  int x;
+  assert_int_eq2(shared_cache_eval(c, reader, "(+ 40 2)", 8, &x, &err), EVAL_OK);
+  assert_int_eq2(x, 42);
+  assert_int_eq2(shared_cache_eval(c, reader, "(+ 40 2)", 8, &x, &err), EVAL_OK);
+  assert_int_eq2(shared_cache_eval(c, reader, "(+ 40", 5, &x, &err), EVAL_PARSE_ERROR);
+  assert_int_eq2(shared_cache_eval(c, reader, "(/ 1 0)", 7, &x, &err), EVAL_DIV_ZERO);
+  assert_int_eq2(c->readers[reader].hits, 1);
+  assert_int_eq2(c->readers[reader].misses, 3);
+  assert_int_eq2(atomic_load(&SHARED_LIVE_ENTRIES) - live_before, 2);
+  shared_cache_reader_free(c, reader);
+
+  // once every slot is taken, there's no reader to be had, and an invalid one is
+  // turned away
+  int readers[SHARED_MAX_READERS];
+  for (int i = 0; i < SHARED_MAX_READERS; i++) {
+    readers[i] = shared_cache_reader_new(c);
+    assert_int_eq2(readers[i] >= 0, 1);
+  }
+  reader = shared_cache_reader_new(c);
+  assert_int_eq2(reader, -1);
+  assert_int_eq2(shared_cache_eval(c, reader, "(+ 40 2)", 8, &x, &err), EVAL_NO_READER);
+  assert_int_eq2(shared_cache_acquire(c, reader, "(+ 40 2)", 8, &err) == NULL, 1);
+  assert_int_eq2(err.status, EVAL_NO_READER);
+  shared_cache_reader_free(c, reader);
+  shared_cache_reader_free(c, readers[7]);
+  assert_int_eq2(shared_cache_eval(c, readers[7], "(+ 40 2)", 8, &x, &err), EVAL_NO_READER);
+  assert_int_eq2(shared_cache_reader_new(c), readers[7]);
+  for (int i = 0; i < SHARED_MAX_READERS; i++) {
+    shared_cache_reader_free(c, readers[i]);
+  }
+
+  // a few hundred distinct expressions through a cache that only holds 64 (one
+  // per shard), so there's constant eviction
+  shared_cache_free(c);
+  c = shared_cache_new(64);
+  size_t n = 300;
+  char** exprs = malloc(n * sizeof *exprs);
+  int* want = malloc(n * sizeof *want);
+  for (size_t i = 0; i < n; i++) {
+    exprs[i] = malloc(32);
+    snprintf(exprs[i], 32, "(* (+ %zu 1) 3)", i);
+    want[i] = ((int)i + 1) * 3;
+  }
+  pthread_t threads[4];
+  struct SharedCacheTest tests[4];
+  for (int i = 0; i < 4; i++) {
+    tests[i] = (struct SharedCacheTest){ c, (const char**)exprs, want, n, 0 };
+    pthread_create(&threads[i], NULL, shared_cache_thread_test, &tests[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    assert_int_eq2(tests[i].mismatches, 0);
+  }
+  shared_cache_free(c);
+  // every entry was freed, evicted or not
+  assert_int_eq2(atomic_load(&SHARED_LIVE_ENTRIES), live_before);
+  for (size_t i = 0; i < n; i++) {
+    free(exprs[i]);
+  }
+  free(exprs);
+  free(want);
+}
+
+struct SharedCacheDeepTest {
+  struct SharedCache* cache;
+  const char* deep;
+  int status;
+  int x;
+};
+
+void* shared_cache_deep_thread(void* arg) {
+  struct SharedCacheDeepTest* t = arg;
+  // if there's no slot, both calls fail with EVAL_NO_READER, and the test says so
+  int reader = shared_cache_reader_new(t->cache);
+  struct EvalError err;
+  int x;
+  t->status = shared_cache_eval(t->cache, reader, t->deep, strlen(t->deep), &x, &err);
+  shared_cache_eval(t->cache, reader, "(+ 40 2)", 8, &t->x, &err);
+  shared_cache_reader_free(t->cache, reader);
+  return NULL;
+}
+
+// a formula too deep to compile is an error for the thread that asked for it,
+// and the others carry on
+void test_shared_cache2() {
+  struct SharedCache* c = shared_cache_new(16);
+  char* deep = make_deep_expression(300000, 1);
+  pthread_t threads[4];
+  struct SharedCacheDeepTest tests[4];
+  for (int i = 0; i < 4; i++) {
+    tests[i] = (struct SharedCacheDeepTest){ c, deep, EVAL_OK, 0 };
+    pthread_create(&threads[i], NULL, shared_cache_deep_thread, &tests[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    assert_int_eq2(tests[i].status, EVAL_PARSE_ERROR);
+    assert_int_eq2(tests[i].x, 42);
+  }
+  free(deep);
+  shared_cache_free(c);
+}
+
+__attribute__((constructor(101))) void register_shared_cache() {
+  register_test("test_shared_cache1", test_shared_cache1);
+  register_test("test_shared_cache2", test_shared_cache2);
+}
+
+// the streaming mode does everything for a line before it even looks at the
+// next one, so reading, parsing, and evaluating never overlap. this version
+// splits them into a pipeline of threads:
+//
+//   reader -> parsers -> evaluators -> writer
+//
+// the reader splits the input into batches of lines (copied, since the read()
+// buffer gets reused), any number of parser threads turn each line into an
+// NTree in the batch's arena, any number of evaluator threads evaluate them and
+// format the output, and the writer (the calling thread) puts the batches back
+// in input order and writes them out.
+//
+// the unit of work is a batch rather than a line, so the cost of handing work
+// from one thread to the next is spread over hundreds of lines. there's a fixed
+// number of batches, which go back to a free queue once they're written. so the
+// reader can only get so far ahead of the writer, which bounds both the memory
+// and how many batches the writer can have waiting to go out in order.
+//
+// the queues are bounded rings with a mutex and two condition variables; a
+// queue with several producers is closed when the last of them is done.
+
+int STREAM_BATCH_LINES = 512;
+size_t STREAM_BATCH_BYTES = 256 * 1024;
+// 0 means pick based on the number of CPUs
+int STREAM_PARSERS = 0;
+int STREAM_EVALUATORS = 0;
+
+struct StreamBatch {
+  uint64_t seq;
+  size_t n;
+  size_t cap;
+  // the lines, back to back, with where each one starts and how long it is
+  struct StrBuf text;
+  size_t* starts;
+  size_t* lens;
+  struct Arena arena;
+  struct NTree** trees;
+  struct EvalError* errs;
+  struct StrBuf out;
+};
+
+struct BatchQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct StreamBatch** items;
+  size_t cap;
+  size_t head;
+  size_t n;
+  int producers;
+};
+
+void batch_queue_init(struct BatchQueue* q, size_t cap, int producers) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  q->items = malloc(cap * sizeof *q->items);
+  q->cap = cap;
+  q->head = 0;
+  q->n = 0;
+  q->producers = producers;
+}
+
+void batch_queue_destroy(struct BatchQueue* q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  free(q->items);
+}
+
+void batch_queue_push(struct BatchQueue* q, struct StreamBatch* b) {
+  pthread_mutex_lock(&q->lock);
+  while (q->n == q->cap) {
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+  q->items[(q->head + q->n) % q->cap] = b;
+  q->n++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// returns NULL once the queue is empty and closed
+struct StreamBatch* batch_queue_pop(struct BatchQueue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->n == 0 && q->producers > 0) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+  struct StreamBatch* b = NULL;
+  if (q->n > 0) {
+    b = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->n--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return b;
+}
+
+// one of the producers is done
+void batch_queue_close(struct BatchQueue* q) {
+  pthread_mutex_lock(&q->lock);
+  if (--q->producers == 0) {
+    pthread_cond_broadcast(&q->not_empty);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
+
+struct StreamBatch* stream_batch_new(void) {
+  struct StreamBatch* b = calloc(1, sizeof *b);
+  b->arena = arena_init();
+  return b;
+}
+
+void stream_batch_free(struct StreamBatch* b) {
+  free(b->text.s);
+  free(b->starts);
+  free(b->lens);
+  arena_free(&b->arena);
+  free(b->trees);
+  free(b->errs);
+  free(b->out.s);
+  free(b);
+}
+
+void stream_batch_add(struct StreamBatch* b, const char* s, size_t n) {
+  if (b->n == b->cap) {
+    b->cap = b->cap == 0 ? 64 : b->cap * 2;
+    b->starts = realloc(b->starts, b->cap * sizeof *b->starts);
+    b->lens = realloc(b->lens, b->cap * sizeof *b->lens);
+    b->trees = realloc(b->trees, b->cap * sizeof *b->trees);
+    b->errs = realloc(b->errs, b->cap * sizeof *b->errs);
+  }
+  b->starts[b->n] = b->text.n;
+  b->lens[b->n] = n;
+  strbuf_append(&b->text, s, n);
+  b->n++;
+}
+
+struct Pipeline {
+  struct LineReader* r;
+  struct BatchQueue free_batches;
+  struct BatchQueue to_parse;
+  struct BatchQueue to_eval;
+  struct BatchQueue to_write;
+};
+
+void* pipeline_reader(void* arg) {
+  struct Pipeline* pl = arg;
+  uint64_t seq = 0;
+  const char* s;
+  size_t n;
+  int more = 1;
+  while (more) {
+    struct StreamBatch* b = batch_queue_pop(&pl->free_batches);
+    b->seq = seq++;
+    b->n = 0;
+    b->text.n = 0;
+    while (b->n < (size_t)STREAM_BATCH_LINES && b->text.n < STREAM_BATCH_BYTES) {
+      if (!line_reader_next(pl->r, &s, &n)) {
+        more = 0;
+        break;
+      }
+      if (n > 0) {
+        stream_batch_add(b, s, n);
+      }
+    }
+    batch_queue_push(&pl->to_parse, b);
+  }
+  batch_queue_close(&pl->to_parse);
+  return NULL;
+}
+
+void* pipeline_parser(void* arg) {
+  struct Pipeline* pl = arg;
+  struct TokenBuffer tb = token_buffer_init();
+  struct StreamBatch* b;
+  while ((b = batch_queue_pop(&pl->to_parse)) != NULL) {
+    arena_reset(&b->arena);
+    for (size_t i = 0; i < b->n; i++) {
+      uint64_t t0 = STAT_CLOCK();
+      parse_ntree_checked(&b->arena, &tb, b->text.s + b->starts[i], b->lens[i], NULL, 0, &b->trees[i],
+                          &b->errs[i]);
+      // every line counts as a call, including the ones that don't parse
+      stats_record(1, &tb, b->trees[i], STAT_CLOCK() - t0, 0);
+    }
+    batch_queue_push(&pl->to_eval, b);
+  }
+  token_buffer_free(&tb);
+  batch_queue_close(&pl->to_eval);
+  return NULL;
+}
+
+// the same output as writer_error
+void strbuf_error(struct StrBuf* sb, struct EvalError* err) {
+  strbuf_append(sb, "error: ", 7);
+  strbuf_append(sb, err->msg, strlen(err->msg));
+  if (err->status == EVAL_PARSE_ERROR) {
+    strbuf_append(sb, " at offset ", 11);
+    strbuf_int(sb, (int)err->offset);
+    if (err->token.n > 0) {
+      strbuf_append(sb, " ('", 3);
+      strbuf_append(sb, err->token.s, err->token.n);
+      strbuf_append(sb, "')", 2);
+    }
+  }
+}
+
+void* pipeline_evaluator(void* arg) {
+  struct Pipeline* pl = arg;
+  struct StreamBatch* b;
+  while ((b = batch_queue_pop(&pl->to_eval)) != NULL) {
+    b->out.n = 0;
+    for (size_t i = 0; i < b->n; i++) {
+      struct EvalError* err = &b->errs[i];
+      if (err->status == EVAL_OK) {
+        int x;
+        uint64_t t0 = STAT_CLOCK();
+        int status = eval_ntree_checked(b->trees[i], NULL, &x);
+        stats_record(0, NULL, NULL, 0, STAT_CLOCK() - t0);
+        if (status == EVAL_OK) {
+          strbuf_int(&b->out, x);
+          strbuf_append(&b->out, "\n", 1);
+          continue;
+        }
+        err->status = status;
+        err->msg = eval_status_string(status);
+      }
+      strbuf_error(&b->out, err);
+      strbuf_append(&b->out, "\n", 1);
+    }
+    batch_queue_push(&pl->to_write, b);
+  }
+  batch_queue_close(&pl->to_write);
+  return NULL;
+}
+
+void stream_eval4(struct LineReader* r, struct Writer* w) {
+  // the reader and the writer take two CPUs, and the rest are split between
+  // parsing and evaluating, which is cheaper. it takes at least one of each, so
+  // with fewer than four CPUs there are more threads than CPUs regardless.
+  int cpus = num_cpus();
+  int workers = cpus > 4 ? cpus - 2 : 2;
+  int nevaluators = STREAM_EVALUATORS > 0 ? STREAM_EVALUATORS : (workers >= 8 ? workers / 4 : 1);
+  int nparsers = STREAM_PARSERS > 0 ? STREAM_PARSERS : (workers > nevaluators ? workers - nevaluators : 1);
+  size_t nbatches = 2 * (size_t)(nparsers + nevaluators) + 2;
+
+  struct Pipeline pl;
+  pl.r = r;
+  batch_queue_init(&pl.free_batches, nbatches, 1);
+  batch_queue_init(&pl.to_parse, nbatches, 1);
+  batch_queue_init(&pl.to_eval, nbatches, nparsers);
+  batch_queue_init(&pl.to_write, nbatches, nevaluators);
+  struct StreamBatch** batches = malloc(nbatches * sizeof *batches);
+  for (size_t i = 0; i < nbatches; i++) {
+    batches[i] = stream_batch_new();
+    batch_queue_push(&pl.free_batches, batches[i]);
+  }
+
+  pthread_t reader;
+  pthread_t* threads = malloc((nparsers + nevaluators) * sizeof *threads);
+  pthread_create(&reader, NULL, pipeline_reader, &pl);
+  for (int i = 0; i < nparsers; i++) {
+    pthread_create(&threads[i], NULL, pipeline_parser, &pl);
+  }
+  for (int i = 0; i < nevaluators; i++) {
+    pthread_create(&threads[nparsers + i], NULL, pipeline_evaluator, &pl);
+  }
+
+  // batches can finish out of order, so hold on to the early ones (indexed by
+  // seq, and there can't be more than nbatches of them) until it's their turn
+  struct StreamBatch** pending = calloc(nbatches, sizeof *pending);
+  uint64_t next = 0;
+  struct StreamBatch* b;
+  while ((b = batch_queue_pop(&pl.to_write)) != NULL) {
+    pending[b->seq % nbatches] = b;
+    while ((b = pending[next % nbatches]) != NULL && b->seq == next) {
+      pending[next % nbatches] = NULL;
+      // the last batch can be empty, and then out.s may still be NULL
+      if (b->out.n > 0) {
+        writer_bytes(w, b->out.s, b->out.n);
+      }
+      next++;
+      batch_queue_push(&pl.free_batches, b);
+    }
+  }
+  writer_flush(w);
+
+  pthread_join(reader, NULL);
+  for (int i = 0; i < nparsers + nevaluators; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (size_t i = 0; i < nbatches; i++) {
+    stream_batch_free(batches[i]);
+  }
+  free(batches);
+  free(pending);
+  free(threads);
+  batch_queue_destroy(&pl.free_batches);
+  batch_queue_destroy(&pl.to_parse);
+  batch_queue_destroy(&pl.to_eval);
+  batch_queue_destroy(&pl.to_write);
+}
+
+int run_stream4(int argc, char** argv) {
+  int fd = open_input(argc, argv);
+  struct LineReader r = line_reader_init(fd);
+  writer_init(&STDOUT_WRITER, 1);
+  stream_eval4(&r, &STDOUT_WRITER);
+  line_reader_free(&r);
+  stats_report();
+  return 0;
+}
+
+void test_stream4() {
+  // lots of small batches, so they really do finish out of order
+  int old_lines = STREAM_BATCH_LINES;
+  int old_parsers = STREAM_PARSERS;
+  int old_evaluators = STREAM_EVALUATORS;
+  STREAM_BATCH_LINES = 7;
+  STREAM_PARSERS = 3;
+  STREAM_EVALUATORS = 2;
+
+  // (stream_through_files writes the whole input into the pipe up front, so it
+  // has to stay under the 64K pipe buffer)
+  struct StrBuf input = { NULL, 0, 0 };
+  for (int i = 0; i < 2000; i++) {
+    char line[64];
+    int k;
+    if (i % 97 == 0) {
+      k = snprintf(line, sizeof line, "(+ %d\n", i);
+    } else if (i % 101 == 0) {
+      k = snprintf(line, sizeof line, "(/ %d 0)\n\n", i);
+    } else {
+      k = snprintf(line, sizeof line, "(* (+ %d 1) (- %d 3))\n", i, i % 13);
+    }
+    strbuf_append(&input, line, k);
+  }
+  for (int use_pipe = 0; use_pipe <= 1; use_pipe++) {
+    char* want = stream_through_files(input.s, use_pipe, stream_eval3);
+    char* got = stream_through_files(input.s, use_pipe, stream_eval4);
+    assert_str_eq(got, want);
+    free(want);
+    free(got);
+  }
+  char* empty = stream_through_files("", 0, stream_eval4);
+  assert_str_eq(empty, "");
+  free(empty);
+  free(input.s);
+
+  // a line too deep to parse is an error like any other
+  char* deep = make_deep_expression(300000, 1);
+  size_t n = strlen(deep);
+  deep = realloc(deep, n + 10);
+  memcpy(deep + n, "\n(+ 1 2)\n", 10);
+  char* out = stream_through_files(deep, 0, stream_eval4);
+  char want[64];
+  snprintf(want, sizeof want, "error: too deeply nested at offset %d ('(')\n3\n", PARSE_MAX_DEPTH * 5);
+  assert_str_eq(out, want);
+  free(out);
+  free(deep);
+
+  STREAM_BATCH_LINES = old_lines;
+  STREAM_PARSERS = old_parsers;
+  STREAM_EVALUATORS = old_evaluators;
+}
+
+// the pipeline's parsers and evaluators count for the stats too
+void test_stream5() {
+  struct EvalStats before;
+  struct EvalStats after;
+  stats_snapshot(&before);
+  char* out = stream_through_files("(+ 1 2)\n(+ 1\n(/ 1 0)\n", 0, stream_eval4);
+  assert_str_eq(out, "3\nerror: expected ')' at offset 4\nerror: division by zero\n");
+  free(out);
+  stats_snapshot(&after);
+#if EVAL_STATS
+  assert_int_eq2(after.calls - before.calls, 3);
+  // ( + 1 2 ) EOF, ( + 1 EOF, and ( / 1 0 ) EOF
+  assert_int_eq2(after.tokens - before.tokens, 16);
+  assert_int_eq2(after.nodes - before.nodes, 6);
+#else
+  assert_int_eq2(after.calls, before.calls);
+#endif
+}
+
+__attribute__((constructor(101))) void register_stream4() {
+  register_command("--stream", run_stream4);
+  register_test("test_stream4", test_stream4);
+  register_test("test_stream5", test_stream5);
+}
+
+// typed engines. everything so far computes with int, and the checked VMs are
+// the only other type (int64_t). some tenants need 64-bit or floating-point
+// arithmetic, so here's one macro that generates a complete engine for a given
+// numeric type: a tree evaluator, a VM, and column kernels. the type is fixed
+// at compile time, so each engine is ordinary code for that type with no checks
+// of which type it is, and the operators are generated as separate inline
+// functions (and separate kernels) instead of arithmetic chosen by a runtime
+// flag.
+//
+// literals are still parsed as ints and converted to T. constant folding uses
+// int arithmetic, which would change what (/ 10 4) means for double, so typed
+// programs come from formula_compile_typed, which doesn't fold.
+//
+// ints wrap on overflow: + - * are done in U, the unsigned type of the same
+// width, where wrapping is defined, and converted back (which gcc defines as
+// modulo 2^N). division is C's, so it traps on division by zero (and on
+// T_MIN / -1). doubles follow IEEE, with U = T.
+
+// one scratch can be shared by all the engines, so it's sized in bytes
+struct EngineScratch {
+  void* stack;
+  size_t size;
+};
+
+struct EngineScratch engine_scratch_init(void) {
+  struct EngineScratch es;
+  es.stack = NULL;
+  es.size = 0;
+  return es;
+}
+
+void engine_scratch_free(struct EngineScratch* es) {
+  free(es->stack);
+  *es = engine_scratch_init();
+}
+
+// a vector kernel for one operator, computing in U (see above). elementwise /
+// works on vector types too (for ints the compiler splits it back into scalar
+// divisions).
+#define ENGINE_COLUMN_OP(prefix, T, U, name, op)                                  \
+  static inline void prefix##_column_##name(T* restrict a, const T* restrict b, size_t n) { \
+    typedef U vec __attribute__((vector_size(32)));                               \
+    size_t lanes = sizeof(vec) / sizeof(T);                                       \
+    size_t i = 0;                                                                 \
+    for (; i + lanes <= n; i += lanes) {                                          \
+      vec x;                                                                      \
+      vec y;                                                                      \
+      memcpy(&x, a + i, sizeof x);                                                \
+      memcpy(&y, b + i, sizeof y);                                                \
+      x = x op y;                                                                 \
+      memcpy(a + i, &x, sizeof x);                                                \
+    }                                                                             \
+    for (; i < n; i++) {                                                          \
+      a[i] = (T)((U)a[i] op (U)b[i]);                                             \
+    }                                                                             \
+  }
+
+#define DEFINE_ENGINE(prefix, T, U)                                               \
+  static inline T prefix##_add(T a, T b) { return (T)((U)a + (U)b); }             \
+  static inline T prefix##_sub(T a, T b) { return (T)((U)a - (U)b); }             \
+  static inline T prefix##_mul(T a, T b) { return (T)((U)a * (U)b); }             \
+  static inline T prefix##_div(T a, T b) { return a / b; }                        \
+                                                                                  \
+  T prefix##_eval_ntree(const struct NTree* t, const T* inputs) {                 \
+    if (t->n == 0) {                                                              \
+      return t->op == VAR_OP ? inputs[t->value] : (T)t->value;                    \
+    }                                                                             \
+    T acc = prefix##_eval_ntree(t->children[0], inputs);                          \
+    switch (t->op) {                                                              \
+      case '+':                                                                   \
+        for (uint32_t i = 1; i < t->n; i++) {                                     \
+          acc = prefix##_add(acc, prefix##_eval_ntree(t->children[i], inputs));   \
+        }                                                                         \
+        return acc;                                                               \
+      case '*':                                                                   \
+        for (uint32_t i = 1; i < t->n; i++) {                                     \
+          acc = prefix##_mul(acc, prefix##_eval_ntree(t->children[i], inputs));   \
+        }                                                                         \
+        return acc;                                                               \
+      case '-':                                                                   \
+        return prefix##_sub(acc, prefix##_eval_ntree(t->children[1], inputs));    \
+      default:                                                                    \
+        return prefix##_div(acc, prefix##_eval_ntree(t->children[1], inputs));    \
+    }                                                                             \
+  }                                                                               \
+                                                                                  \
+  T prefix##_vm_run(const struct Program* prog, const T* inputs) {                \
+    T small[256];                                                                 \
+    T* stack = small;                                                             \
+    if (prog->max_stack > VM_SMALL_STACK) {                                       \
+      stack = malloc(prog->max_stack * sizeof *stack);                            \
+    }                                                                             \
+    T* sp = stack;                                                                \
+    const int* pc = prog->code;                                                   \
+    T r;                                                                          \
+    for (;;) {                                                                    \
+      switch (*pc++) {                                                            \
+        case OP_PUSH_CONST: *sp++ = (T)*pc++; continue;                           \
+        case OP_LOAD_VAR: *sp++ = inputs[*pc++]; continue;                        \
+        case OP_ADD: sp--; sp[-1] = prefix##_add(sp[-1], sp[0]); continue;        \
+        case OP_SUB: sp--; sp[-1] = prefix##_sub(sp[-1], sp[0]); continue;        \
+        case OP_MUL: sp--; sp[-1] = prefix##_mul(sp[-1], sp[0]); continue;        \
+        case OP_DIV: sp--; sp[-1] = prefix##_div(sp[-1], sp[0]); continue;        \
+      }                                                                           \
+      r = sp[-1];                                                                 \
+      break;                                                                      \
+    }                                                                             \
+    if (stack != small) {                                                         \
+      free(stack);                                                                \
+    }                                                                             \
+    return r;                                                                     \
+  }                                                                               \
+                                                                                  \
+  ENGINE_COLUMN_OP(prefix, T, U, add, +)                                          \
+  ENGINE_COLUMN_OP(prefix, T, U, sub, -)                                          \
+  ENGINE_COLUMN_OP(prefix, T, U, mul, *)                                          \
+  ENGINE_COLUMN_OP(prefix, T, T, div, /)                                          \
+                                                                                  \
+  /* formula_eval_columns for T */                                                \
+  void prefix##_eval_columns(const struct Program* prog, const T* const* cols, size_t n, T* out, \
+                             struct EngineScratch* es) {                          \
+    size_t size = (size_t)prog->max_stack * COLUMN_BLOCK * sizeof(T);             \
+    if (es->size < size) {                                                        \
+      free(es->stack);                                                            \
+      es->size = size;                                                            \
+      es->stack = malloc(size);                                                   \
+    }                                                                             \
+    for (size_t base = 0; base < n; base += COLUMN_BLOCK) {                       \
+      size_t len = n - base < COLUMN_BLOCK ? n - base : COLUMN_BLOCK;             \
+      T* sp = es->stack;                                                          \
+      const int* pc = prog->code;                                                 \
+      for (;;) {                                                                  \
+        int op = *pc++;                                                           \
+        if (op == OP_PUSH_CONST) {                                                \
+          T x = (T)*pc++;                                                         \
+          for (size_t i = 0; i < len; i++) {                                      \
+            sp[i] = x;                                                            \
+          }                                                                       \
+          sp += COLUMN_BLOCK;                                                     \
+        } else if (op == OP_LOAD_VAR) {                                           \
+          memcpy(sp, cols[*pc++] + base, len * sizeof(T));                        \
+          sp += COLUMN_BLOCK;                                                     \
+        } else if (op == OP_RET) {                                                \
+          memcpy(out + base, sp - COLUMN_BLOCK, len * sizeof(T));                 \
+          break;                                                                  \
+        } else {                                                                  \
+          sp -= COLUMN_BLOCK;                                                     \
+          T* a = sp - COLUMN_BLOCK;                                               \
+          switch (op) {                                                           \
+            case OP_ADD: prefix##_column_add(a, sp, len); break;                  \
+            case OP_SUB: prefix##_column_sub(a, sp, len); break;                  \
+            case OP_MUL: prefix##_column_mul(a, sp, len); break;                  \
+            default: prefix##_column_div(a, sp, len); break;                      \
+          }                                                                       \
+        }                                                                         \
+      }                                                                           \
+    }                                                                             \
+  }
+
+DEFINE_ENGINE(i32, int32_t, uint32_t)
+DEFINE_ENGINE(i64, int64_t, uint64_t)
+DEFINE_ENGINE(f64, double, double)
+
+// compile for the typed engines: the same as formula_compile_checked, minus the
+// (int) constant folding
+int formula_compile_typed(const char* s, size_t n, const char** params, int nparams, struct Formula** out,
+                          struct EvalError* err) {
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct NTree* t;
+  *out = NULL;
+  int status = parse_ntree_checked(&a, &tb, s, n, params, nparams, &t, err);
+  if (status == EVAL_OK) {
+    struct Formula* f = malloc(sizeof *f);
+    f->prog = compile3(t);
+    f->nparams = nparams;
+    *out = f;
+  }
+  token_buffer_free(&tb);
+  arena_free(&a);
+  return status;
+}
+
+void test_engines1() {
+  const char* params[] = { "x", "y" };
+  const char* s = "(+ (* x 3 y) (/ (- x 1) 4) (* y y))";
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  struct NTree* t = parse_ntree(&a, &tb, s, strlen(s), params, 2);
+  struct Formula* f;
+  assert_int_eq2(formula_compile_typed(s, strlen(s), params, 2, &f, &err), EVAL_OK);
+
+  int32_t in32[] = { 11, -4 };
+  int64_t in64[] = { 3000000000LL, 7 };
+  double inf64[] = { 11, -4 };
+  int in[] = { 11, -4 };
+  int want = eval_ntree(t, in);
+  assert_int_eq2(i32_eval_ntree(t, in32), want);
+  assert_int_eq2(i32_vm_run(f->prog, in32), want);
+  int64_t want64;
+  assert_int_eq2(vm_run_checked64(f->prog, in64, &want64), EVAL_OK);
+  assert_int_eq2(i64_eval_ntree(t, in64) == want64, 1);
+  assert_int_eq2(i64_vm_run(f->prog, in64) == want64, 1);
+  // 11*3*-4 + 10/4 + 16, without the rounding
+  assert_int_eq2(f64_eval_ntree(t, inf64) == -113.5, 1);
+  assert_int_eq2(f64_vm_run(f->prog, inf64) == -113.5, 1);
+
+  // the column kernels agree with the VMs on every row, including the ones that
+  // don't fill a block or a vector
+  size_t n = COLUMN_BLOCK + 13;
+  int32_t* c32[2] = { malloc(n * sizeof(int32_t)), malloc(n * sizeof(int32_t)) };
+  int64_t* c64[2] = { malloc(n * sizeof(int64_t)), malloc(n * sizeof(int64_t)) };
+  double* cf[2] = { malloc(n * sizeof(double)), malloc(n * sizeof(double)) };
+  int32_t* o32 = malloc(n * sizeof *o32);
+  int64_t* o64 = malloc(n * sizeof *o64);
+  double* of = malloc(n * sizeof *of);
+  for (size_t i = 0; i < n; i++) {
+    c32[0][i] = (int32_t)i - 500;
+    c32[1][i] = (int32_t)(i * 7 % 23) - 11;
+    c64[0][i] = (int64_t)c32[0][i] * 1000003;
+    c64[1][i] = c32[1][i];
+    cf[0][i] = c32[0][i] / 8.0;
+    cf[1][i] = c32[1][i];
+  }
+  struct EngineScratch es = engine_scratch_init();
+  i32_eval_columns(f->prog, (const int32_t* const*)c32, n, o32, &es);
+  i64_eval_columns(f->prog, (const int64_t* const*)c64, n, o64, &es);
+  f64_eval_columns(f->prog, (const double* const*)cf, n, of, &es);
+  int mismatches = 0;
+  for (size_t i = 0; i < n; i++) {
+    int32_t r32[] = { c32[0][i], c32[1][i] };
+    int64_t r64[] = { c64[0][i], c64[1][i] };
+    double rf[] = { cf[0][i], cf[1][i] };
+    mismatches += o32[i] != i32_vm_run(f->prog, r32);
+    mismatches += o64[i] != i64_vm_run(f->prog, r64);
+    mismatches += of[i] != f64_vm_run(f->prog, rf);
+  }
+  assert_int_eq2(mismatches, 0);
+
+  engine_scratch_free(&es);
+  for (int k = 0; k < 2; k++) {
+    free(c32[k]);
+    free(c64[k]);
+    free(cf[k]);
+  }
+  free(o32);
+  free(o64);
+  free(of);
+  formula_free(f);
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+// overflow wraps, the same in every int engine, and without UB (which is what
+// -fsanitize=undefined would catch)
+void test_engines2() {
+  const char* params[] = { "x", "y" };
+  const char* s = "(- (* x x y) (+ y 2147483647))";
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct EvalError err;
+  struct NTree* t = parse_ntree(&a, &tb, s, strlen(s), params, 2);
+  struct Formula* f;
+  assert_int_eq2(formula_compile_typed(s, strlen(s), params, 2, &f, &err), EVAL_OK);
+
+  int32_t in32[] = { 65536, 3 };
+  // 65536 * 65536 * 3 wraps to 0, and 0 - (3 + 2147483647) wraps to 2147483646
+  int32_t want = 2147483646;
+  assert_int_eq2(i32_eval_ntree(t, in32), want);
+  assert_int_eq2(i32_vm_run(f->prog, in32), want);
+  int64_t in64[] = { INT64_C(1) << 32, 3 };
+  // 2^64 * 3 wraps to 0, and 0 - 2147483650 doesn't wrap at all
+  assert_int_eq2(i64_eval_ntree(t, in64) == -INT64_C(2147483650), 1);
+  assert_int_eq2(i64_vm_run(f->prog, in64) == -INT64_C(2147483650), 1);
+
+  size_t n = 37;
+  int32_t* cols[2] = { malloc(n * sizeof(int32_t)), malloc(n * sizeof(int32_t)) };
+  int32_t* out = malloc(n * sizeof *out);
+  for (size_t i = 0; i < n; i++) {
+    cols[0][i] = in32[0];
+    cols[1][i] = in32[1];
+  }
+  struct EngineScratch es = engine_scratch_init();
+  i32_eval_columns(f->prog, (const int32_t* const*)cols, n, out, &es);
+  int mismatches = 0;
+  for (size_t i = 0; i < n; i++) {
+    mismatches += out[i] != want;
+  }
+  assert_int_eq2(mismatches, 0);
+
+  engine_scratch_free(&es);
+  free(cols[0]);
+  free(cols[1]);
+  free(out);
+  formula_free(f);
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_engines() {
+  register_test("test_engines1", test_engines1);
+  register_test("test_engines2", test_engines2);
+}
+
+// freeing trees. the arena is fine for trees that die with the parse, but a
+// tree kept around for a long time (a cached formula, say) pins its whole arena,
+// and the malloc'd trees from binary_node and leaf_node are never freed at all.
+// (parser_parse even returns its root by value, so the root's heap copy is lost
+// for good; tree_free_value at least frees everything under it.)
+//
+// tree_destroy frees a tree without recursing, so it works on trees of any
+// depth: while the current node has a left child, rotate it to the right, which
+// makes that child the current node; once there's no left child, the node can be
+// released and we carry on with its right child. every rotation puts one more
+// node on the right spine for good, so it's O(n) with no stack at all.
+
+void tree_destroy(struct Tree* tr, void (*release)(void* ctx, struct Tree*), void* ctx) {
+  while (tr != NULL) {
+    if (tr->left != NULL) {
+      struct Tree* left = tr->left;
+      tr->left = left->right;
+      left->right = tr;
+      tr = left;
+    } else {
+      struct Tree* right = tr->right;
+      release(ctx, tr);
+      tr = right;
+    }
+  }
+}
+
+void release_malloc_node(void* ctx, struct Tree* tr) {
+  (void)ctx;
+  free(tr);
+}
+
+// for trees from binary_node and leaf_node, e.g. parser_parse4's
+void tree_free(struct Tree* tr) {
+  tree_destroy(tr, release_malloc_node, NULL);
+}
+
+// for what's left of parser_parse's result
+void tree_free_value(struct Tree tr) {
+  tree_free(tr.left);
+  tree_free(tr.right);
+}
+
+// and instead of going to malloc for every node, a pool that recycles them. the
+// free nodes are kept in one list per size class: one class for struct Tree, and
+// one for each power of two of NTree children (the child array is part of the
+// node). a node goes back into the first class big enough for it, so an NTree
+// that fold_ntree shrank is just filed under a smaller class than it could be.
+//
+// to keep the memory bounded, each class holds at most max_free nodes; past
+// that, they go back to malloc.
+//
+// binary_node2 and leaf_node2 are binary_node and leaf_node with a pool per
+// thread behind them, and parser_parse11 is parser_parse4 built on those, for
+// code that parses the original way over and over (like the fuzzer's oracle).
+// the caches don't need any of this: ExprCache, Interp and SharedCache keep only
+// a compiled Program per entry, and parse into an arena that's reset after
+// every call. code that keeps trees around should use parse_tree_pooled (or
+// ntree_copy, to keep an NTree past its arena) and give them back with
+// tree_release or ntree_release.
+
+#define NODE_POOL_CLASSES 40
+int NODE_POOL_TREE_CLASS = 0;
+
+struct NodePool {
+  void* free_lists[NODE_POOL_CLASSES];
+  size_t nfree[NODE_POOL_CLASSES];
+  size_t max_free;
+  // how many nodes came from malloc, for the tests
+  size_t fresh;
+  // scratch space for ntree_release
+  struct NTree** stack;
+  size_t stack_cap;
+};
+
+struct NodePool* node_pool_new(size_t max_free) {
+  struct NodePool* pool = calloc(1, sizeof *pool);
+  pool->max_free = max_free;
+  return pool;
+}
+
+void node_pool_free(struct NodePool* pool) {
+  for (int c = 0; c < NODE_POOL_CLASSES; c++) {
+    void* p = pool->free_lists[c];
+    while (p != NULL) {
+      void* next = *(void**)p;
+      free(p);
+      p = next;
+    }
+  }
+  free(pool->stack);
+  free(pool);
+}
+
+// n children go in class k where 2^(k-2) >= n (so leaves are class 1)
+int ntree_class(uint32_t n) {
+  int k = 1;
+  while (n > 0 && (1u << (k - 1)) < n) {
+    k++;
+  }
+  return n == 0 ? 1 : k + 1;
+}
+
+size_t ntree_class_size(int k) {
+  size_t cap = k == 1 ? 0 : (size_t)1 << (k - 2);
+  return sizeof(struct NTree) + cap * sizeof(struct NTree*);
+}
+
+void* node_pool_get(struct NodePool* pool, int c, size_t size) {
+  void* p = pool->free_lists[c];
+  if (p != NULL) {
+    pool->free_lists[c] = *(void**)p;
+    pool->nfree[c]--;
+    return p;
+  }
+  pool->fresh++;
+  p = malloc(size);
+  if (p == NULL) {
+    fprintf(stderr, "node pool: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+void node_pool_put(struct NodePool* pool, int c, void* p) {
+  if (pool->nfree[c] >= pool->max_free) {
+    free(p);
+    return;
+  }
+  *(void**)p = pool->free_lists[c];
+  pool->free_lists[c] = p;
+  pool->nfree[c]++;
+}
+
+struct Tree* pool_binary_node(struct NodePool* pool, char op, struct Tree* left, struct Tree* right) {
+  struct Tree* r = node_pool_get(pool, NODE_POOL_TREE_CLASS, sizeof *r);
+  r->left = left;
+  r->right = right;
+  r->value = 0;
+  r->op = op;
+  return r;
+}
+
+struct Tree* pool_leaf_node(struct NodePool* pool, int x) {
+  struct Tree* r = node_pool_get(pool, NODE_POOL_TREE_CLASS, sizeof *r);
+  r->left = NULL;
+  r->right = NULL;
+  r->value = x;
+  r->op = 0;
+  return r;
+}
+
+struct Tree* pool_var_node(struct NodePool* pool, int slot) {
+  struct Tree* r = pool_leaf_node(pool, slot);
+  r->op = VAR_OP;
+  return r;
+}
+
+void release_pool_node(void* ctx, struct Tree* tr) {
+  node_pool_put(ctx, NODE_POOL_TREE_CLASS, tr);
+}
+
+void tree_release(struct NodePool* pool, struct Tree* tr) {
+  tree_destroy(tr, release_pool_node, pool);
+}
+
+// parse_tree_with_params, but the nodes come from the pool
+
+struct Tree* match_pooled_binary_expression(struct Parser5* p, struct NodePool* pool);
+
+struct Tree* match_pooled_expression(struct Parser5* p, struct NodePool* pool) {
+  struct PackedToken* t = parser4_current(&p->p);
+  if (t->t == TOKEN_LPAREN) {
+    return match_pooled_binary_expression(p, pool);
+  } else if (t->t == TOKEN_NUM) {
+    parser4_advance(&p->p);
+    return pool_leaf_node(pool, t->value);
+  } else if (t->t == TOKEN_SYMBOL) {
+    parser4_advance(&p->p);
+    return pool_var_node(pool, resolve_param(p, t));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_pooled_binary_expression(struct Parser5* p, struct NodePool* pool) {
+  consume4(&p->p, TOKEN_LPAREN);
+  struct PackedToken* t = parser4_current(&p->p);
+  if (!is_op_token2(t->t)) {
+    parser_bail("expected op");
+  }
+  char op = p->p.tb->src[t->off];
+  parser4_advance(&p->p);
+  struct Tree* left = match_pooled_expression(p, pool);
+  struct Tree* right = match_pooled_expression(p, pool);
+  consume4(&p->p, TOKEN_RPAREN);
+  return pool_binary_node(pool, op, left, right);
+}
+
+struct Tree* parse_tree_pooled(struct NodePool* pool, struct TokenBuffer* tb, const char* s, size_t n,
+                               const char** params, int nparams) {
+  lex_all2(tb, s, n);
+  struct Parser5 p;
+  p.p.tb = tb;
+  p.p.i = 0;
+  p.p.arena = NULL;
+  p.params = params;
+  p.nparams = nparams;
+  struct Tree* r = match_pooled_expression(&p, pool);
+  if (parser4_current(&p.p)->t != TOKEN_EOF) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+// NTrees get parsed into an arena (the n-ary parser needs its scratch space
+// anyway), so to keep one, copy it out into the pool
+struct NTree* ntree_copy(struct NodePool* pool, const struct NTree* t) {
+  int c = ntree_class(t->n);
+  struct NTree* r = node_pool_get(pool, c, ntree_class_size(c));
+  r->op = t->op;
+  r->value = t->value;
+  r->n = t->n;
+  for (uint32_t i = 0; i < t->n; i++) {
+    r->children[i] = ntree_copy(pool, t->children[i]);
+  }
+  return r;
+}
+
+// NTree nodes don't have the two child pointers the rotation trick needs, so
+// this one uses an explicit stack (kept in the pool, so it's only allocated once)
+void ntree_release(struct NodePool* pool, struct NTree* t) {
+  size_t n = 0;
+  while (t != NULL || n > 0) {
+    if (t == NULL) {
+      t = pool->stack[--n];
+    }
+    size_t need = n + t->n;
+    if (need > pool->stack_cap) {
+      pool->stack_cap = need * 2;
+      pool->stack = realloc(pool->stack, pool->stack_cap * sizeof *pool->stack);
+    }
+    for (uint32_t i = 0; i < t->n; i++) {
+      pool->stack[n++] = t->children[i];
+    }
+    node_pool_put(pool, ntree_class(t->n), t);
+    t = NULL;
+  }
+}
+
+// the per-thread pools behind binary_node2 and leaf_node2. a thread's pool is
+// freed when the thread exits.
+pthread_key_t NODE_POOL_KEY;
+pthread_once_t NODE_POOL_ONCE = PTHREAD_ONCE_INIT;
+size_t NODE_POOL_MAX_FREE = 1 << 16;
+
+void node_pool_destroy(void* pool) {
+  node_pool_free(pool);
+}
+
+void node_pool_key_init(void) {
+  pthread_key_create(&NODE_POOL_KEY, node_pool_destroy);
+}
+
+struct NodePool* thread_node_pool(void) {
+  pthread_once(&NODE_POOL_ONCE, node_pool_key_init);
+  struct NodePool* pool = pthread_getspecific(NODE_POOL_KEY);
+  if (pool == NULL) {
+    pool = node_pool_new(NODE_POOL_MAX_FREE);
+    pthread_setspecific(NODE_POOL_KEY, pool);
+  }
+  return pool;
+}
+
+struct Tree* binary_node2(char op, struct Tree* left, struct Tree* right) {
+  return pool_binary_node(thread_node_pool(), op, left, right);
+}
+
+struct Tree* leaf_node2(int x) {
+  return pool_leaf_node(thread_node_pool(), x);
+}
+
+// for trees from binary_node2 and leaf_node2. the nodes go to this thread's
+// pool, whichever thread they came from.
+void tree_free2(struct Tree* tr) {
+  tree_release(thread_node_pool(), tr);
+}
+
+struct Tree* match_binary_expression9(struct Parser* p);
+
+// match_expression3, with pooled nodes
+struct Tree* match_expression9(struct Parser* p) {
+  struct Token t = parser_current(p);
+  if (t.t == TOKEN_LPAREN) {
+    return match_binary_expression9(p);
+  } else if (t.t == TOKEN_NUM) {
+    parser_advance(p);
+    return leaf_node2(strtol(t.s, NULL, 10));
+  } else {
+    parser_bail("expected expression");
+    return NULL;
+  }
+}
+
+struct Tree* match_binary_expression9(struct Parser* p) {
+  consume2(p, TOKEN_LPAREN);
+  struct Token t = parser_current(p);
+  if (!is_op_token(t.t)) {
+    parser_bail("expected op");
+  }
+  parser_advance(p);
+  struct Tree* left = match_expression9(p);
+  struct Tree* right = match_expression9(p);
+  consume2(p, TOKEN_RPAREN);
+  return binary_node2(*t.s, left, right);
+}
+
+// parser_parse4, with pooled nodes. free the result with tree_free2.
+struct Tree* parser_parse11(struct Parser* p) {
+  struct Tree* r = match_expression9(p);
+  if (!parser_done(p)) {
+    parser_bail("trailing input");
+  }
+  return r;
+}
+
+void test_node_pool1() {
+  // a tree too deep to free recursively, built by hand since the parsers recurse
+  // too
+  int depth = 1000000;
+  struct Tree* deep = leaf_node(1);
+  for (int i = 0; i < depth; i++) {
+    deep = binary_node(i % 2 == 0 ? '+' : '*', i % 3 == 0 ? leaf_node(1) : deep, i % 3 == 0 ? deep : leaf_node(1));
+  }
+  tree_free(deep);
+
+  struct Tokenizer tz = tokenizer_init("(* (- 7 4) (+ (/ 26 2) 1))");
+  tokenizer_advance(&tz);
+  struct Parser pr = parser_init(&tz);
+  tree_free(parser_parse4(&pr));
+
+  const char* params[] = { "x" };
+  const char* s = "(+ (* x (- x 1)) (/ 100 (+ x 3)))";
+  int inputs[] = { 7 };
+  struct NodePool* pool = node_pool_new(1024);
+  struct TokenBuffer tb = token_buffer_init();
+  for (int i = 0; i < 100; i++) {
+    struct Tree* tr = parse_tree_pooled(pool, &tb, s, strlen(s), params, 1);
+    assert_int_eq2(eval3(tr, inputs), 52);
+    tree_release(pool, tr);
+  }
+  // 11 nodes, allocated once and then recycled
+  assert_int_eq2(pool->fresh, 11);
+
+  struct Arena a = arena_init();
+  struct NTree* t = parse_ntree(&a, &tb, "(+ 1 x (* x x x) (- x 2) 3 4 5 6 7)", 35, params, 1);
+  for (int i = 0; i < 10; i++) {
+    struct NTree* kept = ntree_copy(pool, t);
+    arena_reset(&a);
+    assert_int_eq2(eval_ntree(kept, inputs), 1 + 7 + 343 + 5 + 25);
+    ntree_release(pool, kept);
+    t = parse_ntree(&a, &tb, "(+ 1 x (* x x x) (- x 2) 3 4 5 6 7)", 35, params, 1);
+  }
+  // on top of the 11 from before (which are a different class): 12 leaves, and
+  // the 3-, 2-, and 9-child nodes
+  assert_int_eq2(pool->fresh, 11 + 15);
+  arena_free(&a);
+
+  // a pool with room for only 2 free nodes per class gives the rest back
+  struct NodePool* small = node_pool_new(2);
+  struct Tree* tr = parse_tree_pooled(small, &tb, s, strlen(s), params, 1);
+  tree_release(small, tr);
+  assert_int_eq2(small->nfree[NODE_POOL_TREE_CLASS], 2);
+  node_pool_free(small);
+
+  token_buffer_free(&tb);
+  node_pool_free(pool);
+}
+
+int parse_pooled_repeatedly(const char* s, int reps) {
+  int r = 0;
+  for (int i = 0; i < reps; i++) {
+    struct Tokenizer tz = tokenizer_init(s);
+    tokenizer_advance(&tz);
+    struct Parser pr = parser_init(&tz);
+    struct Tree* tr = parser_parse11(&pr);
+    r = eval2(tr);
+    tree_free2(tr);
+  }
+  return r;
+}
+
+void* node_pool_thread_test(void* arg) {
+  long* fresh = arg;
+  parse_pooled_repeatedly("(* (- 7 4) (+ (/ 26 2) 1))", 100);
+  *fresh = (long)thread_node_pool()->fresh;
+  return NULL;
+}
+
+// parser_parse11 recycles its nodes through the thread's pool, and each thread
+// has a pool of its own
+void test_node_pool2() {
+  size_t fresh = thread_node_pool()->fresh;
+  assert_int_eq2(parse_pooled_repeatedly("(* (- 7 4) (+ (/ 26 2) 1))", 100), 42);
+  // the main thread's pool may already have had some free nodes
+  assert_int_eq2(thread_node_pool()->fresh - fresh <= 9, 1);
+  fresh = thread_node_pool()->fresh;
+  assert_int_eq2(parse_pooled_repeatedly("(+ 1 2)", 100), 3);
+  assert_int_eq2(thread_node_pool()->fresh, fresh);
+
+  pthread_t threads[2];
+  long thread_fresh[2];
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&threads[i], NULL, node_pool_thread_test, &thread_fresh[i]);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+    assert_int_eq2(thread_fresh[i], 9);
+  }
+}
+
+__attribute__((constructor(101))) void register_node_pool() {
+  register_test("test_node_pool1", test_node_pool1);
+  register_test("test_node_pool2", test_node_pool2);
+}
+
+// algebraic simplification. formulas full of products with a literal 0 or 1 in
+// them waste a lot of work: (* 0 <huge subtree>) evaluates the huge subtree just
+// to throw it away. simplify_ntree rewrites the tree bottom-up:
+//
+//   (* ... 0 ...)  ->  0          (+ ... 0 ...)  ->  (+ ...)
+//   (* ... 1 ...)  ->  (* ...)    (- x 0)        ->  x
+//   (- x x)        ->  0          (/ x 1)        ->  x
+//
+// plus folding constants, as in fold_ntree (with wraparound, so this is for the
+// unchecked evaluators; the checked ones should stick with fold_ntree_checked).
+// formula_compile2, and so the VM, the column evaluator and the JIT, compile the
+// simplified tree.
+//
+// the catch is division: (* 0 (/ x y)) isn't 0 when y is 0, it's a trap, and
+// simplifying shouldn't make that go away. so every subtree is tracked as
+// either safe, i.e. it can't trap (no division, or only by a constant other
+// than 0 and -1), or not, and only safe subtrees are ever dropped. in the
+// example, the (/ x y) stays, and simplifies to (* 0 (/ x y)).
+//
+// and to short-circuit at evaluation time, simplify_ntree puts the operands of
+// * in a useful order: the safe ones first, smallest first, then the rest, and
+// it stores how many are safe in the node's value (which is otherwise unused
+// for operators). eval_ntree_sc evaluates the operands in order, and once the
+// product is 0, skips whatever is left of the safe ones.
+
+struct SimplifyInfo {
+  int can_trap;
+  size_t size;
+};
+
+int ntree_equal(const struct NTree* a, const struct NTree* b) {
+  if (a->op != b->op || a->n != b->n || (a->n == 0 && a->value != b->value)) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < a->n; i++) {
+    if (!ntree_equal(a->children[i], b->children[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int is_nconst_value(const struct NTree* t, int x) {
+  return t->n == 0 && t->op != VAR_OP && t->value == x;
+}
+
+void ntree_make_const(struct NTree* t, int x) {
+  t->op = 0;
+  t->value = x;
+  t->n = 0;
+}
+
+// returns the simplified tree, which is either t itself, or one of its
+// descendants
+struct NTree* simplify_ntree(struct NTree* t, struct SimplifyInfo* info) {
+  info->can_trap = 0;
+  info->size = 1;
+  if (t->n == 0) {
+    return t;
+  }
+
+  struct SimplifyInfo small[8];
+  struct SimplifyInfo* ci = t->n <= 8 ? small : malloc(t->n * sizeof *ci);
+  int all_const = 1;
+  for (uint32_t i = 0; i < t->n; i++) {
+    t->children[i] = simplify_ntree(t->children[i], &ci[i]);
+    all_const = all_const && is_nconst(t->children[i]);
+  }
+
+  struct NTree* r = t;
+  int x;
+  if (all_const && eval_ntree_checked(t, NULL, &x) == EVAL_OK) {
+    ntree_make_const(t, x);
+  } else if (t->op == '+' || t->op == '*') {
+    int is_mul = t->op == '*';
+    unsigned acc = is_mul ? 1 : 0;
+    int nconst = 0;
+    struct NTree* last_const = NULL;
+    int any_trap = 0;
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < t->n; i++) {
+      struct NTree* c = t->children[i];
+      if (is_nconst(c)) {
+        acc = is_mul ? acc * (unsigned)c->value : acc + (unsigned)c->value;
+        nconst++;
+        last_const = c;
+      } else {
+        any_trap = any_trap || ci[i].can_trap;
+        t->children[k] = c;
+        ci[k] = ci[i];
+        k++;
+      }
+    }
+    if (is_mul && nconst > 0 && acc == 0) {
+      // the product is 0 no matter what, but any operand that can trap still
+      // has to be evaluated
+      if (!any_trap) {
+        ntree_make_const(t, 0);
+        k = 0;
+      } else {
+        uint32_t j = 0;
+        for (uint32_t i = 0; i < k; i++) {
+          if (ci[i].can_trap) {
+            t->children[j] = t->children[i];
+            ci[j] = ci[i];
+            j++;
+          }
+        }
+        k = j;
+        nconst = 1;
+      }
+    }
+    if (t->n > 0) {
+      // add back the combined constant, unless it's the identity
+      if (nconst > 0 && acc != (is_mul ? 1u : 0u)) {
+        last_const->value = (int)acc;
+        // constants first: they're the cheapest, and for * a 0 ends it early
+        memmove(&t->children[1], &t->children[0], k * sizeof *t->children);
+        memmove(&ci[1], &ci[0], k * sizeof *ci);
+        t->children[0] = last_const;
+        ci[0].can_trap = 0;
+        ci[0].size = 1;
+        k++;
+      }
+      if (k == 0) {
+        ntree_make_const(t, (int)acc);
+      } else if (k == 1) {
+        r = t->children[0];
+        *info = ci[0];
+      } else {
+        t->n = k;
+        if (is_mul) {
+          // stable insertion sort: safe before unsafe, then by size
+          for (uint32_t i = 1; i < k; i++) {
+            struct NTree* c = t->children[i];
+            struct SimplifyInfo cinfo = ci[i];
+            uint32_t j = i;
+            while (j > 0 && (ci[j - 1].can_trap > cinfo.can_trap ||
+                             (ci[j - 1].can_trap == cinfo.can_trap && ci[j - 1].size > cinfo.size))) {
+              t->children[j] = t->children[j - 1];
+              ci[j] = ci[j - 1];
+              j--;
+            }
+            t->children[j] = c;
+            ci[j] = cinfo;
+          }
+          uint32_t safe = 0;
+          while (safe < k && !ci[safe].can_trap) {
+            safe++;
+          }
+          t->value = (int)safe;
+        }
+      }
+    }
+  } else if (t->op == '-') {
+    if (all_const) {
+      // only gets here if it overflowed, so wrap around like fold_ntree does
+      ntree_make_const(t, (int)((unsigned)t->children[0]->value - (unsigned)t->children[1]->value));
+    } else if (is_nconst_value(t->children[1], 0)) {
+      r = t->children[0];
+      *info = ci[0];
+    } else if (!ci[0].can_trap && !ci[1].can_trap && ntree_equal(t->children[0], t->children[1])) {
+      ntree_make_const(t, 0);
+    }
+  } else if (t->op == '/') {
+    if (is_nconst_value(t->children[1], 1)) {
+      r = t->children[0];
+      *info = ci[0];
+    }
+  }
+
+  if (r == t && t->n > 0) {
+    for (uint32_t i = 0; i < t->n; i++) {
+      info->can_trap = info->can_trap || ci[i].can_trap;
+      info->size += ci[i].size;
+    }
+    if (t->op == '/' && !(is_nconst(t->children[1]) && t->children[1]->value != 0 && t->children[1]->value != -1)) {
+      info->can_trap = 1;
+    }
+  }
+  if (ci != small) {
+    free(ci);
+  }
+  return r;
+}
+
+struct NTree* simplify_for_compile(struct NTree* t) {
+  struct SimplifyInfo info;
+  return simplify_ntree(t, &info);
+}
+
+// eval_ntree, short-circuiting multiplication by zero. works on any NTree, but
+// only skips anything in simplified ones (an unsimplified * node has a value of
+// 0, so none of its operands count as safe). if skipped isn't NULL, it's
+// incremented by the number of operands skipped; it belongs to the caller, so
+// concurrent calls don't share a counter.
+int eval_ntree_sc_counted(const struct NTree* t, const int* inputs, uint64_t* skipped) {
+  if (t->n == 0) {
+    return t->op == VAR_OP ? inputs[t->value] : t->value;
+  }
+  if (t->op == '*') {
+    unsigned acc = 1;
+    for (uint32_t i = 0; i < t->n; i++) {
+      if (acc == 0 && i < (uint32_t)t->value) {
+        if (skipped != NULL) {
+          *skipped += t->value - i;
+        }
+        i = t->value;
+        if (i >= t->n) {
+          break;
+        }
+      }
+      acc *= (unsigned)eval_ntree_sc_counted(t->children[i], inputs, skipped);
+    }
+    return (int)acc;
+  }
+  int acc = eval_ntree_sc_counted(t->children[0], inputs, skipped);
+  if (t->op == '+') {
+    for (uint32_t i = 1; i < t->n; i++) {
+      acc = (int)((unsigned)acc + (unsigned)eval_ntree_sc_counted(t->children[i], inputs, skipped));
+    }
+    return acc;
+  }
+  return apply_op(t->op, acc, eval_ntree_sc_counted(t->children[1], inputs, skipped));
+}
+
+int eval_ntree_sc(const struct NTree* t, const int* inputs) {
+  return eval_ntree_sc_counted(t, inputs, NULL);
+}
+
+// a random formula over x and y with small literals, shallow enough that it
+// can't overflow. it can divide by zero, though.
+void gen_simplify_case(struct StrBuf* sb, uint64_t* seed, int depth) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  unsigned r = (unsigned)(*seed >> 33);
+  if (depth == 0 || r % 3 == 0) {
+    const char* leaves[] = { "0", "1", "2", "-", "x", "y" };
+    const char* leaf = leaves[(r >> 4) % 6];
+    if (*leaf == '-') {
+      leaf = "(- 0 2)";
+    }
+    strbuf_append(sb, leaf, strlen(leaf));
+    return;
+  }
+  char op = "+-*/*"[(r >> 4) % 5];
+  int n = op == '+' || op == '*' ? 2 + (int)((r >> 8) % 2) : 2;
+  char head[4] = { '(', op, ' ', '\0' };
+  strbuf_append(sb, head, 3);
+  for (int i = 0; i < n; i++) {
+    if (i > 0) {
+      strbuf_append(sb, " ", 1);
+    }
+    gen_simplify_case(sb, seed, depth - 1);
+  }
+  strbuf_append(sb, ")", 1);
+}
+
+void test_simplify1() {
+  const char* params[] = { "x", "y" };
+  struct Arena a = arena_init();
+  struct TokenBuffer tb = token_buffer_init();
+  struct SimplifyInfo info;
+
+  const char* s = "(+ (* 0 (- x y) (+ x 1)) (* y 1) (- x x) (/ (+ x 0) 1))";
+  struct NTree* t = simplify_ntree(parse_ntree(&a, &tb, s, strlen(s), params, 2), &info);
+  // all that's left is (+ y x)
+  assert_int_eq2(t->op, '+');
+  assert_int_eq2(t->n, 2);
+  assert_int_eq2(info.size, 3);
+  assert_int_eq2(info.can_trap, 0);
+  arena_reset(&a);
+
+  // a product with a divisor that might be 0 keeps it
+  s = "(* 0 x (/ 1 y))";
+  t = simplify_ntree(parse_ntree(&a, &tb, s, strlen(s), params, 2), &info);
+  assert_int_eq2(t->n, 2);
+  assert_int_eq2(t->children[1]->op, '/');
+  assert_int_eq2(info.can_trap, 1);
+  int inputs[] = { 5, 0 };
+  int out;
+  assert_int_eq2(eval_ntree_checked(t, inputs, &out), EVAL_DIV_ZERO);
+  arena_reset(&a);
+
+  // at runtime, x being 0 skips the big factor
+  s = "(* x (+ y (* y y) (* y y y)) (- y 3))";
+  t = simplify_ntree(parse_ntree(&a, &tb, s, strlen(s), params, 2), &info);
+  inputs[0] = 0;
+  inputs[1] = 4;
+  uint64_t skipped = 0;
+  assert_int_eq2(eval_ntree_sc_counted(t, inputs, &skipped), 0);
+  assert_int_eq2(skipped, 2);
+  inputs[0] = 2;
+  assert_int_eq2(eval_ntree_sc(t, inputs), 2 * (4 + 16 + 64) * 1);
+  arena_reset(&a);
+
+  // and lots of random ones, against the unsimplified tree: same value, and a
+  // trap wherever there was one
+  uint64_t seed = 42;
+  int mismatches = 0;
+  for (int i = 0; i < 3000; i++) {
+    struct StrBuf sb = { NULL, 0, 0 };
+    gen_simplify_case(&sb, &seed, 3);
+    for (int xi = -2; xi <= 2; xi++) {
+      for (int yi = -2; yi <= 2; yi++) {
+        int in[] = { xi, yi };
+        struct NTree* orig = parse_ntree(&a, &tb, sb.s, sb.n, params, 2);
+        int want;
+        int want_status = eval_ntree_checked(orig, in, &want);
+        struct NTree* simple = simplify_ntree(orig, &info);
+        int got;
+        int got_status = eval_ntree_checked(simple, in, &got);
+        if (got_status != want_status || (want_status == EVAL_OK && got != want)) {
+          mismatches++;
+        } else if (want_status == EVAL_OK && eval_ntree_sc(simple, in) != want) {
+          mismatches++;
+        }
+        arena_reset(&a);
+      }
+    }
+    free(sb.s);
+  }
+  assert_int_eq2(mismatches, 0);
+
+  // formula_compile2 simplifies, so this is just a constant now
+  struct Formula* f = formula_compile2("(* (+ x 0) 1 (- y y))", 21, params, 2);
+  assert_int_eq2(f->prog->n, 3);
+  assert_int_eq2(formula_eval(f, inputs), 0);
+  formula_free(f);
+  // and a product that might trap keeps its divisor
+  f = formula_compile2("(* 0 (/ x y))", 13, params, 2);
+  inputs[1] = 0;
+  struct Program* prog = f->prog;
+  int status = vm_run_checked(prog, inputs, &out);
+  assert_int_eq2(status, EVAL_DIV_ZERO);
+  formula_free(f);
+
+  token_buffer_free(&tb);
+  arena_free(&a);
+}
+
+__attribute__((constructor(101))) void register_simplify() {
+  register_test("test_simplify1", test_simplify1);
+}
+
+// with this many backends, we need to know that they all agree, and that none of
+// them gets slower. so, a differential fuzzer: generate random expressions in
+// the original grammar (binary operators, non-negative literals), evaluate each
+// one the original way, i.e. eval_string4's parser and eval2 (with nodes from
+// the pool and given back to it, where eval_string4 mallocs and leaks them),
+// and check that every backend gets the same answer.
+//
+// the generator keeps track of each subexpression's value, and never divides by
+// 0 or lets anything overflow, so every backend should give the one right answer,
+// checked or unchecked.
+//
+// it also times each backend over the whole corpus, and can save those numbers
+// to a baseline file, or compare against one and fail if any backend has slowed
+// down by more than a threshold.
+//
+// since every case is valid, a backend has no business declining one, and that
+// fails the run too. the exceptions are marked may_decline: the JIT (which
+// doesn't exist off x86-64, and turns down programs that are too deep), and
+// f64, which skips anything with a / in it since it doesn't truncate.
+//
+// usage: --fuzz [N] [--seed S] [--depth D] [--baseline FILE] [--update-baseline]
+//               [--threshold PERCENT]
+
+struct FuzzCtx {
+  struct Arena arena;
+  struct TokenBuffer tb;
+  struct Dag dag;
+  struct Interp* interp;
+  struct ColumnScratch cs;
+  struct SharedCache* shared;
+  int shared_reader;
+  // a scratch file for library_eval
+  FILE* library;
+};
+
+int fuzz_oracle(const char* s) {
+  struct Tokenizer tz = tokenizer_init(s);
+  tokenizer_advance(&tz);
+  struct Parser pr = parser_init(&tz);
+  struct Tree* tr = parser_parse11(&pr);
+  int r = eval2(tr);
+  tree_free2(tr);
+  return r;
+}
+
+// each backend takes the expression from text to value, returning 0 if it
+// declines (e.g. the JIT on another architecture)
+
+int fuzz_arena(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)n;
+  *out = eval_string_in(&cx->arena, s);
+  return 1;
+}
+
+int fuzz_flat(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  (void)n;
+  *out = eval_string_flat(s);
+  return 1;
+}
+
+int fuzz_iterative(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)n;
+  *out = eval_string_iterative(&cx->arena, s);
+  return 1;
+}
+
+int fuzz_tokenizer2(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  *out = eval_string_n2(&cx->arena, s, n);
+  return 1;
+}
+
+int fuzz_token_buffer(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  *out = eval_string_n3(&cx->arena, &cx->tb, s, n);
+  return 1;
+}
+
+int fuzz_checked(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  struct EvalError err;
+  return eval_string_checked(&cx->arena, &cx->tb, s, n, out, &err) == EVAL_OK;
+}
+
+int fuzz_vm(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  (void)n;
+  struct Program* prog = compile_string(s);
+  *out = vm_run(prog);
+  program_free(prog);
+  return 1;
+}
+
+int fuzz_vm_folded(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  (void)n;
+  struct Program* prog = compile_string_folded(s);
+  *out = vm_run(prog);
+  program_free(prog);
+  return 1;
+}
+
+int fuzz_vm2(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f = formula_compile2(s, n, NULL, 0);
+  *out = formula_eval(f, NULL);
+  formula_free(f);
+  return 1;
+}
+
+int fuzz_columns(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  struct Formula* f = formula_compile2(s, n, NULL, 0);
+  // a few rows, so the vector loop runs as well as the tail
+  int32_t rows[11];
+  formula_eval_columns(f, NULL, 11, rows, &cx->cs);
+  formula_free(f);
+  for (int i = 1; i < 11; i++) {
+    if (rows[i] != rows[0]) {
+      // make sure it's reported as a mismatch
+      *out = rows[0] + 1;
+      return 1;
+    }
+  }
+  *out = rows[0];
+  return 1;
+}
+
+int fuzz_jit(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f = formula_compile2(s, n, NULL, 0);
+  struct JitCode* jit = jit_compile(f->prog);
+  if (jit != NULL) {
+    *out = jit->fn(NULL);
+    jit_free(jit);
+  }
+  formula_free(f);
+  return jit != NULL;
+}
+
+int fuzz_checked_vm(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f;
+  struct EvalError err;
+  if (formula_compile_checked(s, n, NULL, 0, &f, &err) != EVAL_OK) {
+    return 0;
+  }
+  int64_t x;
+  int status = vm_run_checked64(f->prog, NULL, &x);
+  *out = (int)x;
+  formula_free(f);
+  return status == EVAL_OK;
+}
+
+int fuzz_checked_vm32(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f;
+  struct EvalError err;
+  if (formula_compile_checked(s, n, NULL, 0, &f, &err) != EVAL_OK) {
+    return 0;
+  }
+  int status = vm_run_checked(f->prog, NULL, out);
+  formula_free(f);
+  return status == EVAL_OK;
+}
+
+// a one-formula library, written out and mapped back in every time
+int fuzz_library(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  struct Formula* f;
+  struct EvalError err;
+  if (formula_compile_checked(s, n, NULL, 0, &f, &err) != EVAL_OK) {
+    return 0;
+  }
+  rewind(cx->library);
+  int ok = ftruncate(fileno(cx->library), 0) == 0 && library_write(cx->library, &f, 1) == 0;
+  formula_free(f);
+  struct Library lib;
+  const char* why;
+  if (!ok || library_open_fd(&lib, fileno(cx->library), &why) != 0) {
+    return 0;
+  }
+  int status = library_eval(&lib, 0, NULL, out);
+  library_close(&lib);
+  return status == EVAL_OK;
+}
+
+int fuzz_engine_i64(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f;
+  struct EvalError err;
+  if (formula_compile_typed(s, n, NULL, 0, &f, &err) != EVAL_OK) {
+    return 0;
+  }
+  *out = (int)i64_vm_run(f->prog, NULL);
+  formula_free(f);
+  return 1;
+}
+
+int fuzz_engine_i32(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f;
+  struct EvalError err;
+  if (formula_compile_typed(s, n, NULL, 0, &f, &err) != EVAL_OK) {
+    return 0;
+  }
+  *out = i32_vm_run(f->prog, NULL);
+  formula_free(f);
+  return 1;
+}
+
+int fuzz_engine_i32_tree(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  *out = i32_eval_ntree(parse_ntree(&cx->arena, &cx->tb, s, n, NULL, 0), NULL);
+  arena_reset(&cx->arena);
+  return 1;
+}
+
+// every value in a case fits in an int, so doubles get the same answers, as
+// long as nothing gets divided
+int fuzz_engine_f64(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  (void)cx;
+  struct Formula* f;
+  struct EvalError err;
+  if (memchr(s, '/', n) != NULL || formula_compile_typed(s, n, NULL, 0, &f, &err) != EVAL_OK) {
+    return 0;
+  }
+  *out = (int)f64_vm_run(f->prog, NULL);
+  formula_free(f);
+  return 1;
+}
+
+int fuzz_dag(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  dag_reset(&cx->dag);
+  *out = eval_dag(&cx->dag, parse_dag(&cx->dag, &cx->tb, s, n, NULL, 0), NULL);
+  return 1;
+}
+
+int fuzz_simplify(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  struct SimplifyInfo info;
+  *out = eval_ntree_sc(simplify_ntree(parse_ntree(&cx->arena, &cx->tb, s, n, NULL, 0), &info), NULL);
+  arena_reset(&cx->arena);
+  return 1;
+}
+
+int fuzz_interp(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  return interp_eval(cx->interp, s, n, out) == EVAL_OK;
+}
+
+int fuzz_inc(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  struct IncEval* e = inc_new(0);
+  *out = inc_value(e, inc_add(e, &cx->tb, s, n, NULL));
+  inc_free(e);
+  return 1;
+}
+
+int fuzz_shared_cache(struct FuzzCtx* cx, const char* s, size_t n, int* out) {
+  struct EvalError err;
+  return shared_cache_eval(cx->shared, cx->shared_reader, s, n, out, &err) == EVAL_OK;
+}
+
+// the pipelined stream works on a whole input at once, so this one gets every
+// case in one go: one per line, through a file
+void fuzz_stream(struct FuzzCtx* cx, char** exprs, size_t n, int* out, int* ok) {
+  (void)cx;
+  struct StrBuf input = { NULL, 0, 0 };
+  for (size_t i = 0; i < n; i++) {
+    strbuf_append(&input, exprs[i], strlen(exprs[i]));
+    strbuf_append(&input, "\n", 1);
+  }
+  char* output = stream_through_files(n > 0 ? input.s : "", 0, stream_eval4);
+  char* line = output;
+  for (size_t i = 0; i < n; i++) {
+    char* end = strchr(line, '\n');
+    ok[i] = end != NULL && strncmp(line, "error", 5) != 0;
+    if (ok[i]) {
+      out[i] = (int)strtol(line, NULL, 10);
+    }
+    line = end != NULL ? end + 1 : line;
+  }
+  free(output);
+  free(input.s);
+}
+
+struct FuzzBackend {
+  const char* name;
+  int (*run)(struct FuzzCtx*, const char*, size_t, int*);
+  // for backends that want every case at once instead (run is NULL then)
+  void (*run_all)(struct FuzzCtx*, char**, size_t, int*, int*);
+  int may_decline;
+};
+
+struct FuzzBackend FUZZ_BACKENDS[] = {
+  { "eval_string_in", fuzz_arena, NULL, 0 },
+  { "eval_string_flat", fuzz_flat, NULL, 0 },
+  { "eval_string_iterative", fuzz_iterative, NULL, 0 },
+  // parser_parse7
+  { "eval_string_n2", fuzz_tokenizer2, NULL, 0 },
+  // parser_parse8
+  { "eval_string_n3", fuzz_token_buffer, NULL, 0 },
+  { "eval_string_checked", fuzz_checked, NULL, 0 },
+  { "vm_run", fuzz_vm, NULL, 0 },
+  { "vm_run_folded", fuzz_vm_folded, NULL, 0 },
+  { "vm_run2", fuzz_vm2, NULL, 0 },
+  { "formula_eval_columns", fuzz_columns, NULL, 0 },
+  { "jit", fuzz_jit, NULL, 1 },
+  { "vm_run_checked", fuzz_checked_vm32, NULL, 0 },
+  { "vm_run_checked64", fuzz_checked_vm, NULL, 0 },
+  { "library_eval", fuzz_library, NULL, 0 },
+  { "i32_vm_run", fuzz_engine_i32, NULL, 0 },
+  { "i32_eval_ntree", fuzz_engine_i32_tree, NULL, 0 },
+  { "i64_vm_run", fuzz_engine_i64, NULL, 0 },
+  { "f64_vm_run", fuzz_engine_f64, NULL, 1 },
+  { "eval_dag", fuzz_dag, NULL, 0 },
+  { "inc_value", fuzz_inc, NULL, 0 },
+  { "eval_ntree_sc", fuzz_simplify, NULL, 0 },
+  { "interp_eval", fuzz_interp, NULL, 0 },
+  { "shared_cache_eval", fuzz_shared_cache, NULL, 0 },
+  { "stream_eval4", NULL, fuzz_stream, 0 },
+};
+
+#define FUZZ_NBACKENDS (sizeof FUZZ_BACKENDS / sizeof FUZZ_BACKENDS[0])
+
+uint32_t fuzz_rand(uint64_t* seed) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t)(*seed >> 33);
+}
+
+// append a random expression to sb, and return its value
+int64_t fuzz_gen(struct StrBuf* sb, uint64_t* seed, int depth) {
+  uint32_t r = fuzz_rand(seed);
+  if (depth == 0 || r % 4 == 0) {
+    // mostly small numbers, so products don't overflow right away
+    int x = r % 8 == 1 ? (int)(fuzz_rand(seed) % 100000) : (int)((r >> 3) % 20);
+    strbuf_int(sb, x);
+    return x;
+  }
+  size_t start = sb->n;
+  strbuf_append(sb, "(? ", 3);
+  int64_t left = fuzz_gen(sb, seed, depth - 1);
+  strbuf_append(sb, " ", 1);
+  int64_t right = fuzz_gen(sb, seed, depth - 1);
+  strbuf_append(sb, ")", 1);
+
+  // pick an operator that keeps the value in range, starting from a random one
+  const char* ops = "+-*/";
+  uint32_t k = fuzz_rand(seed) % 4;
+  for (int tries = 0; tries < 4; tries++, k = (k + 1) % 4) {
+    int64_t x;
+    if (ops[k] == '+') {
+      x = left + right;
+    } else if (ops[k] == '-') {
+      x = left - right;
+    } else if (ops[k] == '*') {
+      x = left * right;
+    } else if (right == 0 || (left == INT_MIN && right == -1)) {
+      continue;
+    } else {
+      x = left / right;
+    }
+    if (x >= INT_MIN && x <= INT_MAX) {
+      sb->s[start + 1] = ops[k];
+      return x;
+    }
+  }
+  // not reachable: with a divisor of 0, + fits, and otherwise / does (apart
+  // from INT_MIN / -1, where - does)
+  sb->s[start + 1] = '-';
+  return left - right;
+}
+
+struct FuzzResult {
+  size_t cases;
+  size_t mismatches;
+  // cases declined by backends that aren't allowed to
+  size_t bad_declines;
+  // per backend, how many cases it declined, and the best expressions/second
+  size_t declined[FUZZ_NBACKENDS];
+  double rate[FUZZ_NBACKENDS];
+};
+
+// generate n expressions and run them through every backend. mismatches and
+// declines that aren't allowed are printed (the first few) and counted.
+struct FuzzResult fuzz_run(size_t n, uint64_t seed, int depth, int reps, int verbose) {
+  struct FuzzResult res;
+  memset(&res, 0, sizeof res);
+  res.cases = n;
+  char** exprs = malloc(n * sizeof *exprs);
+  size_t* lens = malloc(n * sizeof *lens);
+  int* want = malloc(n * sizeof *want);
+  for (size_t i = 0; i < n; i++) {
+    struct StrBuf sb = { NULL, 0, 0 };
+    int64_t x = fuzz_gen(&sb, &seed, depth);
+    exprs[i] = sb.s;
+    lens[i] = sb.n;
+    want[i] = fuzz_oracle(sb.s);
+    if (want[i] != x) {
+      // the generator and the oracle disagree, which means a bug in one of them
+      if (verbose && res.mismatches < 10) {
+        printf("MISMATCH oracle: %s: got %d, want %ld\n", sb.s, want[i], (long)x);
+      }
+      res.mismatches++;
+    }
+  }
+
+  struct FuzzCtx cx;
+  cx.arena = arena_init();
+  cx.tb = token_buffer_init();
+  cx.dag = dag_init();
+  cx.interp = interp_new(0);
+  cx.cs = column_scratch_init();
+  cx.shared = shared_cache_new(1024);
+  // the cache is new, so this can't run out of slots. if it somehow did, the
+  // shared cache would turn every case away, and they'd all count as bad
+  // declines.
+  cx.shared_reader = shared_cache_reader_new(cx.shared);
+  if (cx.shared_reader < 0 && verbose) {
+    printf("no reader slot for the shared cache\n");
+  }
+  cx.library = tmpfile();
+  int* got = calloc(n > 0 ? n : 1, sizeof *got);
+  int* ok = calloc(n > 0 ? n : 1, sizeof *ok);
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    struct FuzzBackend* be = &FUZZ_BACKENDS[b];
+    uint64_t best = UINT64_MAX;
+    for (int rep = 0; rep < reps; rep++) {
+      uint64_t t0 = now_ns();
+      if (be->run_all != NULL) {
+        be->run_all(&cx, exprs, n, got, ok);
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          ok[i] = be->run(&cx, exprs[i], lens[i], &got[i]);
+        }
+      }
+      uint64_t dt = now_ns() - t0;
+      best = dt < best ? dt : best;
+      if (rep > 0) {
+        continue;
+      }
+      for (size_t i = 0; i < n; i++) {
+        if (!ok[i]) {
+          res.declined[b]++;
+          if (!be->may_decline) {
+            if (verbose && res.bad_declines < 10) {
+              printf("DECLINED %s: %s\n", be->name, exprs[i]);
+            }
+            res.bad_declines++;
+          }
+        } else if (got[i] != want[i]) {
+          if (verbose && res.mismatches < 10) {
+            printf("MISMATCH %s: %s: got %d, want %d\n", be->name, exprs[i], got[i], want[i]);
+          }
+          res.mismatches++;
+        }
+      }
+    }
+    res.rate[b] = best == 0 ? 0 : n * 1e9 / best;
+  }
+  free(got);
+  free(ok);
+  fclose(cx.library);
+  shared_cache_reader_free(cx.shared, cx.shared_reader);
+  shared_cache_free(cx.shared);
+  interp_free(cx.interp);
+  column_scratch_free(&cx.cs);
+  dag_free(&cx.dag);
+  token_buffer_free(&cx.tb);
+  arena_free(&cx.arena);
+  for (size_t i = 0; i < n; i++) {
+    free(exprs[i]);
+  }
+  free(exprs);
+  free(lens);
+  free(want);
+  return res;
+}
+
+// the baseline file has one "name rate" line per backend. returns the rate for
+// each backend via rates (0 if it isn't in the file), or -1 if the file can't be
+// read.
+int fuzz_read_baseline(const char* path, double* rates) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    rates[b] = 0;
+  }
+  char name[128];
+  double rate;
+  while (fscanf(f, "%127s %lf", name, &rate) == 2) {
+    for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+      if (strcmp(name, FUZZ_BACKENDS[b].name) == 0) {
+        rates[b] = rate;
+      }
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+int fuzz_write_baseline(const char* path, const struct FuzzResult* res) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    fprintf(f, "%s %.0f\n", FUZZ_BACKENDS[b].name, res->rate[b]);
+  }
+  return fclose(f);
+}
+
+// how many backends are slower than the baseline by more than threshold percent.
+// backends missing from the baseline are skipped.
+int fuzz_regressions(const struct FuzzResult* res, const double* baseline, double threshold, int verbose) {
+  int n = 0;
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    if (baseline[b] <= 0 || res->declined[b] == res->cases) {
+      continue;
+    }
+    double change = (res->rate[b] - baseline[b]) / baseline[b] * 100;
+    if (change < -threshold) {
+      n++;
+      if (verbose) {
+        printf("REGRESSION %s: %.0f/s vs %.0f/s in the baseline (%.1f%%)\n", FUZZ_BACKENDS[b].name,
+               res->rate[b], baseline[b], change);
+      }
+    }
+  }
+  return n;
+}
+
+int run_fuzz(int argc, char** argv) {
+  size_t n = 2000;
+  uint64_t seed = 1;
+  int depth = 8;
+  const char* baseline_path = NULL;
+  int update = 0;
+  double threshold = 20;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+      depth = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--update-baseline") == 0) {
+      update = 1;
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = strtod(argv[++i], NULL);
+    } else if (argv[i][0] != '-') {
+      n = strtoul(argv[i], NULL, 10);
+    } else {
+      fprintf(stderr, "usage: %s --fuzz [N] [--seed S] [--depth D] [--baseline FILE] [--update-baseline] "
+                      "[--threshold PERCENT]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (depth < 0 || depth > 30) {
+    depth = 8;
+  }
+
+  struct FuzzResult res = fuzz_run(n, seed, depth, 3, 1);
+  double baseline[FUZZ_NBACKENDS];
+  int have_baseline = baseline_path != NULL && !update && fuzz_read_baseline(baseline_path, baseline) == 0;
+  printf("%-22s %12s %12s %9s\n", "backend", "exprs/s", "baseline", "declined");
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    printf("%-22s %12.0f %12.0f %9zu\n", FUZZ_BACKENDS[b].name, res.rate[b], have_baseline ? baseline[b] : 0.0,
+           res.declined[b]);
+  }
+  printf("%zu cases, %zu mismatches, %zu declined that shouldn't have been\n", res.cases, res.mismatches,
+         res.bad_declines);
+
+  int status = res.mismatches > 0 || res.bad_declines > 0;
+  if (baseline_path != NULL && (update || !have_baseline)) {
+    if (fuzz_write_baseline(baseline_path, &res) != 0) {
+      fprintf(stderr, "could not write %s: %s\n", baseline_path, strerror(errno));
+      return 1;
+    }
+    printf("wrote the baseline to %s\n", baseline_path);
+  } else if (have_baseline && fuzz_regressions(&res, baseline, threshold, 1) > 0) {
+    status = 1;
+  }
+  return status;
+}
+
+void test_fuzz1() {
+  struct FuzzResult res = fuzz_run(300, 7, 6, 1, 1);
+  assert_int_eq2(res.mismatches, 0);
+  assert_int_eq2(res.bad_declines, 0);
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    if (!FUZZ_BACKENDS[b].may_decline) {
+      assert_int_eq2(res.declined[b], 0);
+    }
+  }
+#ifdef __x86_64__
+  // the JIT does exist here, and the cases aren't deep enough for it to refuse
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    if (strcmp(FUZZ_BACKENDS[b].name, "jit") == 0) {
+      assert_int_eq2(res.declined[b], 0);
+    }
+  }
+#endif
+
+  // a baseline with made-up rates, half and double the real ones
+  FILE* f = tmpfile();
+  char path[64];
+  snprintf(path, sizeof path, "/proc/self/fd/%d", fileno(f));
+  struct FuzzResult fake = res;
+  double baseline[FUZZ_NBACKENDS];
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    fake.rate[b] = res.rate[b] / 2;
+  }
+  assert_int_eq2(fuzz_write_baseline(path, &fake), 0);
+  assert_int_eq2(fuzz_read_baseline(path, baseline), 0);
+  assert_int_eq2(fuzz_regressions(&res, baseline, 20, 0), 0);
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    fake.rate[b] = res.rate[b] * 2;
+  }
+  fuzz_write_baseline(path, &fake);
+  fuzz_read_baseline(path, baseline);
+  int expected = 0;
+  for (size_t b = 0; b < FUZZ_NBACKENDS; b++) {
+    expected += res.declined[b] != res.cases;
+  }
+  assert_int_eq2(fuzz_regressions(&res, baseline, 20, 0), expected);
+  fclose(f);
+}
+
+__attribute__((constructor(101))) void register_fuzz() {
+  register_command("--fuzz", run_fuzz);
+  register_test("test_fuzz1", test_fuzz1);
+}